@@ -35,6 +35,11 @@ public:
     }
 
     bool hit(const ray& r, interval rayIntrvl) const{
+        return clip(r, rayIntrvl);
+    }
+
+    // Same as hit, but narrows rayIntrvl down to the part of the ray inside the box
+    bool clip(const ray& r, interval& rayIntrvl) const{
         const vec3   rayDir = r.direction();
         const point3 rayPos = r.origin();
     
@@ -26,7 +26,12 @@ public:
     bool hit(const ray& r, interval t_int, hit_record& hr) const override {
         T obj_at_time = T(default_obj);
         animate_to(r.time(), obj_at_time);
-        return obj_at_time.hit(r, t_int, hr);
+        if(!obj_at_time.hit(r, t_int, hr)) return false;
+
+        // The animated copy does not outlive this call, resolve the surface right away
+        obj_at_time.surface_interaction(r, hr);
+        hr.obj = this;
+        return true;
     }
 
     aabb bounding_box() const override {
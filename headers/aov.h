@@ -0,0 +1,102 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include "common.h"
+
+#include <vector>
+#include <string>
+#include <fstream>
+
+// First hit data of one camera sample, filled by camera::ray_color
+struct aov_sample {
+    bool hit = false;
+    color albedo = color(1,1,1);    // scatter attenuation, 1 for lights and the skybox
+    vec3 normal;                    // shading normal, zero when the ray escaped
+    double depth = 0;               // distance to the first hit, 0 when the ray escaped
+};
+
+// Per pixel auxiliary buffers, averaged over the samples of each pixel
+class aov_buffers {
+public:
+    int width = 0, height = 0;
+    std::vector<color> albedo;
+    std::vector<vec3> normal;
+    std::vector<double> depth;
+    std::vector<double> variance;   // variance of the pixel mean's luminance
+
+    void resize(int w, int h){
+        width = w; height = h;
+        size_t n = size_t(w)*h;
+        albedo.assign(n, color(0,0,0));
+        normal.assign(n, vec3(0,0,0));
+        depth.assign(n, 0.0);
+        variance.assign(n, 0.0);
+    }
+
+    // Writes albedo, normal, depth and variance as <prefix>_<name>.pfm, returns false if a file can't be written
+    bool write(const std::string& prefix) const {
+        std::vector<color> scalar(depth.size());
+        bool ok = write_pfm(prefix + "_albedo.pfm", albedo);
+        ok = write_pfm(prefix + "_normal.pfm", normal) && ok;
+        for(size_t i = 0; i < depth.size(); i++) scalar[i] = color(depth[i], depth[i], depth[i]);
+        ok = write_pfm(prefix + "_depth.pfm", scalar) && ok;
+        for(size_t i = 0; i < variance.size(); i++) scalar[i] = color(variance[i], variance[i], variance[i]);
+        ok = write_pfm(prefix + "_variance.pfm", scalar) && ok;
+        return ok;
+    }
+
+    // Appends the buffers of the pixels [x0,x1) x [y0,y1) to out as floats, packed_size values
+    void pack_region(int x0, int y0, int x1, int y1, std::vector<float>& out) const {
+        for(int y = y0; y < y1; y++){
+            for(int x = x0; x < x1; x++){
+                size_t i = size_t(y)*width + x;
+                out.push_back(float(albedo[i].x())); out.push_back(float(albedo[i].y())); out.push_back(float(albedo[i].z()));
+                out.push_back(float(normal[i].x())); out.push_back(float(normal[i].y())); out.push_back(float(normal[i].z()));
+                out.push_back(float(depth[i]));
+                out.push_back(float(variance[i]));
+            }
+        }
+    }
+
+    static size_t packed_size(int x0, int y0, int x1, int y1){
+        return size_t(8)*(x1 - x0)*(y1 - y0);
+    }
+
+    void unpack_region(int x0, int y0, int x1, int y1, const float* data){
+        for(int y = y0; y < y1; y++){
+            for(int x = x0; x < x1; x++, data += 8){
+                size_t i = size_t(y)*width + x;
+                albedo[i] = color(data[0], data[1], data[2]);
+                normal[i] = vec3(data[3], data[4], data[5]);
+                depth[i] = data[6];
+                variance[i] = data[7];
+            }
+        }
+    }
+
+    static double luminance(const color& c){
+        return 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+    }
+
+private:
+    // Portable float map, rows are stored bottom to top
+    bool write_pfm(const std::string& path, const std::vector<color>& buf) const {
+        std::ofstream out(path, std::ios::binary);
+        if(!out){
+            std::clog << "Could not write AOV file " << path << std::endl;
+            return false;
+        }
+        out << "PF\n" << width << " " << height << "\n-1.0\n";
+        std::vector<float> row(size_t(width)*3);
+        for(int y = height-1; y >= 0; y--){
+            for(int x = 0; x < width; x++){
+                const color& c = buf[size_t(y)*width + x];
+                row[3*x] = float(c.x()); row[3*x+1] = float(c.y()); row[3*x+2] = float(c.z());
+            }
+            out.write(reinterpret_cast<const char*>(row.data()), row.size()*sizeof(float));
+        }
+        return bool(out);
+    }
+};
+
+#endif
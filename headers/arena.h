@@ -0,0 +1,141 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "common.h"
+#include "material_table.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <memory>
+#include <iostream>
+
+enum class arena_subsystem { geometry, materials, textures, acceleration, count };
+
+// Owns the objects of a scene, bump allocated in large blocks and all freed together with the
+// arena. Objects are handed out as shared_ptrs that point into the arena without owning anything:
+// they plug into the shared_ptr based interfaces, copying them costs no reference count update,
+// and the arena must outlive them, scene keeps it alongside the objects. Materials are registered
+// in the arena's material_table as they are allocated, primitives reference them by index. The
+// table is handed out sharing ownership of the arena, so a camera holding it keeps the scene's
+// objects alive, arenas are always created with make_shared for that.
+// Allocation isn't thread safe, scenes are built by a single thread.
+class scene_arena : public std::enable_shared_from_this<scene_arena> {
+public:
+    scene_arena(size_t blockSize = size_t(1) << 20): blockSize(blockSize) {}
+
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+
+    ~scene_arena(){
+        for(size_t i = objects.size(); i-- > 0;)
+            objects[i].destroy(objects[i].ptr);
+        for(block& b : blocks)
+            std::free(b.data);
+    }
+
+    template<typename T, typename... Args>
+    shared_ptr<T> make(arena_subsystem s, Args&&... args){
+        T* obj = new(allocate(sizeof(T), alignof(T), s)) T(std::forward<Args>(args)...);
+        if(!std::is_trivially_destructible<T>::value)
+            objects.push_back({obj, [](void* p){ static_cast<T*>(p)->~T(); }});
+        counts[int(s)]++;
+        return shared_ptr<T>(shared_ptr<T>(), obj);
+    }
+
+    template<typename T, typename... Args>
+    shared_ptr<T> geometry(Args&&... args){
+        return make<T>(arena_subsystem::geometry, std::forward<Args>(args)...);
+    }
+
+    // Index of the new material in materials()
+    template<typename T, typename... Args>
+    uint32_t material(Args&&... args){
+        return materialTable.add(make<T>(arena_subsystem::materials, std::forward<Args>(args)...).get());
+    }
+
+    shared_ptr<const material_table> materials() const {
+        return shared_ptr<const material_table>(shared_from_this(), &materialTable);
+    }
+
+    template<typename T, typename... Args>
+    shared_ptr<T> texture(Args&&... args){
+        return make<T>(arena_subsystem::textures, std::forward<Args>(args)...);
+    }
+
+    template<typename T, typename... Args>
+    shared_ptr<T> acceleration(Args&&... args){
+        return make<T>(arena_subsystem::acceleration, std::forward<Args>(args)...);
+    }
+
+    // Raw memory for bytes aligned on align, charged to subsystem s
+    void* allocate(size_t bytes, size_t align, arena_subsystem s){
+        if(blocks.empty() || !fits(blocks.back(), bytes, align)){
+            size_t size = std::max(blockSize, bytes + align);
+            char* data = static_cast<char*>(std::malloc(size));
+            if(data == nullptr) throw std::bad_alloc();
+            blocks.push_back({data, size, 0});
+            reserved += size;
+        }
+        block& b = blocks.back();
+        size_t start = align_up(b, align);
+        b.used = start + bytes;
+        used[int(s)] += bytes;
+        return b.data + start;
+    }
+
+    size_t bytes_used(arena_subsystem s) const {
+        return used[int(s)];
+    }
+
+    size_t object_count(arena_subsystem s) const {
+        return counts[int(s)];
+    }
+
+    size_t bytes_reserved() const {
+        return reserved;
+    }
+
+    // Bytes and objects of each subsystem, the part of the blocks left unused is the difference
+    void report(std::ostream& out = std::clog) const {
+        static const char* names[int(arena_subsystem::count)] = {"geometry", "materials", "textures", "acceleration"};
+        out << "Scene arena, " << blocks.size() << " blocks, " << reserved << " bytes reserved" << std::endl;
+        for(int s = 0; s < int(arena_subsystem::count); s++)
+            out << "  " << names[s] << ": " << counts[s] << " objects, " << used[s] << " bytes" << std::endl;
+    }
+
+private:
+    struct block {
+        char* data;
+        size_t size, used;
+    };
+
+    struct owned_object {
+        void* ptr;
+        void (*destroy)(void*);
+    };
+
+    size_t blockSize;
+    std::vector<block> blocks;
+    std::vector<owned_object> objects;  // non trivially destructible objects, destroyed in reverse order
+    size_t used[int(arena_subsystem::count)] = {};
+    size_t counts[int(arena_subsystem::count)] = {};
+    size_t reserved = 0;
+    material_table materialTable;
+
+    static size_t align_up(const block& b, size_t align){
+        uintptr_t p = uintptr_t(b.data + b.used);
+        return b.used + ((align - p % align) % align);
+    }
+
+    static bool fits(const block& b, size_t bytes, size_t align){
+        return align_up(b, align) + bytes <= b.size;
+    }
+};
+
+#endif
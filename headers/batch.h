@@ -0,0 +1,158 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "common.h"
+#include "hittable.h"
+#include "camera.h"
+#include "film.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <algorithm>
+
+// One view of a batch, written as a PPM to outPath
+struct batch_frame {
+    camera cam;
+    std::string outPath;
+};
+
+// Renders several views of one scene, committed once. The tiles of all the frames go through a
+// single queue so no thread idles while the last tiles of a frame finish. A frame's film is
+// allocated when its first tile starts and written and freed when its last tile is merged, so
+// only the few frames in flight are held in memory.
+// Frames whose integrator renders in passes (integrator::pass_samples) are rendered in rounds,
+// the n-th pass of every such frame in round n. Their films are kept from the first round to
+// their last pass.
+// Returns false if some output couldn't be written.
+inline bool render_batch(hittable& world, shared_ptr<hittable> lights, std::vector<batch_frame>& frames){
+    world.commit_transform();
+
+    // passStarts[f] holds the first sample of each pass of frame f, then its sample count
+    int n = int(frames.size());
+    std::vector<std::vector<int>> passStarts(n);
+    size_t rounds = 0;
+    int total = 0;
+    for(int f = 0; f < n; f++){
+        camera& cam = frames[f].cam;
+        if(cam.pixelSampler != nullptr)
+            cam.pixelSampler = cam.pixelSampler->clone(); // frames may differ in resolution or samples
+        if(cam.radianceIntegrator != nullptr)
+            cam.radianceIntegrator = cam.radianceIntegrator->clone();
+        cam.initialize();
+        for(int done = 0; done < cam.samplesPerPixel;){
+            passStarts[f].push_back(done);
+            int k = cam.radianceIntegrator != nullptr ? cam.radianceIntegrator->pass_samples(done) : 0;
+            done += k > 0 ? std::min(k, cam.samplesPerPixel - done) : cam.samplesPerPixel - done;
+        }
+        passStarts[f].push_back(cam.samplesPerPixel);
+        rounds = std::max(rounds, passStarts[f].size() - 1);
+        total += cam.tile_count()*int(passStarts[f].size() - 1);
+    }
+
+    struct frame_state {
+        std::unique_ptr<film> flm;
+        int tilesLeft = 0;
+    };
+    std::vector<frame_state> state(n);
+    if(n > 0 && frames[0].cam.pinThreads)
+        numa::pin_omp_threads();
+    std::mutex stateMutex;
+    int tilesDone = 0, framesDone = 0;
+    bool ok = true;
+
+    for(size_t round = 0; round < rounds; round++){
+        // Tiles [first[f], first[f+1]) of the round's queue belong to frame f
+        std::vector<int> first(n + 1, 0);
+        for(int f = 0; f < n; f++)
+            first[f+1] = first[f] + (round + 1 < passStarts[f].size() ? frames[f].cam.tile_count() : 0);
+
+        // Integrators are prepared from here rather than from the tiles, so their own parallel
+        // loops (shooting photons) have all the threads
+        for(int f = 0; f < n; f++){
+            camera& cam = frames[f].cam;
+            if(cam.radianceIntegrator == nullptr || first[f+1] == first[f]) continue;
+            if(round == 0){
+                cam.begin_render();
+                state[f].flm = std::make_unique<film>(cam.imgWidth, cam.image_height(), cam.pixelFilter);
+                state[f].tilesLeft = cam.tile_count()*int(passStarts[f].size() - 1);
+            }
+            cam.radianceIntegrator->prepare(world, lights, cam, passStarts[f][round], passStarts[f][round+1] - passStarts[f][round]);
+            if(cam.radianceIntegrator->splats())
+                state[f].flm->enable_splats();
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int g = 0; g < first.back(); g++){
+            int f = int(std::upper_bound(first.begin(), first.end(), g) - first.begin()) - 1;
+            camera& cam = frames[f].cam;
+            film* flm;
+            {
+                std::lock_guard<std::mutex> lock(stateMutex);
+                if(state[f].flm == nullptr){
+                    cam.begin_render();
+                    state[f].flm = std::make_unique<film>(cam.imgWidth, cam.image_height(), cam.pixelFilter);
+                    state[f].tilesLeft = cam.tile_count();
+                }
+                flm = state[f].flm.get();
+            }
+
+            int x0, y0, x1, y1;
+            cam.tile_bounds(g - first[f], x0, y0, x1, y1);
+            film_tile tile = flm->make_tile(x0, y0, x1, y1);
+            shared_ptr<sampler> smp = cam.pixelSampler->clone();
+            cam.render_tile(world, lights, tile, x0, y0, x1, y1, *smp, passStarts[f][round], passStarts[f][round+1] - passStarts[f][round]);
+            flm->merge_tile(tile);
+
+            bool last;
+            {
+                std::lock_guard<std::mutex> lock(stateMutex);
+                last = --state[f].tilesLeft == 0;
+                tilesDone++;
+                framesDone += last;
+                std::clog << "\rFrames " << framesDone << "/" << n << ", tiles " << tilesDone << "/" << total
+                          << " (" << int(100.0*tilesDone/total) << "%)       " << std::flush;
+            }
+
+            // Only the thread merging the last tile touches the frame from here
+            if(last){
+                std::ofstream out(frames[f].outPath);
+                if(out) cam.end_render(*flm, out);
+                if(!out){
+                    std::clog << std::endl << "Could not write frame " << f << " to " << frames[f].outPath << std::endl;
+                    std::lock_guard<std::mutex> lock(stateMutex);
+                    ok = false;
+                }
+                state[f].flm.reset();
+                cam.aovs = aov_buffers();
+            }
+        }
+    }
+    std::clog << std::endl;
+    return ok;
+}
+
+// count frames of a full turn of base around the vup axis through its lookat point. pathPattern is
+// a printf pattern given the frame number, like "turntable_%03d.ppm".
+inline std::vector<batch_frame> turntable(const camera& base, int count, const std::string& pathPattern){
+    std::vector<batch_frame> frames(count, batch_frame{base, ""});
+    vec3 k = base.vup.normalized();
+    vec3 offset = base.lookfrom - base.lookat;
+    for(int f = 0; f < count; f++){
+        // Rodrigues' rotation of the offset around k
+        double theta = 2*PI*f/count, c = std::cos(theta), s = std::sin(theta);
+        vec3 rotated = offset*c + cross(k, offset)*s + k*dot(k, offset)*(1 - c);
+        frames[f].cam.lookfrom = base.lookat + rotated;
+
+        char path[1024];
+        std::snprintf(path, sizeof(path), pathPattern.c_str(), f);
+        frames[f].outPath = path;
+        if(!base.aovPrefix.empty())
+            frames[f].cam.aovPrefix = base.aovPrefix + "_" + std::to_string(f);
+    }
+    return frames;
+}
+
+#endif
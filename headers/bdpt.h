@@ -0,0 +1,363 @@
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "common.h"
+#include "hittable.h"
+#include "material.h"
+#include "material_table.h"
+#include "camera.h"
+#include "integrator.h"
+#include "emitters.h"
+
+#include <vector>
+#include <algorithm>
+
+// Bidirectional path tracing (Veach 1997, laid out as in pbrt v3). Every camera sample traces a
+// camera subpath and a light subpath leaving an emissive surface, and connects every prefix of
+// one to every prefix of the other. Each connection is one strategy to sample a path of its
+// length, weighted with the power heuristic over all the strategies that could have sampled the
+// same path. Caustics, which the path tracer only finds by hitting the light by chance, come
+// from the light tracing strategy (a light subpath connected to the lens), splatted into the film.
+//
+// Light subpaths start from the emitter_set of the world, the lights hittable of the scene isn't
+// used. Emitters out of the set, and the skybox, are only found by the camera subpaths hitting them.
+// Scattering is evaluated through material::scatter, so only materials with a symmetric
+// scatter pdf (all of them but the specular ones, which are never connected) are supported.
+
+struct bdpt_vertex {
+    enum vertex_kind : uint8_t { camera_vertex, light_vertex, surface_vertex, medium_vertex };
+
+    vertex_kind kind = surface_vertex;
+    hit_record hr;                  // position, normal and material, the outward normal for lights
+    color beta;                     // throughput of the subpath up to the vertex
+    bool delta = false;             // specular scattering, the vertex can't be connected
+    double pdfFwd = 0, pdfRev = 0;  // area densities of sampling the vertex from either side of the path
+
+    const point3& p() const {
+        return hr.p;
+    }
+
+    bool on_surface() const {
+        return kind == surface_vertex || kind == light_vertex;
+    }
+};
+
+class bdpt_integrator : public integrator {
+public:
+    void prepare(const hittable& world, shared_ptr<hittable> lights, const camera& cam, int firstSample, int sampleCount) override {
+        materials = cam.materials.get();
+        emitters.build(world, *materials);
+    }
+
+    bool splats() const override {
+        return true;
+    }
+
+    color radiance(const ray& r, const hittable& world, shared_ptr<hittable> lights, const camera& cam,
+                   sampler& smp, film_tile& tile, aov_sample* aov) override {
+        thread_local std::vector<bdpt_vertex> camPath, lightPath;
+        int maxDepth = std::max(0, cam.maxRayBounce);
+        camPath.resize(maxDepth + 2);
+        lightPath.resize(maxDepth + 1);
+
+        color L(0,0,0);
+        int nCam = camera_subpath(r, world, cam, smp, camPath, L, aov);
+        int nLight = light_subpath(world, cam, smp, r.time(), lightPath);
+
+        // s light vertices and t camera vertices, t = 1 connects to a new point on the lens
+        for(int t = 1; t <= nCam; t++){
+            for(int s = 0; s <= nLight; s++){
+                int depth = t + s - 2;
+                if((s == 1 && t == 1) || depth < 0 || depth > maxDepth) continue;
+                double fx, fy;
+                color c = connect(s, t, camPath, lightPath, world, cam, smp, fx, fy);
+                if(t == 1){
+                    if(!c.near_zero()) tile.add_splat(fx, fy, c);
+                } else {
+                    L += c;
+                }
+            }
+        }
+        tile.add_light_path();
+        return L;
+    }
+
+    shared_ptr<integrator> clone() const override {
+        return make_shared<bdpt_integrator>();
+    }
+
+private:
+    emitter_set emitters;
+    const material_table* materials = nullptr;
+
+    // Specular scatterings are the ones the path tracer doesn't sample lights from
+    static bool is_delta(const scatter_rec& sr){
+        return sr.scattered_solid_angle < 0.1;
+    }
+
+    int camera_subpath(const ray& r, const hittable& world, const camera& cam, sampler& smp,
+                       std::vector<bdpt_vertex>& path, color& escaped, aov_sample* aov) const {
+        bdpt_vertex& v = path[0];
+        v.kind = bdpt_vertex::camera_vertex;
+        v.hr.p = r.origin();
+        v.hr.normal = cam.forward();
+        v.beta = color(1,1,1);
+        v.delta = false;
+        v.pdfFwd = v.pdfRev = 0;
+        double pdfDir = cam.direction_pdf(r.direction().normalized());
+        return 1 + random_walk(r, color(1,1,1), pdfDir, world, cam, smp, path, int(path.size()) - 1, &escaped, aov);
+    }
+
+    int light_subpath(const hittable& world, const camera& cam, sampler& smp, double time, std::vector<bdpt_vertex>& path) const {
+        if(path.empty()) return 0;
+        bdpt_vertex& v = path[0];
+        vec3 dir;
+        double pdfPos, pdfDir;
+        if(!emitters.sample_emission(smp, v.hr, dir, pdfPos, pdfDir)) return 0;
+
+        color Le = materials->get(v.hr.mat_id)->emitted(v.hr.u, v.hr.v, v.hr.p);
+        v.kind = bdpt_vertex::light_vertex;
+        v.beta = Le;
+        v.delta = false;
+        v.pdfFwd = pdfPos;
+        v.pdfRev = 0;
+        color beta = Le*std::fabs(dot(dir, v.hr.normal))/(pdfPos*pdfDir);
+        return 1 + random_walk(ray(v.hr.p, dir, time), beta, pdfDir, world, cam, smp, path, int(path.size()) - 1, nullptr, nullptr);
+    }
+
+    // Extends path, whose first vertex is set, by up to maxVertices vertices. r leaves the last
+    // vertex with the solid angle density pdf, beta is the throughput along it. The light of the
+    // camera rays escaping the scene is added to escaped, when given.
+    int random_walk(ray r, color beta, double pdf, const hittable& world, const camera& cam, sampler& smp,
+                    std::vector<bdpt_vertex>& path, int maxVertices, color* escaped, aov_sample* aov) const {
+        int bounces = 0;
+        double pdfFwd = pdf, pdfRev = 0;
+        while(bounces < maxVertices){
+            hit_record hr;
+            if(!world.hit(r, interval(0.001, infinity), hr)){
+                if(escaped != nullptr) *escaped += beta*cam.background(r);
+                break;
+            }
+            hr.obj->surface_interaction(r, hr);
+            hr.compute_differentials(r);
+            const material* mat = materials->get(hr.mat_id);
+
+            bdpt_vertex& v = path[bounces + 1];
+            bdpt_vertex& prev = path[bounces];
+            v.kind = mat->kind() == material_kind::isotropic ? bdpt_vertex::medium_vertex : bdpt_vertex::surface_vertex;
+            v.hr = hr;
+            v.beta = beta;
+            v.delta = false;
+            v.pdfFwd = convert_density(pdfFwd, prev, v);
+            v.pdfRev = 0;
+            bounces++;
+
+            scatter_rec sr;
+            bool scatters = mat->scatter(r, hr, sr);
+            if(aov != nullptr && bounces == 1){
+                aov->hit = true;
+                aov->albedo = scatters ? sr.attenuation : color(1,1,1);
+                aov->normal = hr.normal;
+                aov->depth = hr.t * r.direction().length();
+            }
+            if(!scatters || bounces >= maxVertices) break;
+
+            vec3 wo = -r.direction().normalized();
+            vec3 wi = sr.pdf_ptr->generate(smp);
+            if(wi.near_zero()) break;
+            wi = wi.normalized();
+            if(is_delta(sr)){
+                v.delta = true;
+                pdfFwd = pdfRev = 0;
+            } else {
+                pdfFwd = sr.pdf_ptr->val(wi);
+                if(pdfFwd < EPSILON) break;
+                bsdf(v, wi, wo, &pdfRev);
+            }
+            // f*cos/pdf, the scatter pdf is the density directions are drawn with
+            beta = beta*sr.attenuation;
+            prev.pdfRev = convert_density(pdfRev, v, prev);
+            r = ray(hr.p, wi, r.time());
+        }
+        return bounces;
+    }
+
+    // Scattering function at v for light going between wo and wi (normalized, leaving v), and
+    // the density of sampling wi from wo. Zero for specular scattering and emitters.
+    color bsdf(const bdpt_vertex& v, const vec3& wo, const vec3& wi, double* pdf = nullptr) const {
+        if(pdf != nullptr) *pdf = 0;
+        const material* mat = materials->get(v.hr.mat_id);
+        hit_record hr = v.hr;
+        ray in(hr.p + wo, -wo);
+        if(v.kind == bdpt_vertex::surface_vertex)
+            hr.set_frontface_and_normal(in, hr.front_face ? hr.normal : -hr.normal);
+        scatter_rec sr;
+        if(!mat->scatter(in, hr, sr) || is_delta(sr)) return color(0,0,0);
+        double p = sr.pdf_ptr->val(wi);
+        if(pdf != nullptr) *pdf = p;
+        if(v.kind == bdpt_vertex::medium_vertex) return sr.attenuation*p;
+        double cosine = std::fabs(dot(hr.normal, wi));
+        return cosine < EPSILON ? color(0,0,0) : sr.attenuation*p/cosine;
+    }
+
+    // Solid angle density at from to area density at next
+    static double convert_density(double pdf, const bdpt_vertex& from, const bdpt_vertex& next){
+        vec3 w = next.p() - from.p();
+        double dist2 = w.length_squared();
+        if(dist2 == 0) return 0;
+        if(next.on_surface()) pdf *= std::fabs(dot(next.hr.normal, w/std::sqrt(dist2)));
+        return pdf/dist2;
+    }
+
+    // Area density of the light subpaths starting at the emitter point v, towards the point to
+    double light_origin_pdf(const bdpt_vertex& v, const bdpt_vertex& to) const {
+        if(!emitter_set::emits_towards(v.hr, to.p() - v.p())) return 0;
+        return emitters.pick_pdf(v.hr.obj) / v.hr.obj->get_area();
+    }
+
+    // Area density at to of the directions the emitter point v emits along
+    static double emission_pdf(const bdpt_vertex& v, const bdpt_vertex& to){
+        vec3 w = to.p() - v.p();
+        double dist2 = w.length_squared();
+        if(dist2 == 0) return 0;
+        w /= std::sqrt(dist2);
+        double pdf = emitter_set::direction_pdf(v.hr, w) / dist2;
+        if(to.on_surface()) pdf *= std::fabs(dot(to.hr.normal, w));
+        return pdf;
+    }
+
+    // Area density at next of sampling it from v, reached from prev
+    double vertex_pdf(const bdpt_vertex& v, const bdpt_vertex* prev, const bdpt_vertex& next, const camera& cam) const {
+        if(v.kind == bdpt_vertex::light_vertex) return emission_pdf(v, next);
+        vec3 wn = next.p() - v.p();
+        if(wn.near_zero()) return 0;
+        wn = wn.normalized();
+        double pdf = 0;
+        if(v.kind == bdpt_vertex::camera_vertex) pdf = cam.direction_pdf(wn);
+        else bsdf(v, (prev->p() - v.p()).normalized(), wn, &pdf);
+        return convert_density(pdf, v, next);
+    }
+
+    static bool visible(const hittable& world, const point3& a, const point3& b){
+        vec3 d = b - a;
+        double dist = d.length();
+        hit_record hr;
+        return !world.hit(ray(a, d/dist), interval(0.001, dist - 0.001), hr);
+    }
+
+    // Contribution of the path made of the first s light vertices and t camera vertices. For
+    // t = 1, the film position it lands on is given in (fx, fy).
+    color connect(int s, int t, std::vector<bdpt_vertex>& camPath, std::vector<bdpt_vertex>& lightPath,
+                  const hittable& world, const camera& cam, sampler& smp, double& fx, double& fy) const {
+        color L(0,0,0);
+        bdpt_vertex sampled;
+        if(s == 0){
+            // The camera subpath hit an emitter, on either side as the path tracer counts it
+            const bdpt_vertex& pt = camPath[t-1];
+            if(pt.kind != bdpt_vertex::surface_vertex) return L;
+            const material* mat = materials->get(pt.hr.mat_id);
+            if(mat->kind() != material_kind::emissive) return L;
+            L = pt.beta*mat->emitted(pt.hr.u, pt.hr.v, pt.hr.p);
+        } else if(t == 1){
+            // Light tracing, the light subpath is connected to a point of the lens
+            const bdpt_vertex& qs = lightPath[s-1];
+            if(qs.delta) return L;
+            double su, sv;
+            smp.get_2d(su, sv);
+            point3 lens = cam.sample_defocus_disk(su, sv);
+            double We = cam.importance(lens, qs.p(), fx, fy);
+            if(We == 0) return L;
+            vec3 wi = lens - qs.p();
+            double dist2 = wi.length_squared();
+            wi /= std::sqrt(dist2);
+            sampled.kind = bdpt_vertex::camera_vertex;
+            sampled.hr.p = lens;
+            sampled.hr.normal = cam.forward();
+            double pdf = dist2*cam.lens_pdf()/std::fabs(dot(wi, cam.forward()));
+            sampled.beta = color(We, We, We)/pdf;
+            L = qs.beta*bsdf(qs, (lightPath[s-2].p() - qs.p()).normalized(), wi)*sampled.beta;
+            if(qs.on_surface()) L *= std::fabs(dot(wi, qs.hr.normal));
+            if(L.near_zero() || !visible(world, qs.p(), lens)) return color(0,0,0);
+        } else if(s == 1){
+            // Next event estimation, a new light point is connected to the camera subpath
+            const bdpt_vertex& pt = camPath[t-1];
+            if(pt.delta || emitters.empty()) return L;
+            double lightPdf, su, sv;
+            const hittable* e = emitters.pick(smp.get_1d(), lightPdf);
+            smp.get_2d(su, sv);
+            if(!e->sample_surface(su, sv, sampled.hr)) return L;
+            sampled.kind = bdpt_vertex::light_vertex;
+            vec3 wi = sampled.p() - pt.p();
+            double dist2 = wi.length_squared();
+            if(dist2 == 0 || !emitter_set::emits_towards(sampled.hr, -wi)) return L;
+            wi /= std::sqrt(dist2);
+            sampled.pdfFwd = lightPdf / e->get_area();
+            color Le = materials->get(sampled.hr.mat_id)->emitted(sampled.hr.u, sampled.hr.v, sampled.hr.p);
+            sampled.beta = Le*std::fabs(dot(sampled.hr.normal, wi))/(sampled.pdfFwd*dist2);
+            L = pt.beta*bsdf(pt, (camPath[t-2].p() - pt.p()).normalized(), wi)*sampled.beta;
+            if(pt.on_surface()) L *= std::fabs(dot(wi, pt.hr.normal));
+            if(L.near_zero() || !visible(world, pt.p(), sampled.p())) return color(0,0,0);
+        } else {
+            const bdpt_vertex& qs = lightPath[s-1];
+            const bdpt_vertex& pt = camPath[t-1];
+            if(qs.delta || pt.delta) return L;
+            vec3 w = pt.p() - qs.p();
+            double dist2 = w.length_squared();
+            if(dist2 == 0) return L;
+            w /= std::sqrt(dist2);
+            L = qs.beta*bsdf(qs, (lightPath[s-2].p() - qs.p()).normalized(), w)
+              * bsdf(pt, (camPath[t-2].p() - pt.p()).normalized(), -w)*pt.beta / dist2;
+            if(qs.on_surface()) L *= std::fabs(dot(w, qs.hr.normal));
+            if(pt.on_surface()) L *= std::fabs(dot(w, pt.hr.normal));
+            if(L.near_zero() || !visible(world, qs.p(), pt.p())) return color(0,0,0);
+        }
+        if(L.near_zero()) return L;
+        return L*mis_weight(s, t, camPath, lightPath, sampled, cam);
+    }
+
+    // Power heuristic weight of the (s, t) strategy. The densities of sampling each vertex from
+    // the other side are the subpaths' own, except around the connection where they are
+    // evaluated here. pdf ratios of specular vertices are 0/0 and count as 1, strategies
+    // connecting at them are skipped.
+    double mis_weight(int s, int t, const std::vector<bdpt_vertex>& camPath, const std::vector<bdpt_vertex>& lightPath,
+                      const bdpt_vertex& sampled, const camera& cam) const {
+        if(s + t == 2) return 1;
+        const bdpt_vertex& pt = t == 1 ? sampled : camPath[t-1];
+        const bdpt_vertex* qs = s == 0 ? nullptr : s == 1 ? &sampled : &lightPath[s-1];
+        const bdpt_vertex* ptMinus = t > 1 ? &camPath[t-2] : nullptr;
+        const bdpt_vertex* qsMinus = s > 1 ? &lightPath[s-2] : nullptr;
+
+        double ptRev, ptMinusRev = 0, qsRev = 0, qsMinusRev = 0;
+        if(s > 0){
+            ptRev = vertex_pdf(*qs, qsMinus, pt, cam);
+            if(ptMinus != nullptr) ptMinusRev = vertex_pdf(pt, qs, *ptMinus, cam);
+            qsRev = vertex_pdf(pt, ptMinus, *qs, cam);
+            if(qsMinus != nullptr) qsMinusRev = vertex_pdf(*qs, &pt, *qsMinus, cam);
+        } else {
+            // No light subpath starts at this emitter, or in this direction
+            ptRev = light_origin_pdf(pt, *ptMinus);
+            if(ptRev == 0) return 1;
+            ptMinusRev = emission_pdf(pt, *ptMinus);
+        }
+
+        auto remap0 = [](double f){ return f != 0 ? f : 1.0; };
+        double sumRi = 0, ri = 1;
+        for(int i = t - 1; i > 0; i--){
+            double rev = i == t-1 ? ptRev : i == t-2 ? ptMinusRev : camPath[i].pdfRev;
+            bool delta = i != t-1 && camPath[i].delta;
+            ri *= remap0(rev) / remap0(camPath[i].pdfFwd);
+            if(!delta && !camPath[i-1].delta) sumRi += ri*ri;
+        }
+        ri = 1;
+        for(int i = s - 1; i >= 0; i--){
+            const bdpt_vertex& v = i == s-1 ? *qs : lightPath[i];
+            double rev = i == s-1 ? qsRev : i == s-2 ? qsMinusRev : v.pdfRev;
+            bool delta = i != s-1 && v.delta;
+            ri *= remap0(rev) / remap0(v.pdfFwd);
+            if(!delta && !(i > 0 && lightPath[i-1].delta)) sumRi += ri*ri;
+        }
+        return 1/(1 + sumRi);
+    }
+};
+
+#endif
@@ -3,20 +3,32 @@
 
 #include "transform.h"
 #include "vec3.h"
-#include "hittable_list.h"
-#include "shape2d.h"
+#include "hittable.h"
+#include "material_table.h"
 #include "mat3.h"
 
-class box : public hittable_list, public transform {
+// Oriented box, intersected with a single slab test in its local frame.
+// Faces are indexed 2*axis + side (side 1 is the max face), and keep the
+// uv parametrization the six quads it used to be made of had.
+class box : public hittable, public transform {
 private:
     vec3 &dx= get_basis(0), &dy= get_basis(1), &dz= get_basis(2);
     point3 min, max;
-    shared_ptr<material> mat;
+    uint32_t mat_id;
     bool see_through;
-    
+
+    // Local frame, filled by commit_transform
+    vec3 axis[3];
+    double half[3];
+    double face_area[3]; // area of the two faces orthogonal to each axis
+    aabb bbox;
+
+    // Local axes giving (u,v) on each face, flipped on max faces
+    static constexpr int face_u[6] = {2, 1, 0, 2, 1, 0};
+    static constexpr int face_v[6] = {1, 2, 2, 0, 0, 1};
 
 public:
-    box(const point3& a, const point3& b, shared_ptr<material> mat, bool see_through = false): transform(), mat(mat), see_through(see_through){
+    box(const point3& a, const point3& b, uint32_t mat_id, bool see_through = false): transform(), mat_id(mat_id), see_through(see_through){
 
         // Construct the two opposite vertices with the minimum and maximum coordinates.
         min = point3(std::fmin(a.x(),b.x()), std::fmin(a.y(),b.y()), std::fmin(a.z(),b.z()));
@@ -24,111 +36,181 @@ public:
 
         center = (min+max)/2;
 
-        //dx = get_basis(0); dy = get_basis(1); dz = get_basis(2); 
-
-        //std::clog << "Address of box dx is " << std::addressof(dx[0]) << std::endl;
-
         dx.e[0] = max.x() - min.x();
         dy.e[1] = max.y() - min.y();
         dz.e[2] = max.z() - min.z();
 
-        //build_faces();
+        commit_transform();
     }
 
-    void commit_transform(){
+    void commit_transform() override {
         min = center - (dx + dy + dz)/2;
         max = min + dx + dy + dz;
-        build_faces();
-    }
-
-    void build_faces(){
-        add(make_shared<quad>(min,  dx,  dz, mat, !see_through)); // bottom
-        add(make_shared<quad>(min,  dz,  dy, mat, !see_through)); // left
-        add(make_shared<quad>(min,  dy,  dx, mat, !see_through)); // back
-        add(make_shared<quad>(max, -dx, -dy, mat, !see_through)); // front
-        add(make_shared<quad>(max, -dy, -dz, mat, !see_through)); // right
-        add(make_shared<quad>(max, -dz, -dx, mat, !see_through)); // top
-    }
-
-   double pdf_value(const point3& origin, const vec3& direction) const {
-        //Generate uniformly by surface over all 6 planes
-        
-        
-        std::vector<double> cumsum;
-        double totArea = 0;
-        hittable_list faces;
-        for(auto obj : objs) {
-            if(!obj->is_facing(direction)) continue;
-            faces.add(obj);
-            totArea += obj->get_area();
-        }
-    
 
-        bool hit_smthg = false;
-        hit_record hr;
-
-
-        if(!faces.hit(ray(origin, direction), interval(0.001, infinity), hr)) {
-            return 0;
+        vec3* edges[3] = {&dx, &dy, &dz};
+        for(int i = 0; i < 3; i++){
+            double len = edges[i]->length();
+            axis[i] = *edges[i] / len;
+            half[i] = len/2;
         }
+        face_area[0] = dy.length()*dz.length();
+        face_area[1] = dx.length()*dz.length();
+        face_area[2] = dx.length()*dy.length();
+
+        bbox = aabb(min, max);
+        for(int c = 1; c < 7; c++){
+            point3 corner = min + ((c&1) ? dx : vec3()) + ((c&2) ? dy : vec3()) + ((c&4) ? dz : vec3());
+            bbox = aabb(bbox, aabb(corner, corner));
+        }
+    }
 
-        shared_ptr<hittable> hit_obj;
-        for(auto obj: faces.objs){
-            if(obj == hr.target){
-                return obj->pdf_value(origin, direction) * obj->get_area() / totArea;
+    bool hit(const ray& r, interval t_int, hit_record& hr) const override {
+        vec3 o = r.origin() - center;
+        double tNear = -infinity, tFar = infinity;
+        int nearFace = 0, farFace = 0;
+
+        for(int i = 0; i < 3; i++){
+            double ol = dot(o, axis[i]);
+            double dl = dot(r.direction(), axis[i]);
+            if(std::fabs(dl) < EPSILON){
+                if(std::fabs(ol) > half[i]) return false;
+                continue;
             }
-                
+            double inv = 1.0/dl;
+            double t0 = (-half[i] - ol)*inv;
+            double t1 = ( half[i] - ol)*inv;
+            // A ray going along +axis enters through the min face and leaves through the max face
+            int f0 = 2*i + (dl < 0), f1 = 2*i + (dl > 0);
+            if(t0 > t1){ std::swap(t0, t1); }
+            if(t0 > tNear){ tNear = t0; nearFace = f0; }
+            if(t1 < tFar){ tFar = t1; farFace = f1; }
+            if(tNear > tFar) return false;
         }
 
-        std::clog << "REACHED UNEXPECTED RETURN IN box.h " << __LINE__ << std::endl;
-        return 0;
+        // Faces are one sided unless see_through, so only entry points count
+        double t; int face;
+        if(t_int.contains(tNear)){
+            t = tNear; face = nearFace;
+        } else if(see_through && t_int.contains(tFar)){
+            t = tFar; face = farFace;
+        } else {
+            return false;
+        }
+
+        point3 pl = o + t*r.direction();
+        hr.t = t;
+        hr.obj = this;
+        hr.prim = face;
+        face_uv(face, pl, hr.u, hr.v);
+        return true;
     }
 
-    double area_facing(const vec3& direction) const { // returns the area projected according to the direction
-        double sum = 0;
-        for(auto obj : objs){
-            if(is_facing(direction))
-                sum += obj->get_area();
-        }
-        return sum;
+    void surface_interaction(const ray& r, hit_record& hr) const override {
+        int a = hr.prim/2, side = hr.prim%2;
+        int ua = face_u[hr.prim], va = face_v[hr.prim];
+        double sign = side ? -1.0 : 1.0;
+
+        hr.p = r.at(hr.t);
+        hr.mat_id = mat_id;
+        hr.dpdu = sign*2*half[ua]*axis[ua];
+        hr.dpdv = sign*2*half[va]*axis[va];
+        hr.curvature = 0;
+        hr.set_frontface_and_normal(r, side ? axis[a] : -axis[a]);
     }
 
-    point3 random_point() const {
-        std::vector<double> cumsum;
-        for(int i = 0; i < objs.size(); i++) {
-            auto obj = objs[i];
-            double obj_area = obj->get_area();
-            if(cumsum.size() == 0) cumsum.push_back(cumsum.back() + obj_area);
-        }
-        double r = randDouble(0, cumsum.back());
-        int index = std::lower_bound(cumsum.begin(), cumsum.end(), r) - cumsum.begin();
+    aabb bounding_box() const override {
+        return bbox;
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        hit_record hr;
+        if(!hit(ray(origin, direction), interval(0.001, infinity), hr)) return 0;
+
+        double visArea = visible_area(origin - center);
+        if(visArea <= 0) return 0;
 
-        return objs[index]->random_point();
+        int a = hr.prim/2;
+        double dist2 = hr.t*hr.t*direction.length_squared();
+        double cosine = std::fabs(dot(direction, axis[a])) / direction.length();
+        return dist2 / (cosine*visArea);
     }
 
-    point3 random_point_towards(const point3& position) const  {
-        vec3 dir = center-position;
-        std::vector<double> cumsum;
-        for(int i = 0; i < objs.size(); i++) {
-            auto obj = objs[i];
-            if(!obj->is_facing(dir)) continue;
-            double obj_area = obj->get_area();
-            if(cumsum.size() == 0) cumsum.push_back(cumsum.back() + obj_area);
-        }
-        double r = randDouble(0, cumsum.back());
-        int index = std::lower_bound(cumsum.begin(), cumsum.end(), r) - cumsum.begin();
+    double get_area() const override {
+        return 2*(face_area[0] + face_area[1] + face_area[2]);
+    }
+
+    bool is_facing(const vec3& dir) const override {
+        return true;
+    }
+
+    point3 random_point() const override {
+        return point_on_face(pick_face(randDouble(0, get_area()), false, vec3()));
+    }
 
-        return objs[index]->random_point();
+    // Uniform by area over the faces seen from position, which is what pdf_value expects
+    point3 random_point_towards(const point3& position) const override {
+        vec3 o = position - center;
+        return point_on_face(pick_face(randDouble(0, visible_area(o)), true, o));
     }
 
     void print(){
-        std::clog << "dx: " << dx << "\ndy: " << dy << "\ndz: " << dz << "\nmin: " << min << "\nmax: " << max << std::endl; 
+        std::clog << "dx: " << dx << "\ndy: " << dy << "\ndz: " << dz << "\nmin: " << min << "\nmax: " << max << std::endl;
+    }
+
+private:
+    void face_uv(int face, const point3& pl, double& u, double& v) const {
+        int ua = face_u[face], va = face_v[face];
+        u = (dot(pl, axis[ua]) + half[ua]) / (2*half[ua]);
+        v = (dot(pl, axis[va]) + half[va]) / (2*half[va]);
+        if(face%2){ u = 1-u; v = 1-v; }
+    }
+
+    // A face is seen from o (relative to the center) when o is on its outer side.
+    // From inside the box every face is seen, but only see_through boxes show them.
+    bool face_visible(int face, const vec3& o, bool inside) const {
+        if(inside) return see_through;
+        double ol = dot(o, axis[face/2]);
+        return face%2 ? ol > half[face/2] : ol < -half[face/2];
+    }
+
+    bool is_inside(const vec3& o) const {
+        for(int i = 0; i < 3; i++)
+            if(std::fabs(dot(o, axis[i])) > half[i]) return false;
+        return true;
+    }
+
+    double visible_area(const vec3& o) const {
+        bool inside = is_inside(o);
+        double sum = 0;
+        for(int f = 0; f < 6; f++)
+            if(face_visible(f, o, inside)) sum += face_area[f/2];
+        return sum;
     }
 
+    // Picks the face the area r falls on, over all faces or only over those seen from o
+    int pick_face(double r, bool visibleOnly, const vec3& o) const {
+        bool inside = visibleOnly && is_inside(o);
+        int last = 0;
+        for(int f = 0; f < 6; f++){
+            if(visibleOnly && !face_visible(f, o, inside)) continue;
+            last = f;
+            r -= face_area[f/2];
+            if(r <= 0) return f;
+        }
+        return last;
+    }
 
+    point3 point_on_face(int face) const {
+        int a = face/2;
+        double sign = face%2 ? 1.0 : -1.0;
+        int ua = face_u[face], va = face_v[face];
+        return center + sign*half[a]*axis[a]
+                      + randDouble(-1,1)*half[ua]*axis[ua]
+                      + randDouble(-1,1)*half[va]*axis[va];
+    }
 
 };
 
 
 
-#endif
\ No newline at end of file
+#endif
@@ -8,6 +8,7 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "arena.h"
 
 
 using std::shared_ptr;
@@ -29,10 +30,10 @@ private:
 
 public:
 
-    // hl not by ref because we want a temporary copy
-    bvh_node(hittable_list hl): bvh_node(hl.objs, 0, hl.objs.size()){}
+    // hl not by ref because we want a temporary copy. The inner nodes are allocated in arena when given.
+    bvh_node(hittable_list hl, scene_arena* arena = nullptr): bvh_node(hl.objs, 0, hl.objs.size(), arena){}
 
-    bvh_node(std::vector<shared_ptr<hittable>>& objs, size_t stt, size_t end){
+    bvh_node(std::vector<shared_ptr<hittable>>& objs, size_t stt, size_t end, scene_arena* arena = nullptr){
         bbox = aabb(interval::empty,interval::empty,interval::empty);
         for (size_t object_index=stt; object_index < end; object_index++)
             bbox = aabb(bbox, objs[object_index]->bounding_box());
@@ -51,15 +52,18 @@ public:
         } else {
             std::sort(objs.begin() + stt, objs.begin() + end, compare_func);
             size_t mid = (stt+end)/2;
-            left = make_shared<bvh_node>(objs, stt, mid);
-            right = make_shared<bvh_node>(objs, mid, end);
+            left = arena ? arena->acceleration<bvh_node>(objs, stt, mid, arena) : make_shared<bvh_node>(objs, stt, mid, arena);
+            right = arena ? arena->acceleration<bvh_node>(objs, mid, end, arena) : make_shared<bvh_node>(objs, mid, end, arena);
         }
         bbox = aabb(left->bounding_box(), right->bounding_box());
         
     }
 
     void commit_transform(){
-        // TODO
+        // Children get committed and the boxes refit, the tree itself is not rebuilt
+        left->commit_transform();
+        if(right != left) right->commit_transform();
+        bbox = aabb(left->bounding_box(), right->bounding_box());
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& hr) const override {
@@ -75,6 +79,11 @@ public:
     }
 
 
+    void collect_emitters(const material_table& materials, std::vector<const hittable*>& out) const override {
+        left->collect_emitters(materials, out);
+        if(right != left) right->collect_emitters(materials, out);
+    }
+
     aabb bounding_box() const override {
         return bbox;
     }
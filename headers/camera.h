@@ -5,14 +5,21 @@
 #include "common.h"
 #include "texture.h"
 #include "pdf.h"
+#include "material_table.h"
+#include "sampler.h"
+#include "post_process.h"
+#include "aov.h"
+#include "denoiser.h"
+#include "film.h"
+#include "numa.h"
+#include "guiding.h"
+#include "integrator.h"
 
 #include <memory>
+#include <vector>
+#include <string>
 
 class camera{
-private:
-
-    double color_clamp_val;
-
 public:
 
     double aspectRatio = 1.0;
@@ -24,12 +31,41 @@ public:
     double defocusAngle = 0.0;
     double focusDist = 10;
 
-    double strat_factor_u = -1, strat_factor_v = -1;
-    int strat_count_u, strat_count_v;
+    // Draws the pixel, lens and scattering decisions of every sample, Sobol by default
+    shared_ptr<sampler> pixelSampler;
+
+    // Reconstruction filter the samples are splatted with, a box over the pixel by default
+    shared_ptr<filter> pixelFilter;
+    int tileSize = 16;
+
+    // Pins the render threads to CPUs, spread over the NUMA nodes
+    bool pinThreads = false;
 
-    
     shared_ptr<texture> skybox;
 
+    // Materials of the scene rendered, that the primitives' mat_id index. Keeps the scene's arena alive.
+    shared_ptr<const material_table> materials;
+
+    // Exposure, firefly clamping, bloom and tonemapping applied to the float framebuffer
+    post_process post;
+
+    // First hit albedo, normal, depth and the pixel variance, filled by render
+    aov_buffers aovs;
+    std::string aovPrefix;      // if set, the AOVs are written to <aovPrefix>_<name>.pfm
+    bool denoise = false;       // run the denoiser on the radiance before post processing
+    atrous_denoiser denoiser;
+
+    // If set, render_frame renders in passes of growing sample counts, all but the last one
+    // teaching the guide where light comes from, and part of the scatter directions follow it
+    shared_ptr<path_guide> guide;
+
+    // Estimates the radiance of the samples instead of the path tracer of ray_color when set,
+    // see bdpt.h and photon_map.h. The guide only applies to the path tracer.
+    shared_ptr<integrator> radianceIntegrator;
+
+    // Seeds the random numbers of the frame's tiles, 0 draws a new seed for every render
+    uint64_t seed = 0;
+
     point3 lookfrom = point3(0,0,0);
     point3 lookat = point3(0,0,1);
     vec3 vup = vec3(0,1,0);
@@ -38,47 +74,264 @@ public:
     }
 
 
-    void render(hittable& world, shared_ptr<hittable> lights){
-        initialize();
+    void render(hittable& world, shared_ptr<hittable> lights, std::ostream& out = std::cout){
         world.commit_transform();
+        render_frame(world, lights, out);
+    }
 
-        std::clog << "Each pixel will be stratified into " << strat_count_u << "x" << strat_count_v <<std::endl;
-        std::cout << "P3\n" << imgWidth << ' ' << imgHeight << "\n255\n";
-        for(int i = 0; i < imgHeight; i++){
-            std::clog << "\rScan lines " << (i+1) << "/" << imgHeight << " (" << int(100*(i+1)/imgHeight) << "%)       " << std::flush;
-            for(int j = 0; j < imgWidth; j++){
-                color totCol = color(0,0,0);
-                #pragma omp parallel for 
-                for(int k = 0; k < strat_count_u*strat_count_v; k++){
-                    int ku = k % strat_count_u;
-                    int kv = k / strat_count_u;
-                    ray pixelRay = get_ray(i, j, ku, kv);
-                    color sampled_col = ray_color(pixelRay, world, maxRayBounce, lights);
-                    /*if(sampled_col > color_clamp_val){
-                        sampled_col = color(std::fmin(sampled_col.x(), color_clamp_val),
-                                            std::fmin(sampled_col.y(), color_clamp_val),
-                                            std::fmin(sampled_col.z(), color_clamp_val));
-                    }*/
-                    totCol += sampled_col;
+    // Renders a frame of a world whose transforms are already committed and writes it to out
+    void render_frame(const hittable& world, shared_ptr<hittable> lights, std::ostream& out = std::cout){
+        begin_render();
+        std::vector<int> tiles(tile_count());
+        for(int t = 0; t < tile_count(); t++) tiles[t] = t;
+        if(guide == nullptr || radianceIntegrator != nullptr){
+            film flm(imgWidth, imgHeight, pixelFilter);
+            for(int done = 0; done < samplesPerPixel;){
+                int n = radianceIntegrator != nullptr ? radianceIntegrator->pass_samples(done) : 0;
+                n = n > 0 ? std::min(n, samplesPerPixel - done) : samplesPerPixel - done;
+                render_tiles(world, lights, flm, tiles, done, n);
+                done += n;
+            }
+            end_render(flm, out);
+            return;
+        }
+
+        // The passes sample less and less noisily as the guide learns, each is weighted by the
+        // inverse of its variance instead of keeping only the last one
+        guide->reset(world.bounding_box());
+        std::vector<color> image(size_t(imgWidth)*imgHeight, color(0,0,0));
+        double weightSum = 0;
+        for(int done = 0; done < samplesPerPixel;){
+            int n = std::min(std::max(done, 2), samplesPerPixel - done);
+            guide->set_training(done + n < samplesPerPixel);
+            film passFilm(imgWidth, imgHeight, pixelFilter);
+            double variance = render_tiles(world, lights, passFilm, tiles, done, n);
+            double w = variance > 0 ? 1/variance : 1;
+            std::vector<color> pass = passFilm.resolve();
+            for(size_t i = 0; i < image.size(); i++) image[i] += w*pass[i];
+            weightSum += w;
+            done += n;
+            if(guide->training())
+                guide->refine(n);
+        }
+        for(color& c : image) c /= weightSum;
+        guide->report();
+        end_render(image, out);
+    }
+
+    // Sets the camera up for a frame, before any tile is rendered
+    void begin_render(){
+        initialize();
+        frameSeed = seed != 0 ? seed : splitmix64(thread_random_state()) | 1;
+
+        std::clog << "Taking " << samplesPerPixel << " samples per pixel" << std::endl;
+        aovs.resize(imgWidth, imgHeight);
+    }
+
+    // Tiles are handed out dynamically, each thread draws its samples from its own sampler
+    // and splats them in its own padded tile buffer. firstSample and sampleCount select a range of
+    // the pixel samples, see render_tile. Returns the mean variance of the pixels over the tiles.
+    double render_tiles(const hittable& world, shared_ptr<hittable> lights, film& flm, const std::vector<int>& tiles,
+                        int firstSample = 0, int sampleCount = -1){
+        int tilesDone = 0, n = int(tiles.size());
+        double varianceSum = 0;
+        size_t pixels = 0;
+        if(pinThreads)
+            numa::pin_omp_threads();
+        if(radianceIntegrator != nullptr){
+            radianceIntegrator->prepare(world, lights, *this, firstSample, sampleCount);
+            if(radianceIntegrator->splats())
+                flm.enable_splats();
+        }
+        #pragma omp parallel
+        {
+            shared_ptr<sampler> smp = pixelSampler->clone();
+            #pragma omp for schedule(dynamic)
+            for(int i = 0; i < n; i++){
+                int x0, y0, x1, y1;
+                tile_bounds(tiles[i], x0, y0, x1, y1);
+                film_tile tile = flm.make_tile(x0, y0, x1, y1);
+                double variance = render_tile(world, lights, tile, x0, y0, x1, y1, *smp, firstSample, sampleCount);
+                flm.merge_tile(tile);
+                #pragma omp critical
+                {
+                    varianceSum += variance;
+                    pixels += size_t(x1 - x0)*(y1 - y0);
+                    tilesDone++;
+                    std::clog << "\rTiles " << tilesDone << "/" << n << " (" << int(100*tilesDone/n) << "%)       " << std::flush;
+                }
+            }
+        }
+        std::clog << std::endl;
+        return pixels > 0 ? varianceSum/pixels : 0;
+    }
+
+    // Renders the pixels [x0,x1) x [y0,y1) into tile and fills their AOVs. The random numbers are
+    // seeded from the frame seed and the tile position, so the result doesn't depend on the thread
+    // or process rendering it.
+    // Only the pixel samples [firstSample, firstSample + sampleCount) are taken, all of them by
+    // default. Successive ranges refine the same film, the AOVs of the samples before firstSample
+    // are kept and averaged with the new ones.
+    // Returns the summed variances of the pixel means of the range, estimated without bias, 0 for
+    // a single sample.
+    double render_tile(const hittable& world, shared_ptr<hittable> lights, film_tile& tile, int x0, int y0, int x1, int y1, sampler& smp,
+                       int firstSample = 0, int sampleCount = -1){
+        int lastSample = sampleCount < 0 ? samplesPerPixel : std::min(samplesPerPixel, firstSample + sampleCount);
+        int n = lastSample - firstSample;
+        if(n <= 0) return 0;
+        double varianceSum = 0;
+        seed_thread_random(frameSeed ^ ((uint64_t(y0)*imgWidth + x0) * 0x9e3779b97f4a7c15ULL)
+                                     ^ (uint64_t(firstSample) * 0xbf58476d1ce4e5b9ULL));
+
+        // A batched integrator gets the samples of as many pixels as fit in its batch at once
+        int batchSize = radianceIntegrator != nullptr ? radianceIntegrator->batch_samples() : 0;
+        int tileWidth = x1 - x0, pixelCount = tileWidth*(y1 - y0);
+        int pixelsPerBatch = batchSize > 0 ? std::max(1, batchSize/n) : pixelCount;
+        std::vector<camera_sample> batch;
+        std::vector<color> batchRadiance;
+        std::vector<aov_sample> batchAovs;
+
+        for(int p0 = 0; p0 < pixelCount; p0 += pixelsPerBatch){
+            int p1 = std::min(p0 + pixelsPerBatch, pixelCount);
+            if(batchSize > 0){
+                batch.clear();
+                for(int p = p0; p < p1; p++){
+                    for(int k = firstSample; k < lastSample; k++){
+                        camera_sample cs;
+                        cs.px = x0 + p%tileWidth; cs.py = y0 + p/tileWidth; cs.index = k;
+                        smp.start_pixel_sample(cs.px, cs.py, k);
+                        double su, sv;
+                        smp.get_2d(su, sv);
+                        cs.fx = cs.px + su; cs.fy = cs.py + sv;
+                        cs.r = get_ray_at(cs.fx, cs.fy, smp);
+                        cs.dim = smp.dimension();
+                        batch.push_back(cs);
+                    }
+                }
+                batchRadiance.resize(batch.size());
+                batchAovs.assign(batch.size(), aov_sample());
+                radianceIntegrator->radiance_batch(batch.data(), int(batch.size()), world, lights, *this, smp, tile,
+                                                   batchRadiance.data(), batchAovs.data());
+            }
+
+            for(int p = p0; p < p1; p++){
+                int i = y0 + p/tileWidth, j = x0 + p%tileWidth;
+                color albedo = color(0,0,0);
+                vec3 normal = vec3(0,0,0);
+                double depth = 0, lum = 0, lum2 = 0;
+                int hits = 0;
+                for(int k = firstSample; k < lastSample; k++){
+                    double fx, fy;
+                    color radiance;
+                    aov_sample aov;
+                    if(batchSize > 0){
+                        size_t b = size_t(p - p0)*n + (k - firstSample);
+                        fx = batch[b].fx; fy = batch[b].fy;
+                        radiance = batchRadiance[b];
+                        aov = batchAovs[b];
+                    } else {
+                        smp.start_pixel_sample(j, i, k);
+                        double su, sv;
+                        smp.get_2d(su, sv);
+                        fx = j + su; fy = i + sv;
+                        ray pixelRay = get_ray_at(fx, fy, smp);
+                        radiance = radianceIntegrator != nullptr
+                            ? radianceIntegrator->radiance(pixelRay, world, lights, *this, smp, tile, &aov)
+                            : ray_color(pixelRay, world, maxRayBounce, lights, smp, &aov);
+                    }
+                    color sampled_col = post.clamp_sample(radiance);
+                    tile.add_sample(fx, fy, sampled_col);
+
+                    double l = aov_buffers::luminance(sampled_col);
+                    lum += l; lum2 += l*l;
+                    albedo += aov.albedo;
+                    if(aov.hit){
+                        normal += aov.normal;
+                        depth += aov.depth;
+                        hits++;
+                    }
+                }
+                size_t px = size_t(i)*imgWidth + j;
+                double mean = lum/n;
+                double variance = std::fmax(0.0, lum2/n - mean*mean) / n;
+                if(n > 1) varianceSum += variance*n/(n - 1);
+                if(firstSample == 0){
+                    aovs.albedo[px] = albedo/n;
+                    aovs.normal[px] = normal.near_zero() ? vec3(0,0,0) : normal.normalized();
+                    aovs.depth[px] = hits > 0 ? depth/hits : 0;
+                    aovs.variance[px] = variance;
+                } else {
+                    // Weighted by the sample counts, the variance is the one of the mean of both estimates
+                    double k0 = firstSample, k1 = lastSample;
+                    aovs.albedo[px] = (aovs.albedo[px]*k0 + albedo)/k1;
+                    normal += aovs.normal[px]*k0;
+                    aovs.normal[px] = normal.near_zero() ? vec3(0,0,0) : normal.normalized();
+                    if(hits > 0)
+                        aovs.depth[px] = aovs.depth[px] > 0 ? (aovs.depth[px]*k0 + depth/hits*n)/k1 : depth/hits;
+                    aovs.variance[px] = (aovs.variance[px]*k0*k0 + variance*n*n)/(k1*k1);
                 }
-                write_color(std::cout, totCol/samplesPerPixel);
             }
-            std::cout << '\n';
         }
-        std::cout << std::endl;
+        return varianceSum;
+    }
+
+    // Resolves the film, then denoises, post processes and writes the frame to out
+    void end_render(const film& flm, std::ostream& out = std::cout){
+        end_render(flm.resolve(), out);
+    }
+
+    // Same from the resolved radiance
+    void end_render(std::vector<color> image, std::ostream& out = std::cout){
+        if(!aovPrefix.empty())
+            aovs.write(aovPrefix);
+        if(denoise)
+            denoiser.apply(image, aovs);
+        post.apply(image, imgWidth, imgHeight);
+        write_image(image, out);
+    }
+
+    int tile_count() const {
+        return tile_count_x() * ((imgHeight + tileSize - 1)/tileSize);
+    }
+
+    void tile_bounds(int t, int& x0, int& y0, int& x1, int& y1) const {
+        x0 = (t % tile_count_x())*tileSize; y0 = (t / tile_count_x())*tileSize;
+        x1 = std::min(x0 + tileSize, imgWidth); y1 = std::min(y0 + tileSize, imgHeight);
+    }
+
+    uint64_t frame_seed() const {
+        return frameSeed;
+    }
+
+    int image_height() const {
+        return imgHeight;
+    }
+
+    // Writes a whole frame of pixel colors, row by row, as a PPM
+    void write_image(const std::vector<color>& image, std::ostream& out = std::cout) const {
+        out << "P3\n" << imgWidth << ' ' << imgHeight << "\n255\n";
+        for(int i = 0; i < imgHeight; i++){
+            for(int j = 0; j < imgWidth; j++)
+                write_color(out, image[i*imgWidth + j]);
+            out << '\n';
+        }
+        out << std::endl;
     }
 
 private:
     int imgHeight;
+    uint64_t frameSeed = 1;
     point3 cameraPos, pixel00Loc;
     vec3 pixelDeltaU, pixelDeltaV;
     vec3 u,v,w;
     vec3 defocusDiskU, defocusDiskV;
     vec3 vpUpperLeft;
+    double filmArea;    // area of the image on the plane at distance 1 from the lens
+    double lensArea;    // 1 for a pinhole
 
-    vec3 stratified_pix_du, stratified_pix_dv;
-
-
+    int tile_count_x() const {
+        return (imgWidth + tileSize - 1)/tileSize;
+    }
 
 public:
     void initialize(){
@@ -107,42 +360,81 @@ public:
         vpUpperLeft = cameraPos - focusDist*w - vp_U/2 - vp_V/2;
         pixel00Loc = vpUpperLeft + 0.5*(pixelDeltaU + pixelDeltaV);
 
-        if(strat_factor_u < 0 || strat_factor_v < 0){
-            strat_factor_u = strat_factor_v = 1.0/sqrt(samplesPerPixel);
-        }
-        strat_count_u = int(1.0/strat_factor_u);
-        strat_count_v = int(1.0/strat_factor_v);
-        stratified_pix_du = pixelDeltaU * strat_factor_u;
-        stratified_pix_dv = pixelDeltaV * strat_factor_v;
+        if(pixelSampler == nullptr)
+            pixelSampler = make_shared<sobol_sampler>();
+        samplesPerPixel = pixelSampler->round_count(std::max(1, samplesPerPixel));
+        pixelSampler->init(imgWidth, imgHeight, samplesPerPixel);
 
         double defocusRadius = focusDist * tan(degsToRads(defocusAngle/2));
         defocusDiskU = u * defocusRadius;
         defocusDiskV = v * defocusRadius;
 
-        color_clamp_val = samplesPerPixel/50;
-        std::clog << "Max sample color camp set to " << color_clamp_val << std::endl;
+        filmArea = vpWidth*vpHeight / (focusDist*focusDist);
+        lensArea = defocusAngle > EPSILON ? PI*defocusRadius*defocusRadius : 1.0;
     }
 
-    ray get_ray(int pix_i, int pix_j, int st_i, int st_j) const{
-        point3 pixTopLeftCorner = vpUpperLeft + pix_i * pixelDeltaV + pix_j * pixelDeltaU;
-        vec3 pixOffset = sample_stratified_rect(stratified_pix_du, stratified_pix_dv, st_i, st_j); // stratification
+    ray get_ray(int pix_i, int pix_j, sampler& smp) const{
+        double su, sv;
+        smp.get_2d(su, sv);
+        return get_ray_at(pix_j + su, pix_i + sv, smp);
+    }
+
+    // Ray through the film position (fx, fy), in pixels from the top left corner of the image
+    ray get_ray_at(double fx, double fy, sampler& smp) const{
+        point3 filmPoint = vpUpperLeft + fy * pixelDeltaV + fx * pixelDeltaU;
         point3 rayOrigin = cameraPos;
-        if(defocusAngle > EPSILON)
-            rayOrigin = sample_defocus_disk();
-        ray r = ray(rayOrigin, pixTopLeftCorner + pixOffset - rayOrigin, randDouble());
+        if(defocusAngle > EPSILON){
+            double su, sv;
+            smp.get_2d(su, sv);
+            rayOrigin = sample_defocus_disk(su, sv);
+        }
+        ray r = ray(rayOrigin, filmPoint - rayOrigin, smp.get_1d());
+
+        // Differentials span the spacing between samples rather than a whole pixel
+        double diffScale = std::fmax(0.125, 1.0/std::sqrt(samplesPerPixel));
+        r.set_differentials(rayOrigin, r.direction() + diffScale*pixelDeltaU,
+                            rayOrigin, r.direction() + diffScale*pixelDeltaV);
         return r;
     }
 
-    vec3 sample_stratified_rect(const vec3& du, const vec3& dv, int idu, int idv) const {
-        return (idu + randDouble())*du + (idv + randDouble())*dv;
+    point3 sample_defocus_disk(double su, double sv) const{
+        double rad = std::sqrt(su), phi = 2*PI*sv;
+        return cameraPos + rad*std::cos(phi)*defocusDiskU + rad*std::sin(phi)*defocusDiskV;
     }
 
-    point3 sample_defocus_disk() const{
-        vec3 v = vec3::random_in_unit_circle();
-        return cameraPos +v[0]*defocusDiskU + v[1]*defocusDiskV; 
+    // For integrators tracing paths from the lights, in pbrt's terms: the camera rays are
+    // generated with a uniform density lens_pdf() over the lens, and a direction density
+    // direction_pdf(dir) per solid angle, dir is a normalized ray direction
+    double lens_pdf() const {
+        return 1/lensArea;
     }
 
-    color ray_color(const ray& r, const hittable& world, int bouncesLeft, shared_ptr<hittable> lights){
+    double direction_pdf(const vec3& dir) const {
+        double cosine = -dot(dir, w);
+        return cosine <= 0 ? 0 : 1/(filmArea*cosine*cosine*cosine);
+    }
+
+    // Importance We of the ray from lensPoint towards p, 0 if it misses the image. Also gives
+    // the film position (fx, fy) the ray lands on.
+    double importance(const point3& lensPoint, const point3& p, double& fx, double& fy) const {
+        vec3 dir = p - lensPoint;
+        double along = -dot(dir, w);
+        if(along <= EPSILON) return 0;
+        point3 filmPoint = lensPoint + dir*(focusDist/along);
+        fx = dot(filmPoint - vpUpperLeft, pixelDeltaU) / pixelDeltaU.length_squared();
+        fy = dot(filmPoint - vpUpperLeft, pixelDeltaV) / pixelDeltaV.length_squared();
+        if(fx < 0 || fy < 0 || fx >= imgWidth || fy >= imgHeight) return 0;
+        double cosine = along / dir.length(), cos2 = cosine*cosine;
+        return 1/(filmArea*lensArea*cos2*cos2);
+    }
+
+    // Direction the camera looks to, the normal of the lens
+    vec3 forward() const {
+        return -w;
+    }
+
+    // aov, when given, receives the first hit of the path
+    color ray_color(const ray& r, const hittable& world, int bouncesLeft, shared_ptr<hittable> lights, sampler& smp, aov_sample* aov = nullptr){
         hit_record hr;
         if(bouncesLeft < 0){
 #ifdef SIMPLE_DEBUG
@@ -151,15 +443,26 @@ public:
             return color(0,0,0);
         }
         if (world.hit(r, interval(0.001, infinity), hr)){
+            hr.obj->surface_interaction(r, hr);
 #ifdef SIMPLE_DEBUG
                 std::clog << "Ray hit at point " << hr.p << " after " << hr.t << " timeunits" << std::endl;
 #endif
 
-            color emitted = hr.mat->emitted(hr.u, hr.v, hr.p);
+            hr.compute_differentials(r);
+            const material* mat = materials->get(hr.mat_id);
+            color emitted = mat->emitted(hr.u, hr.v, hr.p);
             
             scatter_rec sr;
+            bool scatters = mat->scatter(r, hr, sr);
+
+            if(aov != nullptr){
+                aov->hit = true;
+                aov->albedo = scatters ? sr.attenuation : color(1,1,1);
+                aov->normal = hr.normal;
+                aov->depth = hr.t * r.direction().length();
+            }
 
-            if(!hr.mat->scatter(r, hr, sr)){
+            if(!scatters){
 #ifdef SIMPLE_DEBUG
                 std::clog << "Material doesnt scatter, returning emission " << emitted << std::endl;
 #endif
@@ -167,22 +470,30 @@ public:
             }
             
             if(sr.scattered_solid_angle < 0.1){ // TODO FIND BETTER THRESHOLD 
-                return emitted + sr.attenuation * ray_color(ray(hr.p, sr.pdf_ptr->generate()), world, bouncesLeft-1, lights);
+                ray specular = ray(hr.p, sr.pdf_ptr->generate());
+                mat->scatter_differentials(r, hr, specular);
+                return emitted + sr.attenuation * ray_color(specular, world, bouncesLeft-1, lights, smp);
             }
 
 
             auto combined_pdf = linear_comb_pdf<vec3>();
-            combined_pdf.add(sr.pdf_ptr, 1.0);
-            
+            const guide_quadtree* guided = guide != nullptr ? guide->lookup(hr.p) : nullptr;
+            if(guided != nullptr){
+                combined_pdf.add(sr.pdf_ptr, 1.0 - guide->sampleFraction);
+                combined_pdf.add(make_shared<guided_pdf>(guided), guide->sampleFraction);
+            } else {
+                combined_pdf.add(sr.pdf_ptr, 1.0);
+            }
+
             if(lights != nullptr){
                 auto to_lights_pdf = make_shared<uniform_hittable_pdf>(lights, hr.p);
-                combined_pdf.add(to_lights_pdf, 1.0);
+                combined_pdf.add(to_lights_pdf, guided != nullptr ? 1.0 - guide->sampleFraction : 1.0);
                 //combined_pdf.add(sr.pdf_ptr, bouncesLeft == 1 ? 0.0 : 1.0);
             } 
 
             double pdfval = 0; ray scattered;
             while(pdfval < EPSILON){
-                scattered = ray(hr.p, combined_pdf.generate(), hr.t);
+                scattered = ray(hr.p, combined_pdf.generate(smp), hr.t);
                 pdfval = combined_pdf.val(scattered.direction());
             }
 
@@ -191,7 +502,9 @@ public:
 #endif
 
             double mat_scatter_pdf = sr.pdf_ptr->val(scattered.direction());
-            color next_col = ray_color(scattered, world, bouncesLeft-1, lights);
+            color next_col = ray_color(scattered, world, bouncesLeft-1, lights, smp);
+            if(guide != nullptr && guide->training())
+                guide->record(hr.p, scattered.direction(), aov_buffers::luminance(next_col), pdfval);
             
 #ifdef SIMPLE_DEBUG
             std::clog << "Scatter col =  " << mat_scatter_pdf << "*" << sr.attenuation << "*" << next_col << "/" << pdfval << std::endl;
@@ -206,6 +519,11 @@ public:
 #ifdef SIMPLE_DEBUG   
         std::clog << "RAY HIT SKYBOX" << std::endl;
 #endif
+        return background(r);
+    }
+
+    color background(const ray& r) const {
+        if(skybox == nullptr) return color(0,0,0);
         vec3 n = r.direction().normalized();
         double u, v;
         sphere::get_sphere_uv(n, u, v);
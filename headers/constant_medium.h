@@ -3,60 +3,74 @@
 
 #include "box.h"
 #include "material.h"
+#include "material_table.h"
 
 class constant_medium : public hittable {
 private:
     shared_ptr<hittable> boundary;
     double neg_inv_density;
-    shared_ptr<material> phase_func;
+    uint32_t phase_id;
 
 public:
-    constant_medium(shared_ptr<hittable> boundary, double density, shared_ptr<texture> tex)
-      : boundary(boundary), neg_inv_density(-1/density),
-        phase_func(make_shared<isotropic>(tex))
-    {}
-
-    constant_medium(shared_ptr<hittable> boundary, double density, const color& albedo)
-      : boundary(boundary), neg_inv_density(-1/density),
-        phase_func(make_shared<isotropic>(albedo))
+    // phase_id is the index of the phase function, an isotropic material, in the scene's material_table
+    constant_medium(shared_ptr<hittable> boundary, double density, uint32_t phase_id)
+      : boundary(boundary), neg_inv_density(-1/density), phase_id(phase_id)
     {}
 
 
     void commit_transform() override {
+#ifdef SIMPLE_DEBUG
       std::clog << "Committed constant medium transform" << std::endl;
+#endif
       boundary->commit_transform();
     }
 
     bool hit(const ray& r, interval t_int, hit_record& hr) const override {
-        hit_record hr1, hr2;
-        
-        // Ray origin might be in volume, need to be careful
-        if(!boundary->hit(r, interval::universe, hr1)) return false;
-        if(!boundary->hit(r, interval(hr1.t+0.001, infinity), hr2)) return false;
-
-
-        hr1.t = std::fmax(hr1.t, t_int.min);
-        hr2.t = std::fmin(hr2.t, t_int.max);
-
-        if(hr2.t < hr1.t) return false;
+        hit_record hr1;
+        double tEnter, tExit;
+
+        // Hitting a back face first means the ray starts inside the volume,
+        // only rays coming from outside need a second query to find the exit
+        if(!boundary->hit(r, interval(t_int.min, infinity), hr1)) return false;
+        hr1.obj->surface_interaction(r, hr1);
+        if(hr1.front_face){
+            if(hr1.t > t_int.max) return false;
+            tEnter = hr1.t;
+            if(!boundary->hit(r, interval(hr1.t+0.001, infinity), hr1)) return false;
+            tExit = hr1.t;
+        } else {
+            tEnter = t_int.min;
+            tExit = hr1.t;
+        }
+
+        tExit = std::fmin(tExit, t_int.max);
+
+        if(tExit < tEnter) return false;
 
         double raySpeed = r.direction().length();
-        double hitDist = (hr2.t -hr1.t) * raySpeed;
+        double hitDist = (tExit - tEnter) * raySpeed;
         double escapeDist = neg_inv_density * std::log(randDouble());
 
         if(hitDist < escapeDist) return false;
         
         // Hit in volume confirmed
 
-        hr.t = hr1.t + escapeDist/raySpeed;
-        hr.p = r.at(hr.t);
-        hr.mat = phase_func;
-        hr.normal = vec3(1,0,0);
-        hr.front_face = true;
+        hr.t = tEnter + escapeDist/raySpeed;
+        hr.obj = this;
 
         return true;
     };
 
+    void surface_interaction(const ray& r, hit_record& hr) const override {
+        hr.p = r.at(hr.t);
+        hr.mat_id = phase_id;
+        hr.normal = vec3(1,0,0);
+        hr.front_face = true;
+        hr.u = hr.v = 0;
+        hr.dpdu = hr.dpdv = vec3(0,0,0);
+        hr.curvature = 0;
+    }
+
     aabb bounding_box() const override { return boundary->bounding_box(); }
 };
 
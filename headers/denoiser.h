@@ -0,0 +1,109 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "common.h"
+#include "aov.h"
+
+#include <vector>
+#include <algorithm>
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010) with the variance guided
+// luminance weight of SVGF (Schied et al. 2017). The radiance is divided by the albedo
+// first so textures are not blurred, filtered, then multiplied back.
+class atrous_denoiser {
+public:
+    int iterations = 5;         // the filter footprint doubles at each iteration
+    double sigmaLuminance = 4;  // in standard deviations of the pixel noise
+    double sigmaNormal = 128;   // exponent on the normals' dot product
+    double sigmaDepth = 1;      // in units of the local depth gradient
+
+    void apply(std::vector<color>& image, const aov_buffers& aov) const {
+        int w = aov.width, h = aov.height;
+        size_t n = size_t(w)*h;
+
+        std::vector<color> cur(n), next(n);
+        std::vector<double> var(n), nextVar(n), gradZ(n);
+
+        #pragma omp parallel for
+        for(int y = 0; y < h; y++){
+            for(int x = 0; x < w; x++){
+                size_t i = size_t(y)*w + x;
+                const color& a = aov.albedo[i];
+                cur[i] = color(demodulate(image[i].x(), a.x()), demodulate(image[i].y(), a.y()), demodulate(image[i].z(), a.z()));
+                double la = std::fmax(aov_buffers::luminance(a), 1e-3);
+                var[i] = aov.variance[i] / (la*la);
+
+                // Depth gradient in pixels, from central differences
+                double dzx = aov.depth[size_t(y)*w + std::min(x+1, w-1)] - aov.depth[size_t(y)*w + std::max(x-1, 0)];
+                double dzy = aov.depth[size_t(std::min(y+1, h-1))*w + x] - aov.depth[size_t(std::max(y-1, 0))*w + x];
+                gradZ[i] = std::fmax(std::fabs(dzx), std::fabs(dzy)) / 2;
+            }
+        }
+
+        static const double kernel[3] = {3.0/8.0, 1.0/4.0, 1.0/16.0}; // B3 spline
+        for(int it = 0; it < iterations; it++){
+            int step = 1 << it;
+
+            #pragma omp parallel for schedule(dynamic)
+            for(int y = 0; y < h; y++){
+                for(int x = 0; x < w; x++){
+                    size_t p = size_t(y)*w + x;
+                    double lp = aov_buffers::luminance(cur[p]);
+                    double sdev = std::sqrt(std::fmax(var[p], 0.0));
+                    const vec3& np = aov.normal[p];
+                    bool hitP = !np.near_zero();
+
+                    color sum = color(0,0,0);
+                    double wsum = 0, vsum = 0;
+                    for(int dy = -2; dy <= 2; dy++){
+                        int qy = y + dy*step;
+                        if(qy < 0 || qy >= h) continue;
+                        for(int dx = -2; dx <= 2; dx++){
+                            int qx = x + dx*step;
+                            if(qx < 0 || qx >= w) continue;
+                            size_t q = size_t(qy)*w + qx;
+
+                            double wk = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                            double wgt = wk;
+                            if(q != p){
+                                const vec3& nq = aov.normal[q];
+                                bool hitQ = !nq.near_zero();
+                                if(hitP != hitQ) continue;
+                                if(hitP){
+                                    wgt *= std::pow(std::fmax(0.0, dot(np, nq)), sigmaNormal);
+                                    double dist = step*std::sqrt(double(dx*dx + dy*dy));
+                                    wgt *= std::exp(-std::fabs(aov.depth[p] - aov.depth[q]) / (sigmaDepth*gradZ[p]*dist + 1e-6));
+                                }
+                                double lq = aov_buffers::luminance(cur[q]);
+                                wgt *= std::exp(-std::fabs(lp - lq) / (sigmaLuminance*sdev + 1e-6));
+                            }
+
+                            sum += wgt*cur[q];
+                            wsum += wgt;
+                            vsum += wgt*wgt*var[q];
+                        }
+                    }
+                    next[p] = sum / wsum;
+                    nextVar[p] = vsum / (wsum*wsum);
+                }
+            }
+            std::swap(cur, next);
+            std::swap(var, nextVar);
+        }
+
+        #pragma omp parallel for
+        for(size_t i = 0; i < n; i++)
+            image[i] = remodulate(cur[i], aov.albedo[i]);
+    }
+
+private:
+    static double demodulate(double c, double a){
+        return c / std::fmax(a, 1e-3);
+    }
+
+    static color remodulate(const color& c, const color& a){
+        return color(c.x()*std::fmax(a.x(), 1e-3), c.y()*std::fmax(a.y(), 1e-3), c.z()*std::fmax(a.z(), 1e-3));
+    }
+};
+
+#endif
@@ -0,0 +1,414 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "common.h"
+#include "scene.h"
+#include "film.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+// A frame split in tiles rendered by worker processes, reached over Unix or TCP sockets:
+//
+//   coordinator                            worker
+//       <----------------- connect -----------
+//       --- frame (scene name, seed) -------->  builds the scene once
+//       --- job (tile bounds) --------------->  renders it
+//       <-- result (film tile, tile AOVs) ----
+//       ...
+//       --- done ---------------------------->
+//
+// The frame seed both seeds the scene construction and the tiles' random numbers, and tiles are
+// seeded from their position, so every worker builds the same scene and the image doesn't depend
+// on which worker rendered which tile. The tiles of a worker that disconnects go back in the queue.
+// Messages are in the host's byte order, the workers must run on the same architecture.
+namespace dist {
+
+enum msg_type : uint32_t { msg_frame = 1, msg_job = 2, msg_result = 3, msg_done = 4 };
+
+struct msg_header {
+    uint32_t type;
+    uint32_t size;
+};
+
+struct frame_msg {
+    uint64_t seed;
+    int32_t width, height, samples;
+    char scene[64];
+};
+
+struct job_msg {
+    int32_t tile, x0, y0, x1, y1;
+};
+
+// Addresses are "unix:<path>" or "tcp:<host>:<port>", an empty host listens on all interfaces
+inline bool parse_address(const std::string& addr, bool& isUnix, std::string& host, std::string& port){
+    if(addr.compare(0, 5, "unix:") == 0){
+        isUnix = true;
+        host = addr.substr(5);
+        return !host.empty() && host.size() < sizeof(sockaddr_un::sun_path);
+    }
+    if(addr.compare(0, 4, "tcp:") == 0){
+        isUnix = false;
+        size_t colon = addr.rfind(':');
+        if(colon <= 3) return false;
+        host = addr.substr(4, colon - 4);
+        port = addr.substr(colon + 1);
+        return !port.empty();
+    }
+    return false;
+}
+
+// Returns a socket listening on addr, -1 on failure
+inline int listen_on(const std::string& addr){
+    bool isUnix; std::string host, port;
+    if(!parse_address(addr, isUnix, host, port)){
+        std::clog << "Invalid address " << addr << std::endl;
+        return -1;
+    }
+
+    int fd = -1;
+    if(isUnix){
+        sockaddr_un sa = {};
+        sa.sun_family = AF_UNIX;
+        std::strcpy(sa.sun_path, host.c_str());
+        unlink(sa.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd >= 0 && bind(fd, (sockaddr*)&sa, sizeof(sa)) != 0){ close(fd); fd = -1; }
+    } else {
+        addrinfo hints = {}, *res = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if(getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) == 0){
+            for(addrinfo* ai = res; ai != nullptr && fd < 0; ai = ai->ai_next){
+                fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if(fd < 0) continue;
+                int one = 1;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                if(bind(fd, ai->ai_addr, ai->ai_addrlen) != 0){ close(fd); fd = -1; }
+            }
+            freeaddrinfo(res);
+        }
+    }
+
+    if(fd < 0 || listen(fd, 64) != 0){
+        std::clog << "Could not listen on " << addr << ": " << std::strerror(errno) << std::endl;
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns a socket connected to addr, -1 on failure. Retries for a few seconds so workers can be
+// started before the coordinator.
+inline int connect_to(const std::string& addr, int attempts = 50){
+    bool isUnix; std::string host, port;
+    if(!parse_address(addr, isUnix, host, port)){
+        std::clog << "Invalid address " << addr << std::endl;
+        return -1;
+    }
+
+    for(int a = 0; a < attempts; a++){
+        if(a > 0) usleep(100000);
+        if(isUnix){
+            sockaddr_un sa = {};
+            sa.sun_family = AF_UNIX;
+            std::strcpy(sa.sun_path, host.c_str());
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(fd >= 0 && connect(fd, (sockaddr*)&sa, sizeof(sa)) == 0) return fd;
+            if(fd >= 0) close(fd);
+        } else {
+            addrinfo hints = {}, *res = nullptr;
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if(getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &res) != 0) continue;
+            int fd = -1;
+            for(addrinfo* ai = res; ai != nullptr && fd < 0; ai = ai->ai_next){
+                fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if(fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0){ close(fd); fd = -1; }
+            }
+            freeaddrinfo(res);
+            if(fd >= 0) return fd;
+        }
+    }
+    std::clog << "Could not connect to " << addr << std::endl;
+    return -1;
+}
+
+inline bool write_all(int fd, const void* data, size_t n){
+    const char* p = (const char*)data;
+    while(n > 0){
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return false;
+        p += w; n -= w;
+    }
+    return true;
+}
+
+inline bool read_all(int fd, void* data, size_t n){
+    char* p = (char*)data;
+    while(n > 0){
+        ssize_t r = recv(fd, p, n, 0);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+        p += r; n -= r;
+    }
+    return true;
+}
+
+inline bool send_msg(int fd, uint32_t type, const void* data, size_t n){
+    msg_header h = {type, uint32_t(n)};
+    return write_all(fd, &h, sizeof(h)) && write_all(fd, data, n);
+}
+
+inline bool recv_msg(int fd, uint32_t& type, std::vector<char>& payload){
+    msg_header h;
+    if(!read_all(fd, &h, sizeof(h)) || h.size > (1u << 30)) return false;
+    type = h.type;
+    payload.resize(h.size);
+    return read_all(fd, payload.data(), h.size);
+}
+
+// Builds the scene a frame names into out, after seeding the random generator with seed so
+// every process builds the same scene. Returns false if the scene is unknown.
+using scene_loader = std::function<bool(const std::string& name, uint64_t seed, scene& out)>;
+
+// Worker side: renders the tiles the coordinator at addr hands out until the frame is done.
+// Tiles are rendered one at a time on the calling thread, run one worker per core.
+inline bool run_worker(const std::string& addr, const scene_loader& load){
+    int fd = connect_to(addr);
+    if(fd < 0) return false;
+
+    uint32_t type;
+    std::vector<char> buf;
+    frame_msg frame;
+    if(!recv_msg(fd, type, buf) || type != msg_frame || buf.size() != sizeof(frame)){
+        std::clog << "Worker got no frame from " << addr << std::endl;
+        close(fd);
+        return false;
+    }
+    std::memcpy(&frame, buf.data(), sizeof(frame));
+    frame.scene[sizeof(frame.scene) - 1] = 0;
+
+    scene scn;
+    if(!load(frame.scene, frame.seed, scn)){
+        std::clog << "Worker could not load scene " << frame.scene << std::endl;
+        close(fd);
+        return false;
+    }
+    camera& cam = scn.cam;
+    cam.seed = frame.seed;
+    scn.world.commit_transform();
+    cam.begin_render();
+    if(cam.imgWidth != frame.width || cam.image_height() != frame.height || cam.samplesPerPixel != frame.samples){
+        std::clog << "Worker's scene " << frame.scene << " doesn't match the coordinator's frame" << std::endl;
+        close(fd);
+        return false;
+    }
+
+    film flm(frame.width, frame.height, cam.pixelFilter);
+    shared_ptr<sampler> smp = cam.pixelSampler->clone();
+    std::vector<float> data;
+    std::vector<char> out;
+    while(recv_msg(fd, type, buf)){
+        if(type == msg_done){
+            close(fd);
+            return true;
+        }
+        job_msg job;
+        if(type != msg_job || buf.size() != sizeof(job)) break;
+        std::memcpy(&job, buf.data(), sizeof(job));
+
+        film_tile tile = flm.make_tile(job.x0, job.y0, job.x1, job.y1);
+        cam.render_tile(scn.world, scn.lights, tile, job.x0, job.y0, job.x1, job.y1, *smp);
+
+        data.clear();
+        tile.pack(data);
+        cam.aovs.pack_region(job.x0, job.y0, job.x1, job.y1, data);
+        out.resize(sizeof(job) + data.size()*sizeof(float));
+        std::memcpy(out.data(), &job, sizeof(job));
+        std::memcpy(out.data() + sizeof(job), data.data(), data.size()*sizeof(float));
+        if(!send_msg(fd, msg_result, out.data(), out.size())) break;
+    }
+    std::clog << "Worker lost the coordinator at " << addr << std::endl;
+    close(fd);
+    return false;
+}
+
+
+// Coordinator side: hands the tiles of a frame out to the workers that connect, merges what
+// they send back and writes the frame like camera::render would.
+class render_coordinator {
+public:
+    std::string address;        // where the workers connect, see parse_address
+    int localWorkers = 0;       // worker processes forked from this one, they reuse the scene already built
+    int jobsPerWorker = 2;      // tiles in flight per worker, hides the round trips
+    double idleTimeout = 10;    // seconds without any worker before the coordinator renders the remaining tiles itself
+
+    // Renders scn, built by the scene function sceneName after seed_random(scn.cam.seed)
+    bool render(scene& scn, const std::string& sceneName){
+        int lfd = listen_on(address);
+        if(lfd < 0) return false;
+
+        camera& cam = scn.cam;
+        scn.world.commit_transform();
+        cam.begin_render();
+
+        std::vector<pid_t> children;
+        for(int i = 0; i < localWorkers; i++){
+            pid_t pid = fork();
+            if(pid == 0){
+                close(lfd);
+                bool ok = run_worker(address, [&scn](const std::string&, uint64_t, scene& out){
+                    out = scn;
+                    return true;
+                });
+                _exit(ok ? 0 : 1);
+            }
+            if(pid < 0)
+                std::clog << "Could not fork worker " << i << ": " << std::strerror(errno) << std::endl;
+            else
+                children.push_back(pid);
+        }
+
+        frame_msg frame = {};
+        frame.seed = cam.frame_seed();
+        frame.width = cam.imgWidth;
+        frame.height = cam.image_height();
+        frame.samples = cam.samplesPerPixel;
+        std::strncpy(frame.scene, sceneName.c_str(), sizeof(frame.scene) - 1);
+
+        film flm(cam.imgWidth, cam.image_height(), cam.pixelFilter);
+        int nTiles = cam.tile_count(), tilesDone = 0;
+        std::deque<int> todo;
+        for(int t = 0; t < nTiles; t++) todo.push_back(t);
+
+        std::vector<connection> workers;
+        auto lastWorker = std::chrono::steady_clock::now();
+        std::vector<char> buf;
+
+        while(tilesDone < nTiles){
+            std::vector<pollfd> fds(1 + workers.size());
+            fds[0] = {lfd, POLLIN, 0};
+            for(size_t i = 0; i < workers.size(); i++) fds[i+1] = {workers[i].fd, POLLIN, 0};
+            if(poll(fds.data(), fds.size(), 200) < 0 && errno != EINTR){
+                std::clog << "Coordinator poll failed: " << std::strerror(errno) << std::endl;
+                break;
+            }
+
+            for(size_t i = 0; i < workers.size(); i++){
+                if(fds[i+1].revents == 0) continue;
+                uint32_t type;
+                if(!recv_msg(workers[i].fd, type, buf) || type != msg_result || !merge_result(cam, flm, workers[i], buf)){
+                    drop(workers[i], todo);
+                    continue;
+                }
+                tilesDone++;
+                std::clog << "\rTiles " << tilesDone << "/" << nTiles << " (" << int(100*tilesDone/nTiles) << "%), "
+                          << workers.size() << " workers       " << std::flush;
+            }
+
+            if(fds[0].revents & POLLIN){
+                int fd = accept(lfd, nullptr, nullptr);
+                if(fd >= 0 && send_msg(fd, msg_frame, &frame, sizeof(frame)))
+                    workers.push_back({fd, {}});
+                else if(fd >= 0)
+                    close(fd);
+            }
+
+            for(connection& w : workers){
+                while(w.fd >= 0 && int(w.jobs.size()) < jobsPerWorker && !todo.empty()){
+                    job_msg job;
+                    job.tile = todo.front();
+                    cam.tile_bounds(job.tile, job.x0, job.y0, job.x1, job.y1);
+                    todo.pop_front();
+                    w.jobs.push_back(job.tile);
+                    if(!send_msg(w.fd, msg_job, &job, sizeof(job)))
+                        drop(w, todo);
+                }
+            }
+            workers.erase(std::remove_if(workers.begin(), workers.end(), [](const connection& w){ return w.fd < 0; }), workers.end());
+
+            if(!workers.empty()){
+                lastWorker = std::chrono::steady_clock::now();
+            } else if(std::chrono::duration<double>(std::chrono::steady_clock::now() - lastWorker).count() > idleTimeout){
+                std::clog << std::endl << "No worker left, rendering the last " << todo.size() << " tiles here" << std::endl;
+                cam.render_tiles(scn.world, scn.lights, flm, std::vector<int>(todo.begin(), todo.end()));
+                tilesDone += int(todo.size());
+                todo.clear();
+            }
+        }
+        std::clog << std::endl;
+
+        for(connection& w : workers){
+            send_msg(w.fd, msg_done, nullptr, 0);
+            close(w.fd);
+        }
+        close(lfd);
+        bool isUnix; std::string host, port;
+        if(parse_address(address, isUnix, host, port) && isUnix)
+            unlink(host.c_str());
+        for(pid_t pid : children)
+            waitpid(pid, nullptr, 0);
+
+        if(tilesDone < nTiles) return false;
+        cam.end_render(flm);
+        return true;
+    }
+
+private:
+    struct connection {
+        int fd;
+        std::vector<int> jobs;  // tiles sent and not returned yet
+    };
+
+    // Puts the worker's tiles back at the front of the queue and forgets it
+    static void drop(connection& w, std::deque<int>& todo){
+        std::clog << std::endl << "Lost a worker, requeuing its " << w.jobs.size() << " tiles" << std::endl;
+        for(int t : w.jobs) todo.push_front(t);
+        w.jobs.clear();
+        close(w.fd);
+        w.fd = -1;
+    }
+
+    static bool merge_result(camera& cam, film& flm, connection& w, const std::vector<char>& buf){
+        job_msg job;
+        if(buf.size() < sizeof(job)) return false;
+        std::memcpy(&job, buf.data(), sizeof(job));
+        auto it = std::find(w.jobs.begin(), w.jobs.end(), job.tile);
+        if(it == w.jobs.end()) return false;
+
+        int x0, y0, x1, y1;
+        cam.tile_bounds(job.tile, x0, y0, x1, y1);
+        film_tile tile = flm.make_tile(x0, y0, x1, y1);
+        size_t nTile = tile.packed_size(), nAov = aov_buffers::packed_size(x0, y0, x1, y1);
+        if(buf.size() != sizeof(job) + (nTile + nAov)*sizeof(float)) return false;
+
+        std::vector<float> data(nTile + nAov);
+        std::memcpy(data.data(), buf.data() + sizeof(job), data.size()*sizeof(float));
+        tile.unpack(data.data());
+        flm.merge_tile(tile);
+        cam.aovs.unpack_region(x0, y0, x1, y1, data.data() + nTile);
+        w.jobs.erase(it);
+        return true;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef EMITTERS_H
+#define EMITTERS_H
+
+#include "common.h"
+#include "hittable.h"
+#include "material.h"
+#include "material_table.h"
+#include "sampler.h"
+#include "warp.h"
+#include "aov.h"
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+// The emissive quads, triangles and spheres of a world (hittable::collect_emitters), to start
+// paths from the lights. Emitters are picked proportionally to their power, estimated from
+// their area and their emission at the center. Emitters that can't be sampled by area (boxes)
+// are left out.
+class emitter_set {
+public:
+    void build(const hittable& world, const material_table& materials){
+        emitters.clear();
+        world.collect_emitters(materials, emitters);
+
+        cdf.assign(emitters.size() + 1, 0.0);
+        for(size_t i = 0; i < emitters.size(); i++){
+            hit_record hr;
+            double power = 0;
+            if(emitters[i]->sample_surface(0.5, 0.5, hr))
+                power = emitters[i]->get_area()*aov_buffers::luminance(materials.get(hr.mat_id)->emitted(hr.u, hr.v, hr.p));
+            cdf[i+1] = cdf[i] + std::fmax(0.0, power);
+        }
+        pdfs.clear();
+        double total = cdf.back();
+        if(total <= 0){
+            std::clog << "No emitter to start light paths from" << std::endl;
+            emitters.clear();
+            return;
+        }
+        for(size_t i = 0; i < emitters.size(); i++){
+            cdf[i+1] /= total;
+            pdfs[emitters[i]] += cdf[i+1] - cdf[i];
+        }
+    }
+
+    bool empty() const {
+        return emitters.empty();
+    }
+
+    const hittable* pick(double u, double& pdf) const {
+        size_t i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        i = std::min(std::max(i, size_t(1)), emitters.size()) - 1;
+        while(i > 0 && cdf[i+1] == cdf[i]) i--; // skip emitters without power
+        pdf = cdf[i+1] - cdf[i];
+        return emitters[i];
+    }
+
+    // Probability of picking e, 0 if it isn't part of the set
+    double pick_pdf(const hittable* e) const {
+        auto it = pdfs.find(e);
+        return it == pdfs.end() ? 0 : it->second;
+    }
+
+    // Starts a light path: fills hr with a point of an emitter, dir with a direction cosine
+    // distributed around the normal of one of its emitting faces, and their densities, per area
+    // (with the pick probability) and per solid angle
+    bool sample_emission(sampler& smp, hit_record& hr, vec3& dir, double& pdfPos, double& pdfDir) const {
+        if(emitters.empty()) return false;
+        double pickPdf, su, sv;
+        const hittable* e = pick(smp.get_1d(), pickPdf);
+        smp.get_2d(su, sv);
+        if(!e->sample_surface(su, sv, hr)) return false;
+
+        vec3 n = hr.normal;
+        bool twoSided = e->two_sided();
+        if(twoSided && smp.get_1d() < 0.5) n = -n;
+        smp.get_2d(su, sv);
+        dir = to_world(warp_cosine_hemisphere(su, sv), n);
+        pdfDir = warp_cosine_hemisphere_pdf(dot(dir, n)) * (twoSided ? 0.5 : 1.0);
+        pdfPos = pickPdf / e->get_area();
+        return pdfDir > 0 && pdfPos > 0;
+    }
+
+    // Whether the emitter point hr, from sample_surface or a hit, sends light along dir
+    static bool emits_towards(const hit_record& hr, const vec3& dir){
+        vec3 outward = hr.front_face ? hr.normal : -hr.normal;
+        return dot(outward, dir) > 0 || hr.obj->two_sided();
+    }
+
+    // Solid angle density of the emission directions of sample_emission, dir is normalized
+    static double direction_pdf(const hit_record& hr, const vec3& dir){
+        if(!emits_towards(hr, dir)) return 0;
+        return std::fabs(dot(hr.normal, dir))/PI * (hr.obj->two_sided() ? 0.5 : 1.0);
+    }
+
+private:
+    std::vector<const hittable*> emitters;
+    std::vector<double> cdf;
+    std::unordered_map<const hittable*, double> pdfs;
+};
+
+#endif
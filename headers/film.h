@@ -0,0 +1,243 @@
+#ifndef FILM_H
+#define FILM_H
+
+#include "common.h"
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <algorithm>
+
+// Pixel reconstruction filters, evaluated on offsets from the pixel center in pixels.
+// All of them are separable, f(x,y) = f1(x)*f1(y).
+class filter {
+public:
+    double radius;
+
+    filter(double radius): radius(radius) {}
+    virtual ~filter() = default;
+
+    virtual double eval_1d(double x) const = 0;
+
+    double eval(double x, double y) const {
+        return eval_1d(x) * eval_1d(y);
+    }
+};
+
+// Each sample only counts for the pixel it was taken in
+class box_filter : public filter {
+public:
+    box_filter(double radius = 0.5): filter(radius) {}
+
+    double eval_1d(double x) const override {
+        return std::fabs(x) <= radius ? 1.0 : 0.0;
+    }
+};
+
+class gaussian_filter : public filter {
+private:
+    double alpha, expR;
+public:
+    gaussian_filter(double radius = 1.5, double alpha = 2.0): filter(radius), alpha(alpha), expR(std::exp(-alpha*radius*radius)) {}
+
+    double eval_1d(double x) const override {
+        return std::fmax(0.0, std::exp(-alpha*x*x) - expR);
+    }
+};
+
+// Mitchell and Netravali 1988, sharper than the gaussian, with small negative lobes
+class mitchell_filter : public filter {
+private:
+    double B, C;
+public:
+    mitchell_filter(double radius = 2.0, double B = 1.0/3.0, double C = 1.0/3.0): filter(radius), B(B), C(C) {}
+
+    double eval_1d(double x) const override {
+        x = std::fabs(2*x/radius);
+        if(x > 2) return 0;
+        if(x > 1)
+            return ((-B - 6*C)*x*x*x + (6*B + 30*C)*x*x + (-12*B - 48*C)*x + (8*B + 24*C)) / 6;
+        return ((12 - 9*B - 6*C)*x*x*x + (-18 + 12*B + 6*C)*x*x + (6 - 2*B)) / 6;
+    }
+};
+
+// Filter by name, box, gaussian or mitchell with their default radius, nullptr for any other name
+inline shared_ptr<filter> make_filter(const std::string& name){
+    if(name == "box") return make_shared<box_filter>();
+    if(name == "gaussian") return make_shared<gaussian_filter>();
+    if(name == "mitchell") return make_shared<mitchell_filter>();
+    return nullptr;
+}
+
+
+class film;
+
+// Weighted sums of the samples splatted around a block of pixels. The buffer is padded by
+// the filter radius so samples near the border can reach the neighbouring tiles' pixels,
+// the overlap is resolved when the tile is merged into the film.
+class film_tile {
+    friend class film;
+private:
+    const film* flm;
+    int px0, py0, px1, py1;     // padded pixel bounds, [px0,px1) x [py0,py1)
+    std::vector<color> sum;
+    std::vector<double> weight;
+    uint64_t lightPaths = 0;
+
+public:
+    film_tile(const film* flm, int px0, int py0, int px1, int py1): flm(flm), px0(px0), py0(py0), px1(px1), py1(py1) {
+        size_t n = size_t(std::max(0, px1 - px0)) * std::max(0, py1 - py0);
+        sum.assign(n, color(0,0,0));
+        weight.assign(n, 0.0);
+    }
+
+    // Sample L taken at the film position (fx, fy), in pixels from the top left corner
+    inline void add_sample(double fx, double fy, const color& L);
+
+    // Light tracing contribution L reaching the film at (fx, fy), it may land outside the tile
+    inline void add_splat(double fx, double fy, const color& L);
+
+    // Counts a light path traced for this tile, the splats are averaged over all of them
+    void add_light_path(){
+        lightPaths++;
+    }
+
+    // Appends the buffers to out as floats, the weighted sum then the weight of each padded pixel,
+    // to ship the tile to another process
+    void pack(std::vector<float>& out) const {
+        for(size_t i = 0; i < sum.size(); i++){
+            out.push_back(float(sum[i].x())); out.push_back(float(sum[i].y())); out.push_back(float(sum[i].z()));
+            out.push_back(float(weight[i]));
+        }
+    }
+
+    size_t packed_size() const {
+        return 4*sum.size();
+    }
+
+    // Reads back what pack wrote for a tile with the same bounds, data holds packed_size() values
+    void unpack(const float* data){
+        for(size_t i = 0; i < sum.size(); i++, data += 4){
+            sum[i] = color(data[0], data[1], data[2]);
+            weight[i] = data[3];
+        }
+    }
+};
+
+// Accumulates filtered samples over the whole image. Tiles are filled without any
+// synchronization, merging one takes a lock once.
+class film {
+    friend class film_tile;
+private:
+    static const int table_size = 16;
+
+    int width, height;
+    shared_ptr<filter> filt;
+    double filterTable[table_size][table_size]; // filter on [0,radius]^2, it is symmetric
+    std::vector<color> sum;
+    std::vector<double> weight;
+    std::mutex mergeMutex;
+
+    // Unfiltered sums of the light tracing splats, any tile adds to any pixel. Only allocated by
+    // enable_splats, for the integrators that trace paths from the lights.
+    mutable std::unique_ptr<std::atomic<double>[]> splat;
+    uint64_t splatPaths = 0;
+
+public:
+    film(int width, int height, shared_ptr<filter> f): width(width), height(height), filt(f) {
+        if(filt == nullptr) filt = make_shared<box_filter>();
+        for(int y = 0; y < table_size; y++)
+            for(int x = 0; x < table_size; x++)
+                filterTable[y][x] = filt->eval((x + 0.5)*filt->radius/table_size, (y + 0.5)*filt->radius/table_size);
+        sum.assign(size_t(width)*height, color(0,0,0));
+        weight.assign(size_t(width)*height, 0.0);
+    }
+
+    double filter_radius() const {
+        return filt->radius;
+    }
+
+    // Tile gathering the samples taken in the pixels [x0,x1) x [y0,y1)
+    film_tile make_tile(int x0, int y0, int x1, int y1) const {
+        int pad = int(std::ceil(filt->radius - 0.5));
+        return film_tile(this, std::max(0, x0 - pad), std::max(0, y0 - pad),
+                               std::min(width, x1 + pad), std::min(height, y1 + pad));
+    }
+
+    // Must be called before the tiles are rendered, splats are dropped otherwise
+    void enable_splats(){
+        if(splat == nullptr)
+            splat.reset(new std::atomic<double>[3*size_t(width)*height]());
+    }
+
+    void merge_tile(const film_tile& tile){
+        std::lock_guard<std::mutex> lock(mergeMutex);
+        splatPaths += tile.lightPaths;
+        int tw = tile.px1 - tile.px0;
+        for(int y = tile.py0; y < tile.py1; y++){
+            for(int x = tile.px0; x < tile.px1; x++){
+                size_t t = size_t(y - tile.py0)*tw + (x - tile.px0);
+                size_t p = size_t(y)*width + x;
+                sum[p] += tile.sum[t];
+                weight[p] += tile.weight[t];
+            }
+        }
+    }
+
+    // Final pixel values, negative lobes of the filter can't make them negative.
+    // A light path lands in a given pixel with the probability 1/(width*height) of a camera
+    // sample, so the splats are scaled by the pixel count over the number of light paths.
+    std::vector<color> resolve() const {
+        std::vector<color> image(sum.size());
+        double splatScale = splat != nullptr && splatPaths > 0 ? double(sum.size())/splatPaths : 0;
+        #pragma omp parallel for
+        for(size_t i = 0; i < sum.size(); i++){
+            color c = weight[i] == 0 ? color(0,0,0) : sum[i] / weight[i];
+            if(splatScale > 0)
+                c += splatScale*color(splat[3*i].load(std::memory_order_relaxed), splat[3*i+1].load(std::memory_order_relaxed),
+                                      splat[3*i+2].load(std::memory_order_relaxed));
+            image[i] = color(std::fmax(0.0, c.x()), std::fmax(0.0, c.y()), std::fmax(0.0, c.z()));
+        }
+        return image;
+    }
+
+private:
+    double table_weight(double dx, double dy) const {
+        int ix = std::min(int(std::fabs(dx)*table_size/filt->radius), table_size-1);
+        int iy = std::min(int(std::fabs(dy)*table_size/filt->radius), table_size-1);
+        return filterTable[iy][ix];
+    }
+};
+
+inline void film_tile::add_sample(double fx, double fy, const color& L){
+    double r = flm->filt->radius;
+    // Pixels whose center (x+0.5, y+0.5) is within the filter radius
+    int x0 = std::max(px0, int(std::ceil(fx - 0.5 - r)));
+    int x1 = std::min(px1 - 1, int(std::floor(fx - 0.5 + r)));
+    int y0 = std::max(py0, int(std::ceil(fy - 0.5 - r)));
+    int y1 = std::min(py1 - 1, int(std::floor(fy - 0.5 + r)));
+    int tw = px1 - px0;
+
+    for(int y = y0; y <= y1; y++){
+        for(int x = x0; x <= x1; x++){
+            double w = flm->table_weight(x + 0.5 - fx, y + 0.5 - fy);
+            size_t t = size_t(y - py0)*tw + (x - px0);
+            sum[t] += w*L;
+            weight[t] += w;
+        }
+    }
+}
+
+inline void film_tile::add_splat(double fx, double fy, const color& L){
+    if(flm->splat == nullptr) return;
+    int x = int(fx), y = int(fy);
+    if(fx < 0 || fy < 0 || x >= flm->width || y >= flm->height) return;
+    size_t p = 3*(size_t(y)*flm->width + x);
+    atomic_add(flm->splat[p], L.x());
+    atomic_add(flm->splat[p+1], L.y());
+    atomic_add(flm->splat[p+2], L.z());
+}
+
+#endif
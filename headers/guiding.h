@@ -0,0 +1,333 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "common.h"
+#include "aabb.h"
+#include "pdf.h"
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+#include <iostream>
+
+// Path guiding with an SD-tree (Müller et al., "Practical Path Guiding for Efficient Light-Transport
+// Simulation"). Space is cut by a binary tree into cells, each holding a quadtree over directions
+// that learns the incident radiance there. The frame is rendered in passes of growing sample
+// counts: every pass records the radiance its paths find into the trees, and the next one samples
+// part of its scatter directions from what was learned.
+
+// Directional distribution over the whole sphere. Directions map to the unit square by
+// ((cos theta + 1)/2, phi/2pi), which preserves areas, and the square is a quadtree whose nodes
+// hold the energy of their 4 quadrants. Quadrant q covers x half q&1 and y half q>>1.
+class guide_quadtree {
+public:
+    struct node {
+        std::atomic<float> sum[4];
+        uint32_t child[4];      // 0 for a quadrant that isn't subdivided
+
+        node(){
+            for(int q = 0; q < 4; q++){ sum[q].store(0, std::memory_order_relaxed); child[q] = 0; }
+        }
+        node(const node& o){
+            for(int q = 0; q < 4; q++){ sum[q].store(o.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed); child[q] = o.child[q]; }
+        }
+        node& operator=(const node& o){
+            for(int q = 0; q < 4; q++){ sum[q].store(o.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed); child[q] = o.child[q]; }
+            return *this;
+        }
+
+        double total() const {
+            return double(sum[0]) + sum[1] + sum[2] + sum[3];
+        }
+    };
+
+    std::vector<node> nodes = std::vector<node>(1);
+
+    double total() const {
+        return nodes[0].total();
+    }
+
+    void record(const vec3& dir, double value){
+        double x, y;
+        to_square(dir, x, y);
+        uint32_t idx = 0;
+        for(;;){
+            int q = quadrant(x, y);
+            atomic_add(nodes[idx].sum[q], float(value));
+            if(nodes[idx].child[q] == 0) return;
+            idx = nodes[idx].child[q];
+        }
+    }
+
+    // Solid angle density of dir
+    double pdf(const vec3& dir) const {
+        double total = this->total();
+        if(!(total > 0)) return 0;
+        double x, y;
+        to_square(dir, x, y);
+        double density = 1;
+        uint32_t idx = 0;
+        for(;;){
+            const node& nd = nodes[idx];
+            int q = quadrant(x, y);
+            double t = nd.total();
+            if(!(nd.sum[q] > 0)) return 0;
+            density *= 4*nd.sum[q]/t;
+            if(nd.child[q] == 0) break;
+            idx = nd.child[q];
+        }
+        return density / (4*PI);
+    }
+
+    // Direction drawn proportionally to the energies, the tree must not be empty
+    vec3 sample(double su, double sv) const {
+        double x0 = 0, y0 = 0, size = 1;
+        uint32_t idx = 0;
+        for(;;){
+            const node& nd = nodes[idx];
+            double s[4] = {nd.sum[0], nd.sum[1], nd.sum[2], nd.sum[3]};
+            double t = s[0] + s[1] + s[2] + s[3];
+            int qx = pick(su, (s[0] + s[2])/t);
+            int qy = pick(sv, s[qx]/(s[qx] + s[qx + 2]));
+            int q = qx + 2*qy;
+            size *= 0.5;
+            x0 += qx*size; y0 += qy*size;
+            if(nd.child[q] == 0) break;
+            idx = nd.child[q];
+        }
+        return from_square(x0 + su*size, y0 + sv*size);
+    }
+
+    // Rebuilds the structure from the energies of prev with no energy recorded yet: quadrants
+    // holding more than rho of the total are subdivided, the others are merged
+    void refine_from(const guide_quadtree& prev, double rho, int maxDepth, size_t maxNodes){
+        nodes.assign(1, node());
+        double total = prev.total();
+        if(!(total > 0)) return;
+
+        struct entry { uint32_t idx; int prevIdx; double energy; int depth; };
+        std::vector<entry> stack = {{0, 0, total, 1}};
+        while(!stack.empty()){
+            entry e = stack.back();
+            stack.pop_back();
+            for(int q = 0; q < 4; q++){
+                // Quadrants the previous tree didn't subdivide spread their energy evenly
+                double energy = e.prevIdx >= 0 ? double(prev.nodes[e.prevIdx].sum[q]) : e.energy/4;
+                if(energy <= rho*total || e.depth >= maxDepth || nodes.size() + 1 > maxNodes) continue;
+                uint32_t child = uint32_t(nodes.size());
+                nodes.emplace_back();
+                nodes[e.idx].child[q] = child;
+                int prevChild = e.prevIdx >= 0 && prev.nodes[e.prevIdx].child[q] != 0 ? int(prev.nodes[e.prevIdx].child[q]) : -1;
+                stack.push_back({child, prevChild, energy, e.depth + 1});
+            }
+        }
+    }
+
+    size_t bytes() const {
+        return nodes.capacity()*sizeof(node);
+    }
+
+private:
+    static void to_square(const vec3& dir, double& x, double& y){
+        vec3 d = dir.normalized();
+        x = std::clamp(0.5*(d.z() + 1), 0.0, 1.0 - 1e-9);
+        double phi = std::atan2(d.y(), d.x());
+        if(phi < 0) phi += 2*PI;
+        y = std::clamp(phi/(2*PI), 0.0, 1.0 - 1e-9);
+    }
+
+    static vec3 from_square(double x, double y){
+        double cosTheta = 2*x - 1, sinTheta = std::sqrt(std::fmax(0.0, 1 - cosTheta*cosTheta));
+        double phi = 2*PI*y;
+        return vec3(sinTheta*std::cos(phi), sinTheta*std::sin(phi), cosTheta);
+    }
+
+    // Quadrant of (x, y), which is rescaled to the quadrant
+    static int quadrant(double& x, double& y){
+        int qx = x >= 0.5, qy = y >= 0.5;
+        x = 2*x - qx; y = 2*y - qy;
+        return qx + 2*qy;
+    }
+
+    // Picks the lower half with probability p and rescales u to the half picked
+    static int pick(double& u, double p){
+        if(!(p > 0)) return 1;
+        if(u < p){ u = std::fmin(u/p, 1.0 - 1e-9); return 0; }
+        u = std::fmin((u - p)/(1 - p), 1.0 - 1e-9);
+        return 1;
+    }
+};
+
+// Scatter directions drawn from a cell's learned distribution
+class guided_pdf : public pdf<vec3> {
+private:
+    const guide_quadtree* dist;
+public:
+    guided_pdf(const guide_quadtree* dist): dist(dist) {}
+
+    double val(const vec3& dir) const override {
+        return dist->pdf(dir);
+    }
+
+    vec3 generate() const override {
+        return dist->sample(randDouble(), randDouble());
+    }
+
+    vec3 generate(sampler& smp) const override {
+        double su, sv;
+        smp.get_2d(su, sv);
+        return dist->sample(su, sv);
+    }
+};
+
+// The spatial binary tree and the quadtrees of its cells. Each cell has the quadtree sampled
+// during a pass, learned in the previous ones, and the one recording the current pass.
+// Recording is lock free, refine runs between passes.
+// Memory is bounded by maxCells times twice maxQuadtreeNodes quadtree nodes of 32 bytes, 256MB
+// with the defaults, scenes usually stay far below.
+class path_guide {
+public:
+    double sampleFraction = 0.5;        // share of the BSDF and light sampling weights given to the guide
+    double spatialThreshold = 12000;    // records that split a cell, times sqrt(samples of the pass)
+    double rho = 0.01;                  // energy fraction that subdivides a quadrant
+    int maxDepth = 20;
+    size_t maxCells = 1 << 12;
+    size_t maxQuadtreeNodes = 1 << 10;
+
+    // Untrained until reset, which render_frame and render_progressive call; other render paths
+    // leave the guide unused
+    path_guide(){
+        reset(aabb(point3(-1,-1,-1), point3(1,1,1)));
+        learning = false;
+    }
+
+    // Clears what was learned, bounds is the region cut into cells
+    void reset(const aabb& bounds){
+        boxMin = point3(bounds.x.min, bounds.y.min, bounds.z.min);
+        boxMax = point3(bounds.x.max, bounds.y.max, bounds.z.max);
+        for(int a = 0; a < 3; a++){
+            if(!(boxMax[a] - boxMin[a] > EPSILON)) { boxMin[a] -= 1; boxMax[a] += 1; }
+        }
+        spatial.assign(1, spatial_node{-1, 0, {0, 0}, 0});
+        cells.assign(1, cell());
+        learning = true;
+        passes = 0;
+    }
+
+    bool training() const {
+        return learning;
+    }
+
+    void set_training(bool t){
+        learning = t;
+    }
+
+    // Distribution to sample at p, nullptr if nothing was learned there yet
+    const guide_quadtree* lookup(const point3& p) const {
+        const guide_quadtree& q = cells[find(p)].sampling;
+        return q.total() > 0 ? &q : nullptr;
+    }
+
+    // Records radiance arriving at p from dir, estimated with one sample of density pdf
+    void record(const point3& p, const vec3& dir, double radiance, double pdf){
+        cell& c = cells[find(p)];
+        c.records.fetch_add(1, std::memory_order_relaxed);
+        double value = radiance/pdf;
+        if(value > 0 && std::isfinite(value))
+            c.building.record(dir, value);
+    }
+
+    // Ends a pass of samplesPerPixel samples: the recorded radiance becomes the sampled
+    // distribution, busy cells are split and the quadtrees refined for the next pass
+    void refine(int samplesPerPixel){
+        passes++;
+        double threshold = spatialThreshold*std::sqrt(double(samplesPerPixel));
+        // A split cell's records are assumed to go half to each side, which splits again until
+        // the halves are under the threshold
+        for(size_t s = 0; s < spatial.size(); s++){
+            if(spatial[s].axis >= 0 || cells.size() >= maxCells) continue;
+            if(cells[spatial[s].cell].records.load(std::memory_order_relaxed) <= threshold) continue;
+            split(s);
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for(size_t i = 0; i < cells.size(); i++){
+            cell& c = cells[i];
+            c.sampling = c.building;
+            c.building.refine_from(c.sampling, rho, maxDepth, maxQuadtreeNodes);
+            c.records.store(0, std::memory_order_relaxed);
+        }
+#ifdef SIMPLE_DEBUG
+        report();
+#endif
+    }
+
+    size_t bytes() const {
+        size_t b = spatial.capacity()*sizeof(spatial_node) + cells.capacity()*sizeof(cell);
+        for(const cell& c : cells) b += c.sampling.bytes() + c.building.bytes();
+        return b;
+    }
+
+    void report(std::ostream& out = std::clog) const {
+        out << "Path guide after " << passes << " passes, " << cells.size() << " cells, " << bytes() << " bytes" << std::endl;
+    }
+
+private:
+    struct spatial_node {
+        int axis;           // split axis, -1 for a leaf
+        int depth;          // nodes split x, y, z in turn down the tree
+        uint32_t child[2];
+        uint32_t cell;      // leaf cell
+    };
+
+    struct cell {
+        guide_quadtree sampling, building;
+        std::atomic<uint32_t> records{0};
+
+        cell() {}
+        cell(const cell& o): sampling(o.sampling), building(o.building), records(o.records.load(std::memory_order_relaxed)) {}
+        cell& operator=(const cell& o){
+            sampling = o.sampling; building = o.building;
+            records.store(o.records.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return *this;
+        }
+    };
+
+    point3 boxMin, boxMax;
+    std::vector<spatial_node> spatial;
+    std::vector<cell> cells;
+    bool learning = false;
+    int passes = 0;
+
+    uint32_t find(const point3& p) const {
+        point3 lo = boxMin, hi = boxMax;
+        uint32_t s = 0;
+        while(spatial[s].axis >= 0){
+            int a = spatial[s].axis;
+            double mid = 0.5*(lo[a] + hi[a]);
+            if(p[a] < mid){ hi[a] = mid; s = spatial[s].child[0]; }
+            else { lo[a] = mid; s = spatial[s].child[1]; }
+        }
+        return spatial[s].cell;
+    }
+
+    // Turns leaf s into a node whose two leaves start from its quadtrees
+    void split(size_t s){
+        uint32_t cellIdx = spatial[s].cell;
+        uint32_t newCell = uint32_t(cells.size());
+        uint32_t half = cells[cellIdx].records.load(std::memory_order_relaxed)/2;
+        cells[cellIdx].records.store(half, std::memory_order_relaxed);
+        cell copy = cells[cellIdx];
+        cells.push_back(copy);
+        uint32_t c0 = uint32_t(spatial.size());
+        int depth = spatial[s].depth + 1;
+        spatial.push_back(spatial_node{-1, depth, {0, 0}, cellIdx});
+        spatial.push_back(spatial_node{-1, depth, {0, 0}, newCell});
+        spatial[s].axis = spatial[s].depth % 3;
+        spatial[s].child[0] = c0;
+        spatial[s].child[1] = c0 + 1;
+    }
+};
+
+#endif
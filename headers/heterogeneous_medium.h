@@ -0,0 +1,73 @@
+#ifndef HETEROGENEOUS_MEDIUM_H
+#define HETEROGENEOUS_MEDIUM_H
+
+#include "hittable.h"
+#include "material.h"
+#include "material_table.h"
+#include "voxel_grid.h"
+
+// Participating medium whose density is read from a voxel grid mapped onto an axis aligned box.
+// Scattering distances are sampled with delta tracking along the segments of voxel_grid::walk_majorants,
+// the bound of each segment is used as the tracking density so empty space is skipped and sparse
+// regions take long steps.
+class heterogeneous_medium : public hittable {
+private:
+    shared_ptr<voxel_grid> grid;
+    aabb bbox;
+    point3 corner;          // world position of the grid origin
+    vec3 inv_voxel_size;
+    double density_scale;
+    uint32_t phase_id;
+
+public:
+    // phase_id is the index of the phase function, an isotropic material, in the scene's material_table
+    heterogeneous_medium(shared_ptr<voxel_grid> grid, const point3& a, const point3& b, double density_scale, uint32_t phase_id)
+      : grid(grid), bbox(a, b), density_scale(density_scale), phase_id(phase_id)
+    {
+        grid->build_majorants();
+        corner = point3(bbox.x.min, bbox.y.min, bbox.z.min);
+        inv_voxel_size = vec3(grid->nx / bbox.x.size(), grid->ny / bbox.y.size(), grid->nz / bbox.z.size());
+    }
+
+    void commit_transform() override {}
+
+    bool hit(const ray& r, interval t_int, hit_record& hr) const override {
+        interval rayT = interval(t_int.min, t_int.max);
+        if(!bbox.clip(r, rayT)) return false;
+
+        // Ray in grid coordinates, t is shared with the world ray
+        point3 o = (r.origin() - corner) * inv_voxel_size;
+        vec3 d = r.direction() * inv_voxel_size;
+        double raySpeed = r.direction().length();
+
+        // Delta tracking in each segment: tentative collisions against the majorant,
+        // real ones with probability density/majorant
+        return grid->walk_majorants(o, d, rayT.min, rayT.max, [&](double t0, double t1, double majorant){
+            double sigmaMax = majorant * density_scale;
+            double t = t0;
+            while(true){
+                t -= std::log(1 - randDouble()) / (sigmaMax * raySpeed);
+                if(t >= t1) return false;
+                if(randDouble() * sigmaMax < density_scale * grid->density(o + t*d)){
+                    hr.t = t;
+                    hr.obj = this;
+                    return true;
+                }
+            }
+        });
+    }
+
+    void surface_interaction(const ray& r, hit_record& hr) const override {
+        hr.p = r.at(hr.t);
+        hr.mat_id = phase_id;
+        hr.normal = vec3(1,0,0);
+        hr.front_face = true;
+        hr.u = hr.v = 0;
+        hr.dpdu = hr.dpdv = vec3(0,0,0);
+        hr.curvature = 0;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+};
+
+#endif
@@ -3,25 +3,74 @@
 
 #include "common.h"
 #include "aabb.h"
+#include "texture.h"
+
+#include <cstdint>
+#include <vector>
 
 class material;
+class material_table;
 class hittable;
 
 class hit_record{
 public:
+    // Filled during traversal by `hit`
+    double t;
+    const hittable* obj;    // primitive that was hit
+    uint32_t prim = 0;      // sub-primitive index, for hittables made of several faces or shapes
+    double u, v;            // hit parameters (barycentrics for planar shapes)
+
+    // Filled for the closest hit only, by obj->surface_interaction
     point3 p;
     vec3 normal;
-    double t;
-    double u, v, w;
+    double w;
     bool front_face;
-    shared_ptr<material> mat;
-    shared_ptr<hittable> target; // only filled when calling `hit` function on `hittable_list`
+    uint32_t mat_id;        // index in the scene's material_table
+
+    vec3 dpdu, dpdv;        // surface tangents along the uv parametrization, zero if there is none
+    double curvature = 0;   // dn/dp along the surface, 1/radius for spheres and 0 for planar shapes
+    vec3 dpdx, dpdy;        // change of p for a one pixel offset, filled by compute_differentials
+    tex_footprint footprint;
 
 
     void set_frontface_and_normal(const ray& r, const vec3 outnrml){
         front_face = dot(r.direction(), outnrml) <= 0.0;
         normal = front_face ? outnrml : -outnrml;
     }
+
+    void compute_differentials(const ray& r){
+        footprint = tex_footprint();
+        dpdx = dpdy = vec3(0,0,0);
+        if(!r.has_differentials) return;
+
+        // Intersect the offset rays with the tangent plane at p
+        double d = dot(normal, p);
+        double tx = (d - dot(normal, r.rx_origin)) / dot(normal, r.rx_direction);
+        double ty = (d - dot(normal, r.ry_origin)) / dot(normal, r.ry_direction);
+        if(!std::isfinite(tx) || !std::isfinite(ty)) return;
+
+        dpdx = r.rx_origin + tx*r.rx_direction - p;
+        dpdy = r.ry_origin + ty*r.ry_direction - p;
+        footprint.world = std::fmax(dpdx.length(), dpdy.length());
+
+        // Express dpdx and dpdy in the (dpdu, dpdv) basis, solving the 2x2 system
+        // on the two axes where the surface is the least foreshortened
+        int d0 = 1, d1 = 2;
+        if(std::fabs(normal.y()) > std::fabs(normal.x()) && std::fabs(normal.y()) > std::fabs(normal.z())){
+            d0 = 0; d1 = 2;
+        } else if(std::fabs(normal.z()) > std::fabs(normal.x())){
+            d0 = 0; d1 = 1;
+        }
+
+        double det = dpdu[d0]*dpdv[d1] - dpdv[d0]*dpdu[d1];
+        if(std::fabs(det) < EPSILON) return;
+
+        double dudx = (dpdv[d1]*dpdx[d0] - dpdv[d0]*dpdx[d1]) / det;
+        double dvdx = (dpdu[d0]*dpdx[d1] - dpdu[d1]*dpdx[d0]) / det;
+        double dudy = (dpdv[d1]*dpdy[d0] - dpdv[d0]*dpdy[d1]) / det;
+        double dvdy = (dpdu[d0]*dpdy[d1] - dpdu[d1]*dpdy[d0]) / det;
+        footprint.uv = std::fmax(std::sqrt(dudx*dudx + dvdx*dvdx), std::sqrt(dudy*dudy + dvdy*dvdy));
+    }
 };
 
 class hittable {
@@ -30,8 +79,12 @@ public:
 
     virtual void commit_transform() = 0;
 
+    // Only records t, obj, prim and the hit parameters, and leaves hr untouched on a miss
     virtual bool hit(const ray& r, interval t_int, hit_record& hr) const = 0;
 
+    // Resolves the surface (point, normal, uvs, tangents, material) of a hit found by `hit`
+    virtual void surface_interaction(const ray& r, hit_record& hr) const {}
+
     virtual aabb bounding_box() const = 0;
 
     virtual double pdf_value(const point3& origin, const vec3& direction) const {
@@ -53,6 +106,26 @@ public:
     virtual point3 random_point_towards(const point3& position) const {
         return point3(0,0,0);
     };
+
+    // Direction from origin towards the shape, distributed with density pdf_value.
+    // (su, sv) in [0,1]^2 drive the sample, shapes without a warp ignore them.
+    virtual vec3 sample_direction(const point3& origin, double su, double sv) const {
+        return random_point_towards(origin) - origin;
+    }
+
+    // Point of the surface for (su, sv) in [0,1]^2, uniform by area: fills p, the outward normal,
+    // the hit parameters and the material of hr. False for shapes that can't be sampled this way.
+    virtual bool sample_surface(double su, double sv, hit_record& hr) const {
+        return false;
+    }
+
+    // Whether light leaves both faces, or only the side the outward normal points to
+    virtual bool two_sided() const {
+        return false;
+    }
+
+    // Appends the primitives made of an emissive material of materials, that can be sampled by area
+    virtual void collect_emitters(const material_table& materials, std::vector<const hittable*>& out) const {}
     
 };
 
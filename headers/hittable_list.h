@@ -5,6 +5,7 @@
 #include "hittable.h"
 #include "aabb.h"
 #include <vector>
+#include <algorithm>
 
 class hittable_list : public hittable {
 private:
@@ -22,8 +23,11 @@ public:
 #ifdef SIMPLE_DEBUG
         std::clog << "Committed list transform" << std::endl;
 #endif
+        // Shapes only know their bounds once committed
+        bbox = aabb();
         for(auto obj : objs){
             obj->commit_transform();
+            bbox = aabb(bbox, obj->bounding_box());
         }
     };
 
@@ -34,16 +38,13 @@ public:
     }
 
     bool hit(const ray& r, interval t_int, hit_record& hr) const {
-        hit_record tmpRec;
         bool hitAnything = false;
         interval workingInterval = interval(t_int.min, t_int.max);
 
         for(const shared_ptr<hittable>& obj : objs){
-            if(obj->hit(r, workingInterval, tmpRec)){
+            if(obj->hit(r, workingInterval, hr)){
                 hitAnything = true;
-                workingInterval.max =tmpRec.t;
-                hr = tmpRec;
-                hr.target = obj;
+                workingInterval.max = hr.t;
             }
         }
 
@@ -51,9 +52,27 @@ public:
     }
 
 
-    // TODO perhaps take normal into account to know what ovjects are actually seen
+    // Sampled as lights, each object is picked with the same probability
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        if(objs.empty()) return 0;
+        double sum = 0;
+        for(const shared_ptr<hittable>& obj : objs)
+            sum += obj->pdf_value(origin, direction);
+        return sum / objs.size();
+    }
+
+    // su picks the object, then is stretched back to [0,1) to sample it
+    vec3 sample_direction(const point3& origin, double su, double sv) const override {
+        double scaled = su*objs.size();
+        int i = std::min(int(scaled), int(objs.size())-1);
+        return objs[i]->sample_direction(origin, std::fmin(scaled - i, 1 - 0x1p-53), sv);
+    }
 
-    
+
+    void collect_emitters(const material_table& materials, std::vector<const hittable*>& out) const override {
+        for(const shared_ptr<hittable>& obj : objs)
+            obj->collect_emitters(materials, out);
+    }
 
     aabb bounding_box() const override {
         return bbox;
@@ -0,0 +1,66 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "common.h"
+#include "hittable.h"
+#include "sampler.h"
+#include "film.h"
+#include "aov.h"
+
+class camera;
+
+// Camera sample handed to integrator::radiance_batch: sample index of pixel (px, py), through the
+// film position (fx, fy). dim is the sampler's dimension after the camera drew the ray.
+struct camera_sample {
+    int px, py, index, dim;
+    double fx, fy;
+    ray r;
+};
+
+// Light transport algorithm estimating the radiance of the camera samples, in place of the
+// camera's own path tracer (camera::ray_color) when the camera is given one.
+class integrator {
+public:
+    virtual ~integrator() = default;
+
+    // Called before the tiles of a pass, the pixel samples [firstSample, firstSample + sampleCount)
+    // (sampleCount -1 for all the rest), are rendered. From a single thread, with the world committed.
+    virtual void prepare(const hittable& world, shared_ptr<hittable> lights, const camera& cam, int firstSample, int sampleCount) {}
+
+    // Samples per pixel of the pass starting at sample done when the camera renders a frame,
+    // 0 renders all the remaining samples in one pass
+    virtual int pass_samples(int done) const {
+        return 0;
+    }
+
+    // Whether the integrator splats into the film (film::enable_splats)
+    virtual bool splats() const {
+        return false;
+    }
+
+    // Radiance arriving along the camera ray r. Contributions to other pixels go to the film
+    // through tile.add_splat. aov, when given, receives the first hit.
+    virtual color radiance(const ray& r, const hittable& world, shared_ptr<hittable> lights, const camera& cam,
+                           sampler& smp, film_tile& tile, aov_sample* aov) = 0;
+
+    // Samples the camera hands at once to radiance_batch, 0 to trace them one by one with radiance
+    virtual int batch_samples() const {
+        return 0;
+    }
+
+    // Radiance of the n samples, to out, and their first hits to aovs. The samples of a tile come in
+    // pixel order. smp must be restarted with start_pixel_sample and set_dimension to draw for one.
+    virtual void radiance_batch(const camera_sample* samples, int n, const hittable& world, shared_ptr<hittable> lights,
+                                const camera& cam, sampler& smp, film_tile& tile, color* out, aov_sample* aovs){
+        for(int i = 0; i < n; i++){
+            smp.start_pixel_sample(samples[i].px, samples[i].py, samples[i].index);
+            smp.set_dimension(samples[i].dim);
+            out[i] = radiance(samples[i].r, world, lights, cam, smp, tile, &aovs[i]);
+        }
+    }
+
+    // Fresh integrator with the same settings, for cameras rendering at the same time
+    virtual shared_ptr<integrator> clone() const = 0;
+};
+
+#endif
@@ -4,8 +4,11 @@
 #include "common.h"
 #include "hittable.h"
 #include "texture.h"
+#include "tex_program.h"
 #include "pdf.h"
 
+enum class material_kind : uint8_t { other, lambertian, transparent, metal, dielectric, emissive, isotropic };
+
 struct scatter_rec {
 public:
     color attenuation;
@@ -20,6 +23,10 @@ public:
 
     virtual ~material() = default;
 
+    virtual material_kind kind() const {
+        return material_kind::other;
+    }
+
     virtual color emitted(double u, double v, const point3& p) const {
         return color(0,0,0);
     }
@@ -31,19 +38,93 @@ public:
     virtual double scatter_pdf(const ray& ray_in, const hit_record& hr, const ray& ray_out) const {
         return 0.0;
     }
+
+    // Gives rayOut the differentials of rayIn carried through a specular scattering,
+    // rayOut is left without differentials for materials that blur the footprint anyway
+    virtual void scatter_differentials(const ray& rayIn, const hit_record& hr, ray& rayOut) const {}
+
+    // Texture lookups of n hits of the material at once, for scatter_texel. Returns false for
+    // materials without a texture, which scatter without one.
+    virtual bool texture_values(int n, const double* u, const double* v, const point3* p, const tex_footprint* fp, color* out) const {
+        return false;
+    }
+
+    // scatter with the texel texture_values returned for the hit
+    virtual bool scatter_texel(const ray& rayIn, hit_record& hr, const color& texel, scatter_rec& sr) const {
+        return scatter(rayIn, hr, sr);
+    }
 };
 
 
+// Differentials of a perfect mirror reflection of rayIn into rayOut, pbrt's formulation
+inline void reflect_differentials(const ray& rayIn, const hit_record& hr, ray& rayOut){
+    if(!rayIn.has_differentials) return;
+
+    const vec3& n = hr.normal;
+    double sgn = hr.front_face ? 1.0 : -1.0;
+    vec3 dndx = sgn*hr.curvature*hr.dpdx, dndy = sgn*hr.curvature*hr.dpdy;
+
+    vec3 wo = -rayIn.direction().normalized();
+    vec3 wi = rayOut.direction().normalized();
+    vec3 dwodx = -rayIn.rx_direction.normalized() - wo;
+    vec3 dwody = -rayIn.ry_direction.normalized() - wo;
+    double dDNdx = dot(dwodx, n) + dot(wo, dndx);
+    double dDNdy = dot(dwody, n) + dot(wo, dndy);
+
+    rayOut.set_differentials(
+        hr.p + hr.dpdx, wi - dwodx + 2.0*(dot(wo, n)*dndx + dDNdx*n),
+        hr.p + hr.dpdy, wi - dwody + 2.0*(dot(wo, n)*dndy + dDNdy*n));
+}
+
+// Differentials of a refraction of rayIn into rayOut, ri being the ratio of refractive indices
+inline void refract_differentials(const ray& rayIn, const hit_record& hr, ray& rayOut, double ri){
+    if(!rayIn.has_differentials) return;
+
+    const vec3& n = hr.normal;
+    double sgn = hr.front_face ? 1.0 : -1.0;
+    vec3 dndx = sgn*hr.curvature*hr.dpdx, dndy = sgn*hr.curvature*hr.dpdy;
+
+    vec3 wo = -rayIn.direction().normalized();
+    vec3 wi = rayOut.direction().normalized();
+    vec3 dwodx = -rayIn.rx_direction.normalized() - wo;
+    vec3 dwody = -rayIn.ry_direction.normalized() - wo;
+    double dDNdx = dot(dwodx, n) + dot(wo, dndx);
+    double dDNdy = dot(dwody, n) + dot(wo, dndy);
+
+    double cos_o = dot(wo, n), cos_i = std::fmax(std::fabs(dot(wi, n)), EPSILON);
+    double mu = ri*cos_o - cos_i;
+    double dmudx = (ri - ri*ri*cos_o/cos_i) * dDNdx;
+    double dmudy = (ri - ri*ri*cos_o/cos_i) * dDNdy;
+
+    rayOut.set_differentials(
+        hr.p + hr.dpdx, wi - ri*dwodx + (mu*dndx + dmudx*n),
+        hr.p + hr.dpdy, wi - ri*dwody + (mu*dndy + dmudy*n));
+}
+
+
 class lambertian : public material {
 private:
-    shared_ptr<texture> albedo; 
+    tex_program albedo; 
 
 public:
-    lambertian(color  albedo): albedo(make_shared<solid_color_tex>(albedo)){}
+    lambertian(color  albedo): albedo(albedo){}
     lambertian(shared_ptr<texture> tex): albedo(tex){}
 
+    material_kind kind() const override {
+        return material_kind::lambertian;
+    }
+
     bool scatter(const ray& rayIn, hit_record& hr, scatter_rec& sr) const override{       
-        sr.attenuation = albedo->value(hr.u,hr.v,hr.p);
+        return scatter_texel(rayIn, hr, albedo.eval(hr.u,hr.v,hr.p,hr.footprint), sr);
+    }
+
+    bool texture_values(int n, const double* u, const double* v, const point3* p, const tex_footprint* fp, color* out) const override {
+        albedo.eval(n, u, v, p, fp, out);
+        return true;
+    }
+
+    bool scatter_texel(const ray& rayIn, hit_record& hr, const color& texel, scatter_rec& sr) const override {
+        sr.attenuation = texel;
         sr.pdf_ptr = make_shared<cosine_hemisphere_pdf>(hr.normal);
         sr.scattered_solid_angle = PI/2.0;
         return true;
@@ -62,19 +143,37 @@ private:
 
 class transparent : public material {
 private:
-    shared_ptr<texture> albedo; 
+    tex_program albedo; 
 
 public:
-    transparent(color  albedo): albedo(make_shared<solid_color_tex>(albedo)){}
+    transparent(color  albedo): albedo(albedo){}
     transparent(shared_ptr<texture> tex): albedo(tex){}
 
+    material_kind kind() const override {
+        return material_kind::transparent;
+    }
+
     bool scatter(const ray& rayIn, hit_record& hr, scatter_rec& sr) const override{       
-        sr.attenuation = albedo->value(hr.u,hr.v,hr.p);
+        return scatter_texel(rayIn, hr, albedo.eval(hr.u,hr.v,hr.p,hr.footprint), sr);
+    }
+
+    bool texture_values(int n, const double* u, const double* v, const point3* p, const tex_footprint* fp, color* out) const override {
+        albedo.eval(n, u, v, p, fp, out);
+        return true;
+    }
+
+    bool scatter_texel(const ray& rayIn, hit_record& hr, const color& texel, scatter_rec& sr) const override {
+        sr.attenuation = texel;
         sr.pdf_ptr = make_shared<point_pdf<vec3>>(rayIn.direction());
         sr.scattered_solid_angle = 0;
         return true;
     }
 
+    void scatter_differentials(const ray& rayIn, const hit_record& hr, ray& rayOut) const override {
+        if(!rayIn.has_differentials) return;
+        rayOut.set_differentials(hr.p + hr.dpdx, rayIn.rx_direction, hr.p + hr.dpdy, rayIn.ry_direction);
+    }
+
 private:
 
     double scatter_pdf(const ray& ray_in, const hit_record& hr, const ray& ray_out) const {
@@ -94,6 +193,10 @@ private:
 public:
     metal(const color& albedo, double fuzz): albedo(albedo), fuzzFactor(fuzz) {}
 
+    material_kind kind() const override {
+        return material_kind::metal;
+    }
+
     bool scatter(const ray& rayIn, hit_record& hr, scatter_rec& sr) const override{
         sr.attenuation = albedo;
         if(fuzzFactor > 0.0001){
@@ -115,6 +218,10 @@ public:
         //return cos_theta < 0.0 ? 0.0 : cos_theta/PI;
     }
 
+    void scatter_differentials(const ray& rayIn, const hit_record& hr, ray& rayOut) const override {
+        reflect_differentials(rayIn, hr, rayOut);
+    }
+
 
 
 };
@@ -127,6 +234,10 @@ private:
 public:
     dielectric(double ri): refractiveIndex(ri) {}
 
+    material_kind kind() const override {
+        return material_kind::dielectric;
+    }
+
     bool scatter(const ray& rayIn, hit_record& hr, scatter_rec& sr) const override{
         sr.attenuation = color(1,1,1);
 
@@ -164,6 +275,13 @@ public:
         return reflected == ray_out.direction() ? reflect_prob : 1-reflect_prob;
     }
 
+    void scatter_differentials(const ray& rayIn, const hit_record& hr, ray& rayOut) const override {
+        if(dot(rayOut.direction(), hr.normal) > 0)
+            reflect_differentials(rayIn, hr, rayOut);
+        else
+            refract_differentials(rayIn, hr, rayOut, hr.front_face ? 1/refractiveIndex : refractiveIndex);
+    }
+
 private:
     static double reflectance(double cosine, double ri) {
         // Use Schlick's approximation for reflectance.
@@ -177,15 +295,19 @@ private:
 
 class emissive_mat : public material {
 private:
-    shared_ptr<texture> tex;
+    tex_program tex;
     double intensity;
 public:
 
     emissive_mat(shared_ptr<texture> tex, double intensity=1.0): tex(tex), intensity(intensity) {}
-    emissive_mat(const color& col, double intensity=1.0): tex(make_shared<solid_color_tex>(col)), intensity(intensity) {}
+    emissive_mat(const color& col, double intensity=1.0): tex(col), intensity(intensity) {}
+
+    material_kind kind() const override {
+        return material_kind::emissive;
+    }
 
     color emitted(double u, double v, const point3& p) const override{
-        return tex->value(u,v,p)*intensity;
+        return tex.eval(u,v,p)*intensity;
     }
 
 
@@ -195,12 +317,16 @@ public:
 
 class isotropic : public material {
   public:
-    isotropic(const color& albedo) : tex(make_shared<solid_color_tex>(albedo)) {}
+    isotropic(const color& albedo) : tex(albedo) {}
     isotropic(shared_ptr<texture> tex) : tex(tex) {}
 
+    material_kind kind() const override {
+        return material_kind::isotropic;
+    }
+
      bool scatter(const ray& rayIn, hit_record& hr, scatter_rec& sr) const override {
         sr.pdf_ptr = make_shared<uniform_sphere_pdf>();
-        sr.attenuation = tex->value(hr.u, hr.v, hr.p);
+        sr.attenuation = tex.eval(hr.u, hr.v, hr.p, hr.footprint);
         sr.scattered_solid_angle = 4*PI/3.0;
         return true;
     }
@@ -210,7 +336,7 @@ class isotropic : public material {
     }
 
   private:
-    shared_ptr<texture> tex;
+    tex_program tex;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,39 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "material.h"
+
+// Table of the materials of a scene. Primitives keep the 32 bit index of their material and
+// shading resolves it here, so no shared_ptr is copied while tracing. The kind of every
+// material is stored alongside so ray batches can be sorted by material without touching them.
+// The table doesn't own the materials, the scene_arena they are allocated in owns both the
+// materials and its table (scene_arena::material). The table must not grow during a render.
+class material_table {
+public:
+    uint32_t add(const material* m) {
+        raw.push_back(m);
+        kinds.push_back(m->kind());
+        return raw.size() - 1;
+    }
+
+    const material* get(uint32_t id) const {
+        return raw[id];
+    }
+
+    material_kind kind(uint32_t id) const {
+        return kinds[id];
+    }
+
+    uint32_t size() const {
+        return raw.size();
+    }
+
+private:
+    std::vector<const material*> raw;
+    std::vector<material_kind> kinds;
+};
+
+#endif
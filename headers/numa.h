@@ -0,0 +1,177 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <omp.h>
+
+// Placement of threads and memory on machines with several NUMA nodes, without libnuma:
+//  - threads can be pinned, spread over the nodes in turn so a partial team still uses every socket
+//  - large read-only scene arrays (flat BVHs, texture and voxel data) are mapped directly, backed
+//    by transparent huge pages and interleaved page by page over the nodes. Every thread then
+//    reads from all the nodes evenly instead of all of them reading the node of the thread that
+//    built the scene.
+// On a single node machine pinning only fixes threads to cores and the interleaving is skipped.
+namespace numa {
+
+// CPUs of each node, read from sysfs. A single node holding the CPUs the process may run on
+// when sysfs has no node information.
+class topology {
+public:
+    std::vector<std::vector<int>> nodeCpus;
+
+    static const topology& get(){
+        static topology t;
+        return t;
+    }
+
+    int node_count() const {
+        return int(nodeCpus.size());
+    }
+
+private:
+    topology(){
+        for(int n = 0; ; n++){
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+            if(!in) break;
+            std::string list;
+            std::getline(in, list);
+            nodeCpus.push_back(parse_cpu_list(list));
+        }
+
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        for(auto& cpus : nodeCpus){
+            std::vector<int> kept;
+            for(int c : cpus) if(CPU_ISSET(c, &allowed)) kept.push_back(c);
+            cpus.swap(kept);
+        }
+        std::vector<std::vector<int>> nonEmpty;
+        for(auto& cpus : nodeCpus) if(!cpus.empty()) nonEmpty.push_back(cpus);
+        nodeCpus.swap(nonEmpty);
+
+        if(nodeCpus.empty()){
+            nodeCpus.emplace_back();
+            for(int c = 0; c < CPU_SETSIZE; c++)
+                if(CPU_ISSET(c, &allowed)) nodeCpus[0].push_back(c);
+        }
+    }
+
+    // "0-3,8-11" -> 0 1 2 3 8 9 10 11
+    static std::vector<int> parse_cpu_list(const std::string& list){
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while(std::getline(ss, range, ',')){
+            if(range.empty()) continue;
+            size_t dash = range.find('-');
+            int lo = std::atoi(range.c_str());
+            int hi = dash == std::string::npos ? lo : std::atoi(range.c_str() + dash + 1);
+            for(int c = lo; c <= hi; c++) cpus.push_back(c);
+        }
+        return cpus;
+    }
+};
+
+// Pins the calling thread, thread index of a team of threads, to one CPU. Consecutive indices go
+// to different nodes.
+inline bool pin_current_thread(int thread){
+    const topology& topo = topology::get();
+    const std::vector<int>& cpus = topo.nodeCpus[thread % topo.node_count()];
+    if(cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[(thread / topo.node_count()) % cpus.size()], &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Pins every thread of the OpenMP team. The runtime keeps its threads between parallel regions,
+// so the later regions of the same size run on the same CPUs.
+inline void pin_omp_threads(){
+    #pragma omp parallel
+    pin_current_thread(omp_get_thread_num());
+}
+
+
+const size_t huge_page_size = size_t(2) << 20;
+
+// Memory for large arrays: below a huge page it comes from the heap, above it is mapped on its
+// own, huge page aligned, with huge pages requested and its pages interleaved over the nodes
+inline void* alloc_large(size_t bytes){
+    if(bytes < huge_page_size)
+        return std::malloc(std::max<size_t>(bytes, 1));
+
+    size_t len = (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+    void* raw = mmap(nullptr, len + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED) return nullptr;
+
+    // Trim the mapping to an aligned range so it can be backed by huge pages entirely
+    uintptr_t start = (uintptr_t(raw) + huge_page_size - 1) & ~(uintptr_t(huge_page_size) - 1);
+    if(start > uintptr_t(raw)) munmap(raw, start - uintptr_t(raw));
+    uintptr_t end = uintptr_t(raw) + len + huge_page_size;
+    if(end > start + len) munmap((void*)(start + len), end - (start + len));
+    void* p = (void*)start;
+
+#ifdef MADV_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE);
+#endif
+    int nodes = topology::get().node_count();
+    if(nodes > 1){
+        const int mpolInterleave = 3;
+        unsigned long mask[16] = {};
+        for(int n = 0; n < nodes && n < int(8*sizeof(mask)); n++)
+            mask[n / (8*sizeof(unsigned long))] |= 1UL << (n % (8*sizeof(unsigned long)));
+        syscall(SYS_mbind, p, len, mpolInterleave, mask, 8*sizeof(mask), 0);
+    }
+    return p;
+}
+
+inline void free_large(void* p, size_t bytes){
+    if(p == nullptr) return;
+    if(bytes < huge_page_size){
+        std::free(p);
+        return;
+    }
+    munmap(p, (bytes + huge_page_size - 1) & ~(huge_page_size - 1));
+}
+
+template<typename T>
+struct huge_page_allocator {
+    using value_type = T;
+
+    huge_page_allocator() = default;
+    template<typename U> huge_page_allocator(const huge_page_allocator<U>&) {}
+
+    T* allocate(size_t n){
+        void* p = alloc_large(n*sizeof(T));
+        if(p == nullptr) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t n){
+        free_large(p, n*sizeof(T));
+    }
+
+    template<typename U> bool operator==(const huge_page_allocator<U>&) const { return true; }
+    template<typename U> bool operator!=(const huge_page_allocator<U>&) const { return false; }
+};
+
+// Storage of read-only scene data, written once while building the scene
+template<typename T>
+using scene_vector = std::vector<T, huge_page_allocator<T>>;
+
+}
+
+#endif
@@ -2,12 +2,19 @@
 #define PDF_H
 
 #include "vec3.h"
+#include "sampler.h"
+#include "warp.h"
 
 template <typename T>
 class pdf {
 public:
     virtual double val(const T& x) const = 0;
     virtual T generate() const = 0;
+
+    // Same as generate, with the random numbers read from the sampler
+    virtual T generate(sampler& smp) const {
+        return generate();
+    }
 };
 
 
@@ -17,11 +24,17 @@ public:
     uniform_sphere_pdf(){}
 
     double val(const vec3& x) const override {
-        return 1/(4*PI);
+        return warp_uniform_sphere_pdf();
     }
     vec3 generate() const override {
         return vec3::random_on_unit_sphere();
     };
+
+    vec3 generate(sampler& smp) const override {
+        double su, sv;
+        smp.get_2d(su, sv);
+        return warp_uniform_sphere(su, sv);
+    };
 };
 
 class uniform_hemisphere_pdf : public pdf<vec3>{
@@ -29,39 +42,43 @@ private:
     vec3 n;
 public:
 
-    uniform_hemisphere_pdf(const vec3& normal) : n(normal){}
+    uniform_hemisphere_pdf(const vec3& normal) : n(normal.normalized()){}
 
     double val(const vec3& x) const override {
-        return 1/(2*PI);
+        return dot(n, x) < 0.0 ? 0.0 : warp_uniform_hemisphere_pdf();
     }
     vec3 generate() const override {
-        return vec3::random_on_hemisphere(n);
+        return to_world(warp_uniform_hemisphere(randDouble(), randDouble()), n);
+    };
+
+    vec3 generate(sampler& smp) const override {
+        double su, sv;
+        smp.get_2d(su, sv);
+        return to_world(warp_uniform_hemisphere(su, sv), n);
     };
 };
 
+// Cosine weighted around n, restricted to the cone of half angle `angle` (radians) around it
 class cosine_hemisphere_pdf : public pdf<vec3>{
 private:
     vec3 n;
-    double angle = PI/2.0;
-    double sin_squared = 1.0;
+    double cos_max = 0.0;
 public:
 
-    cosine_hemisphere_pdf(const vec3& normal) : n(normal){}
-    cosine_hemisphere_pdf(const vec3& normal, double angle) : n(normal), angle(angle){
-        double sine = std::sin(angle*PI/180.0);
-        sin_squared = sine*sine;
-    }
+    cosine_hemisphere_pdf(const vec3& normal) : n(normal.normalized()){}
+    cosine_hemisphere_pdf(const vec3& normal, double angle) : n(normal.normalized()), cos_max(std::cos(std::fmin(angle, PI/2.0))){}
 
     double val(const vec3& x) const override {
-        double cos_theta = dot(n, x.normalized());
-        return cos_theta < 0.0 ? 0.0 : cos_theta/(PI*sin_squared);
+        return warp_cosine_hemisphere_pdf(dot(n, x.normalized()), cos_max);
     }
     vec3 generate() const override {
-        //std::clog << "Generating direciton via cosine pdf of angle " << angle << std::endl;
-        vec3 v = n + vec3::random_on_unit_sphere() * (angle*2.0/PI);
-        if(v.near_zero())
-            v = n;
-        return v;
+        return to_world(warp_cosine_hemisphere(randDouble(), randDouble(), cos_max), n);
+    };
+
+    vec3 generate(sampler& smp) const override {
+        double su, sv;
+        smp.get_2d(su, sv);
+        return to_world(warp_cosine_hemisphere(su, sv, cos_max), n);
     };
 };
 
@@ -78,7 +95,13 @@ public:
     }
 
     vec3 generate() const override {
-        return obj->random_point_towards(orig) - orig;
+        return obj->sample_direction(orig, randDouble(), randDouble());
+    };
+
+    vec3 generate(sampler& smp) const override {
+        double su, sv;
+        smp.get_2d(su, sv);
+        return obj->sample_direction(orig, su, sv);
     };
 };
 
@@ -123,6 +146,11 @@ public:
         return v2;
     };
 
+    T generate(sampler& smp) const override {
+        if(smp.get_1d() < p1) return v1;
+        return v2;
+    };
+
 
 };
 
@@ -168,6 +196,12 @@ public:
         return pdfs[index].first->generate();
     };
 
+    T generate(sampler& smp) const override {
+        double v = smp.get_1d() * cumsum.back();
+        int index = std::lower_bound(cumsum.begin(), cumsum.end(), v) - cumsum.begin();
+        return pdfs[index].first->generate(smp);
+    };
+
 };
 
 #endif
@@ -4,10 +4,16 @@
 #include "utils.h"
 #include "vec3.h"
 
+// Define PERLIN_REFERENCE to evaluate noise with the original loop based implementation.
+// The default path is unrolled and table driven but keeps the same evaluation order,
+// so both give bit identical results.
 class perlin {
 private:
     static const int point_count = 256;
-    vec3 randvec[point_count];
+    // Gradients are kept as three separate tables so batched lookups can be vectorized
+    double grad_x[point_count];
+    double grad_y[point_count];
+    double grad_z[point_count];
     int perm_x[point_count];
     int perm_y[point_count];
     int perm_z[point_count]; 
@@ -17,7 +23,8 @@ public:
 
     perlin() {
         for(int i = 0; i < point_count; i++){
-            randvec[i] = vec3::random_on_unit_sphere();
+            vec3 g = vec3::random_on_unit_sphere();
+            grad_x[i] = g.x(); grad_y[i] = g.y(); grad_z[i] = g.z();
         }
 
         perlin_generate_perm(perm_x);
@@ -26,30 +33,26 @@ public:
     }
 
     double noise(const point3& pt) const {
-        auto i = int(std::floor(pt.x()));
-        auto j = int(std::floor(pt.y()));
-        auto k = int(std::floor(pt.z()));
-
-        auto u = pt.x() - double(i);
-        auto v = pt.y() - double(j);
-        auto w = pt.z() - double(k);
-
-
-        vec3 c[2][2][2];
-
-        for(int di=0; di < 2; di++)
-            for(int dj=0; dj < 2; dj++)
-                for(int dk=0; dk < 2; dk++)
-                    c[di][dj][dk] = randvec[
-                        perm_x[(i+di)&255] ^
-                        perm_y[(j+dj)&255] ^
-                        perm_z[(k+dk)&255]
-                    ];
+#ifdef PERLIN_REFERENCE
+        return noise_reference(pt);
+#else
+        return noise_at(pt.x(), pt.y(), pt.z());
+#endif
+    }
 
-        return perlin_interp(c, u, v, w);
+    // Batch evaluation over n points given as separate coordinate arrays
+    void noise(const double* xs, const double* ys, const double* zs, double* out, int n) const {
+#ifdef PERLIN_REFERENCE
+        for(int s = 0; s < n; s++)
+            out[s] = noise_reference(point3(xs[s], ys[s], zs[s]));
+#else
+        #pragma omp simd
+        for(int s = 0; s < n; s++)
+            out[s] = noise_at(xs[s], ys[s], zs[s]);
+#endif
     }
 
-    double turb(const point3& pt, int depth){
+    double turb(const point3& pt, int depth) const {
         auto accum = 0.0;
         auto temp_p = pt;
         auto weight = 1.0;
@@ -63,7 +66,87 @@ public:
         return std::fabs(accum);
     }
 
+    // Batch turbulence, the octaves of all n points are evaluated together
+    void turb(const double* xs, const double* ys, const double* zs, double* out, int n, int depth) const {
+        for(int s = 0; s < n; s++)
+            out[s] = 0.0;
+
+        auto weight = 1.0;
+        auto freq = 1.0;
+        for (int i = 0; i < depth; i++) {
+            #pragma omp simd
+            for(int s = 0; s < n; s++)
+                out[s] += weight * noise_at(xs[s]*freq, ys[s]*freq, zs[s]*freq);
+            weight *= 0.5;
+            freq *= 2;
+        }
+
+        for(int s = 0; s < n; s++)
+            out[s] = std::fabs(out[s]);
+    }
+
 private:
+    inline double noise_at(double x, double y, double z) const {
+        int i = int(std::floor(x));
+        int j = int(std::floor(y));
+        int k = int(std::floor(z));
+
+        double u = x - double(i);
+        double v = y - double(j);
+        double w = z - double(k);
+
+        int px0 = perm_x[i&255], px1 = perm_x[(i+1)&255];
+        int py0 = perm_y[j&255], py1 = perm_y[(j+1)&255];
+        int pz0 = perm_z[k&255], pz1 = perm_z[(k+1)&255];
+
+        double uu = u*u*(3-2*u);
+        double vv = v*v*(3-2*v);
+        double ww = w*w*(3-2*w);
+        double wu0 = 1-uu, wv0 = 1-vv, ww0 = 1-ww;
+        double u1 = u-1, v1 = v-1, w1 = w-1;
+
+        // Corners in the same order as the reference triple loop
+        double accum = 0.0;
+        accum += wu0*wv0*ww0 * gdot(px0^py0^pz0, u,  v,  w );
+        accum += wu0*wv0*ww  * gdot(px0^py0^pz1, u,  v,  w1);
+        accum += wu0*vv *ww0 * gdot(px0^py1^pz0, u,  v1, w );
+        accum += wu0*vv *ww  * gdot(px0^py1^pz1, u,  v1, w1);
+        accum += uu *wv0*ww0 * gdot(px1^py0^pz0, u1, v,  w );
+        accum += uu *wv0*ww  * gdot(px1^py0^pz1, u1, v,  w1);
+        accum += uu *vv *ww0 * gdot(px1^py1^pz0, u1, v1, w );
+        accum += uu *vv *ww  * gdot(px1^py1^pz1, u1, v1, w1);
+
+        return accum;
+    }
+
+    inline double gdot(int h, double x, double y, double z) const {
+        return grad_x[h]*x + grad_y[h]*y + grad_z[h]*z;
+    }
+
+    double noise_reference(const point3& pt) const {
+        auto i = int(std::floor(pt.x()));
+        auto j = int(std::floor(pt.y()));
+        auto k = int(std::floor(pt.z()));
+
+        auto u = pt.x() - double(i);
+        auto v = pt.y() - double(j);
+        auto w = pt.z() - double(k);
+
+
+        vec3 c[2][2][2];
+
+        for(int di=0; di < 2; di++)
+            for(int dj=0; dj < 2; dj++)
+                for(int dk=0; dk < 2; dk++){
+                    int h = perm_x[(i+di)&255] ^
+                            perm_y[(j+dj)&255] ^
+                            perm_z[(k+dk)&255];
+                    c[di][dj][dk] = vec3(grad_x[h], grad_y[h], grad_z[h]);
+                }
+
+        return perlin_interp(c, u, v, w);
+    }
+
     static void perlin_generate_perm(int* p){
         for(int i = 0; i < point_count; i++)
             p[i] = i;
@@ -113,4 +196,4 @@ private:
     }
 };
 
-#endif
\ No newline at end of file
+#endif
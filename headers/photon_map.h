@@ -0,0 +1,305 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "common.h"
+#include "hittable.h"
+#include "material.h"
+#include "material_table.h"
+#include "sampler.h"
+#include "camera.h"
+#include "integrator.h"
+#include "emitters.h"
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+
+// Photons hashed into a uniform grid of cells twice as wide as the gather radius, so the photons
+// within the radius of a point are in the 2x2x2 cells around it. The photons of a hash bucket are
+// stored contiguously, in the order they were given so the gathered sums don't depend on the
+// threads that built the grid.
+class photon_grid {
+public:
+    struct photon {
+        float p[3];
+        float dir[3];       // direction the photon travelled along
+        float power[3];
+    };
+
+    void build(const std::vector<photon>& photons, double radius){
+        cellSize = 2*radius;
+        size_t n = photons.size(), tableSize = 1;
+        while(tableSize < 2*n) tableSize <<= 1;
+        mask = uint32_t(tableSize - 1);
+
+        // Counting sort of the photon indices by bucket
+        std::vector<uint32_t> bucketOf(n);
+        std::unique_ptr<std::atomic<uint32_t>[]> counts(new std::atomic<uint32_t>[tableSize]());
+        #pragma omp parallel for
+        for(size_t i = 0; i < n; i++){
+            const float* p = photons[i].p;
+            bucketOf[i] = bucket(cell(p[0]), cell(p[1]), cell(p[2]));
+            counts[bucketOf[i]].fetch_add(1, std::memory_order_relaxed);
+        }
+        bucketStart.assign(tableSize + 1, 0);
+        for(size_t b = 0; b < tableSize; b++){
+            bucketStart[b+1] = bucketStart[b] + counts[b].load(std::memory_order_relaxed);
+            counts[b].store(bucketStart[b], std::memory_order_relaxed);
+        }
+
+        std::vector<uint32_t> order(n);
+        #pragma omp parallel for
+        for(size_t i = 0; i < n; i++)
+            order[counts[bucketOf[i]].fetch_add(1, std::memory_order_relaxed)] = uint32_t(i);
+        #pragma omp parallel for schedule(dynamic, 4096)
+        for(size_t b = 0; b < tableSize; b++)
+            std::sort(order.begin() + bucketStart[b], order.begin() + bucketStart[b+1]);
+
+        sorted.resize(n);
+        #pragma omp parallel for
+        for(size_t i = 0; i < n; i++)
+            sorted[i] = photons[order[i]];
+    }
+
+    // Calls f(photon, squared distance) for the photons within radius of x, radius being at most
+    // the one the grid was built for
+    template<typename F>
+    void for_each_near(const point3& x, double radius, F&& f) const {
+        if(sorted.empty()) return;
+        int c[3], side[3];
+        for(int a = 0; a < 3; a++){
+            double g = x[a]/cellSize;
+            c[a] = int(std::floor(g));
+            side[a] = g - c[a] < 0.5 ? -1 : 1;
+        }
+
+        // Distinct cells may share a bucket, each bucket is visited once
+        uint32_t visited[8];
+        int nVisited = 0;
+        double r2 = radius*radius;
+        for(int k = 0; k < 8; k++){
+            uint32_t b = bucket(c[0] + ((k&1) ? side[0] : 0), c[1] + ((k&2) ? side[1] : 0), c[2] + ((k&4) ? side[2] : 0));
+            if(std::find(visited, visited + nVisited, b) != visited + nVisited) continue;
+            visited[nVisited++] = b;
+            for(uint32_t i = bucketStart[b]; i < bucketStart[b+1]; i++){
+                const photon& ph = sorted[i];
+                double dx = ph.p[0] - x[0], dy = ph.p[1] - x[1], dz = ph.p[2] - x[2];
+                double d2 = dx*dx + dy*dy + dz*dz;
+                if(d2 <= r2) f(ph, d2);
+            }
+        }
+    }
+
+    size_t size() const {
+        return sorted.size();
+    }
+
+    size_t bytes() const {
+        return sorted.size()*sizeof(photon) + bucketStart.size()*sizeof(uint32_t);
+    }
+
+private:
+    double cellSize = 1;
+    uint32_t mask = 0;
+    std::vector<uint32_t> bucketStart;
+    std::vector<photon> sorted;
+
+    int cell(double v) const {
+        return int(std::floor(v/cellSize));
+    }
+
+    uint32_t bucket(int x, int y, int z) const {
+        return ((uint32_t(x)*73856093u) ^ (uint32_t(y)*19349663u) ^ (uint32_t(z)*83492791u)) & mask;
+    }
+};
+
+// Photon mapping for the caustics (Jensen 1996). Photons are shot from the emitter_set of the
+// world through the specular surfaces, and stored where they land on a lambertian surface: their
+// density there is the light the specular chains focus. The camera paths are path traced as by
+// camera::ray_color, except that at lambertian hits the caustics come from the photons, and the
+// light of the emitters reached from there through specular surfaces only is left out.
+// With progressive set, the frame is rendered in passes of samplesPerPass samples, each with its
+// own photon map, gathered with a radius shrinking from pass to pass (Knaus and Zwicker 2011,
+// "Progressive Photon Mapping: A Probabilistic Approach"). Averaging the passes makes the bias
+// vanish while only one pass's photons are held at a time. Without it, a single map is gathered
+// with the initial radius.
+class photon_mapper : public integrator {
+public:
+    int photonsPerPass = 200000;    // photons shot for each map, most don't reach a specular surface
+    double radius = 0;              // gather radius of the first pass, 0 derives it from the scene bounds
+    bool progressive = true;
+    int samplesPerPass = 1;
+    double alpha = 2.0/3.0;         // how slowly the radius shrinks, in (0,1)
+
+    void prepare(const hittable& world, shared_ptr<hittable> lights, const camera& cam, int firstSample, int sampleCount) override {
+        materials = cam.materials.get();
+        emitters.build(world, *materials);
+        double r = radius;
+        if(r <= 0){
+            aabb b = world.bounding_box();
+            r = 0.002*std::sqrt(b.x.size()*b.x.size() + b.y.size()*b.y.size() + b.z.size()*b.z.size());
+        }
+        // The samples before the pass count as passes of their own
+        if(progressive){
+            double r2 = r*r;
+            for(int i = 1; i <= firstSample; i++) r2 *= (i + alpha)/(i + 1);
+            r = std::sqrt(r2);
+        }
+        passRadius = r;
+        shoot(world, cam, firstSample);
+    }
+
+    int pass_samples(int done) const override {
+        return progressive ? std::max(1, samplesPerPass) : 0;
+    }
+
+    color radiance(const ray& r, const hittable& world, shared_ptr<hittable> lights, const camera& cam,
+                   sampler& smp, film_tile& tile, aov_sample* aov) override {
+        color L(0,0,0), beta(1,1,1);
+        ray cur = r;
+        bool fromLambertian = false;    // the last non specular scattering was on a lambertian surface
+        int specularRun = 0;            // specular scatterings since then
+        for(int bounce = 0; bounce <= cam.maxRayBounce; bounce++){
+            hit_record hr;
+            if(!world.hit(cur, interval(0.001, infinity), hr)){
+                L += beta*cam.background(cur);
+                break;
+            }
+            hr.obj->surface_interaction(cur, hr);
+            hr.compute_differentials(cur);
+            const material* mat = materials->get(hr.mat_id);
+
+            // Emitters the photons left from already lit this path through its specular chain
+            bool inPhotons = fromLambertian && specularRun > 0 && emitters.pick_pdf(hr.obj) > 0
+                             && emitter_set::emits_towards(hr, -cur.direction());
+            if(!inPhotons)
+                L += beta*mat->emitted(hr.u, hr.v, hr.p);
+
+            scatter_rec sr;
+            bool scatters = mat->scatter(cur, hr, sr);
+            if(aov != nullptr && bounce == 0){
+                aov->hit = true;
+                aov->albedo = scatters ? sr.attenuation : color(1,1,1);
+                aov->normal = hr.normal;
+                aov->depth = hr.t * cur.direction().length();
+            }
+            if(!scatters) break;
+
+            if(sr.scattered_solid_angle < 0.1){
+                ray specular = ray(hr.p, sr.pdf_ptr->generate(smp), cur.time());
+                mat->scatter_differentials(cur, hr, specular);
+                beta = beta*sr.attenuation;
+                specularRun++;
+                cur = specular;
+                continue;
+            }
+
+            fromLambertian = mat->kind() == material_kind::lambertian;
+            specularRun = 0;
+            if(fromLambertian)
+                L += beta*sr.attenuation/PI*caustics(hr);
+
+            auto combined_pdf = linear_comb_pdf<vec3>();
+            combined_pdf.add(sr.pdf_ptr, 1.0);
+            if(lights != nullptr)
+                combined_pdf.add(make_shared<uniform_hittable_pdf>(lights, hr.p), 1.0);
+            double pdfval = 0;
+            ray scattered;
+            while(pdfval < EPSILON){
+                scattered = ray(hr.p, combined_pdf.generate(smp), cur.time());
+                pdfval = combined_pdf.val(scattered.direction());
+            }
+            beta = beta*sr.attenuation*(sr.pdf_ptr->val(scattered.direction())/pdfval);
+            cur = scattered;
+        }
+        return L;
+    }
+
+    shared_ptr<integrator> clone() const override {
+        return make_shared<photon_mapper>(*this);
+    }
+
+private:
+    emitter_set emitters;
+    const material_table* materials = nullptr;
+    photon_grid grid;
+    double passRadius = 1;
+
+    // Shoots photonsPerPass photons in chunks seeded from the frame and the pass, so the map
+    // doesn't depend on the threads
+    void shoot(const hittable& world, const camera& cam, int pass){
+        static const int chunk = 4096;
+        int count = std::max(0, photonsPerPass), chunks = (count + chunk - 1)/chunk;
+        std::vector<photon_grid::photon> slots(count);
+        std::vector<uint8_t> stored(count, 0);
+        #pragma omp parallel
+        {
+            independent_sampler smp;
+            #pragma omp for schedule(dynamic)
+            for(int c = 0; c < chunks; c++){
+                seed_thread_random(cam.frame_seed() ^ (uint64_t(pass + 1)*0xd1b54a32d192ed03ULL)
+                                                    ^ (uint64_t(c + 1)*0x9e3779b97f4a7c15ULL));
+                for(int i = c*chunk; i < std::min(count, (c + 1)*chunk); i++)
+                    stored[i] = trace_photon(world, cam.maxRayBounce, smp, 1.0/count, slots[i]);
+            }
+        }
+
+        std::vector<photon_grid::photon> photons;
+        for(int i = 0; i < count; i++)
+            if(stored[i]) photons.push_back(slots[i]);
+        grid.build(photons, passRadius);
+        std::clog << "Photon map of pass " << pass << ": " << grid.size() << " of " << count << " photons stored, radius "
+                  << passRadius << ", " << grid.bytes()/1024 << " KiB" << std::endl;
+    }
+
+    // Follows a photon through the specular surfaces, and stores it where it lands if that's a
+    // lambertian surface reached after at least one specular scattering
+    bool trace_photon(const hittable& world, int maxDepth, sampler& smp, double scale, photon_grid::photon& out) const {
+        hit_record hr;
+        vec3 dir;
+        double pdfPos, pdfDir;
+        if(!emitters.sample_emission(smp, hr, dir, pdfPos, pdfDir)) return false;
+        color power = materials->get(hr.mat_id)->emitted(hr.u, hr.v, hr.p)
+                    * (std::fabs(dot(dir, hr.normal))*scale/(pdfPos*pdfDir));
+
+        ray r(hr.p, dir);
+        for(int depth = 0; depth <= maxDepth; depth++){
+            hit_record h;
+            if(!world.hit(r, interval(0.001, infinity), h)) return false;
+            h.obj->surface_interaction(r, h);
+            const material* mat = materials->get(h.mat_id);
+            scatter_rec sr;
+            if(!mat->scatter(r, h, sr)) return false;
+            if(sr.scattered_solid_angle >= 0.1){
+                if(depth == 0 || mat->kind() != material_kind::lambertian) return false;
+                vec3 d = r.direction().normalized();
+                for(int a = 0; a < 3; a++){
+                    out.p[a] = float(h.p[a]);
+                    out.dir[a] = float(d[a]);
+                    out.power[a] = float(power[a]);
+                }
+                return true;
+            }
+            power = power*sr.attenuation;
+            r = ray(h.p, sr.pdf_ptr->generate(smp));
+        }
+        return false;
+    }
+
+    // Radiance density of the photons around the lambertian hit hr, without the albedo over pi.
+    // Only the photons arriving on the side hr is seen from and close to its tangent plane count.
+    color caustics(const hit_record& hr) const {
+        color sum(0,0,0);
+        grid.for_each_near(hr.p, passRadius, [&](const photon_grid::photon& ph, double d2){
+            vec3 d(ph.dir[0], ph.dir[1], ph.dir[2]);
+            vec3 offset = point3(ph.p[0], ph.p[1], ph.p[2]) - hr.p;
+            if(dot(d, hr.normal) >= 0 || std::fabs(dot(offset, hr.normal)) > 0.5*passRadius) return;
+            sum += color(ph.power[0], ph.power[1], ph.power[2]);
+        });
+        return sum/(PI*passRadius*passRadius);
+    }
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef POST_PROCESS_H
+#define POST_PROCESS_H
+
+#include "common.h"
+
+#include <vector>
+#include <algorithm>
+
+enum class tonemap_op { none, reinhard, filmic, aces };
+
+// Passes run on the linear float framebuffer once rendering is done, before gamma and quantization:
+//   exposure -> bloom -> tonemap
+// Each pass is a data parallel loop over the pixels. The default settings leave the image untouched.
+class post_process {
+public:
+    double exposure = 0.0;          // in stops, the image is scaled by 2^exposure
+    double sampleClamp = 0.0;       // max channel value of a single sample, 0 disables it (used while accumulating)
+    tonemap_op tonemap = tonemap_op::none;
+    double whitePoint = 11.2;       // linear value mapped to white by the filmic curve
+
+    double bloomStrength = 0.0;     // 0 disables bloom
+    double bloomThreshold = 1.0;    // only the part of a pixel above this value blooms
+    int bloomRadius = 8;            // in pixels
+
+    // Scales a sample down so none of its channels exceed sampleClamp, keeping its hue
+    color clamp_sample(const color& c) const {
+        if(sampleClamp <= 0) return c;
+        double m = std::fmax(c.x(), std::fmax(c.y(), c.z()));
+        if(m <= sampleClamp) return c;
+        return c * (sampleClamp / m);
+    }
+
+    void apply(std::vector<color>& image, int width, int height) const {
+        if(exposure != 0.0){
+            double scale = std::pow(2.0, exposure);
+            size_t n = image.size();
+            double* px = image[0].e;
+            #pragma omp parallel for simd
+            for(size_t i = 0; i < 3*n; i++)
+                px[i] *= scale;
+        }
+
+        if(bloomStrength > 0 && bloomRadius > 0)
+            bloom(image, width, height);
+
+        if(tonemap != tonemap_op::none){
+            size_t n = image.size();
+            double* px = image[0].e;
+            #pragma omp parallel for simd
+            for(size_t i = 0; i < 3*n; i++)
+                px[i] = tonemap_value(px[i]);
+        }
+    }
+
+private:
+    double tonemap_value(double x) const {
+        x = std::fmax(x, 0.0);
+        switch(tonemap){
+            case tonemap_op::reinhard:
+                return x / (1 + x);
+            case tonemap_op::filmic:
+                return hable(x) / hable(whitePoint);
+            case tonemap_op::aces: // Narkowicz's fit of the ACES reference rendering transform
+                return std::fmin(1.0, (x*(2.51*x + 0.03)) / (x*(2.43*x + 0.59) + 0.14));
+            default:
+                return x;
+        }
+    }
+
+    // Hable's filmic curve (Uncharted 2)
+    static double hable(double x) {
+        const double A = 0.15, B = 0.50, C = 0.10, D = 0.20, E = 0.02, F = 0.30;
+        return ((x*(A*x + C*B) + D*E) / (x*(A*x + B) + D*F)) - E/F;
+    }
+
+    // Adds a gaussian blur of the pixels brighter than bloomThreshold, the blur is separable so
+    // it runs as a horizontal pass over rows then a vertical pass over columns
+    void bloom(std::vector<color>& image, int width, int height) const {
+        int r = bloomRadius;
+        std::vector<double> kernel(r + 1);
+        double sigma = r / 3.0, sum = 0;
+        for(int i = 0; i <= r; i++){
+            kernel[i] = std::exp(-0.5*i*i/(sigma*sigma));
+            sum += i == 0 ? kernel[i] : 2*kernel[i];
+        }
+        for(double& k : kernel) k /= sum;
+
+        std::vector<color> bright(image.size()), tmp(image.size());
+        #pragma omp parallel for
+        for(size_t i = 0; i < image.size(); i++){
+            const color& c = image[i];
+            bright[i] = color(std::fmax(0.0, c.x() - bloomThreshold),
+                              std::fmax(0.0, c.y() - bloomThreshold),
+                              std::fmax(0.0, c.z() - bloomThreshold));
+        }
+
+        #pragma omp parallel for
+        for(int y = 0; y < height; y++){
+            const color* row = &bright[size_t(y)*width];
+            for(int x = 0; x < width; x++){
+                color acc = kernel[0]*row[x];
+                for(int k = 1; k <= r; k++)
+                    acc += kernel[k]*(row[std::max(x-k, 0)] + row[std::min(x+k, width-1)]);
+                tmp[size_t(y)*width + x] = acc;
+            }
+        }
+
+        #pragma omp parallel for
+        for(int x = 0; x < width; x++){
+            for(int y = 0; y < height; y++){
+                color acc = kernel[0]*tmp[size_t(y)*width + x];
+                for(int k = 1; k <= r; k++)
+                    acc += kernel[k]*(tmp[size_t(std::max(y-k, 0))*width + x] + tmp[size_t(std::min(y+k, height-1))*width + x]);
+                image[size_t(y)*width + x] += bloomStrength*acc;
+            }
+        }
+    }
+};
+
+#endif
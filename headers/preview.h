@@ -0,0 +1,249 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "common.h"
+#include "hittable.h"
+#include "camera.h"
+#include "film.h"
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <new>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A float framebuffer in a POSIX shared memory segment (/dev/shm/<name>), that a viewer in another
+// process maps and displays while the frame renders. The segment is a header followed by the
+// width*height RGB pixels as floats, row by row from the top, post processed but not gamma encoded.
+// The header's sequence is a seqlock: it is odd while the pixels are rewritten, a reader copies the
+// pixels between two equal even reads of it, or simply draws the mapping and tolerates tearing.
+class shm_framebuffer {
+public:
+    static const uint32_t magic = 0x42465450;     // "PTFB"
+    static const uint32_t version = 1;
+
+    struct header {
+        uint32_t magic, version;
+        int32_t width, height;
+        std::atomic<uint64_t> sequence;
+        uint32_t pass;          // passes published so far
+        uint32_t samples;       // samples per pixel of the published image, 0 for the reduced resolution pass
+        uint32_t done;          // set with the last pass
+        uint32_t pad;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "the sequence is shared between processes");
+
+    shm_framebuffer() {}
+    shm_framebuffer(const shm_framebuffer&) = delete;
+    shm_framebuffer& operator=(const shm_framebuffer&) = delete;
+
+    ~shm_framebuffer(){
+        close();
+    }
+
+    // Creates, or replaces, the segment name for a width x height image
+    bool create(const std::string& name, int width, int height){
+        close();
+        int fd = shm_open(shm_name(name).c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if(fd < 0){
+            std::clog << "Could not create shared memory " << name << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        size_t len = sizeof(header) + size_t(width)*height*3*sizeof(float);
+        if(ftruncate(fd, len) != 0 || !map(fd, len, true)){
+            std::clog << "Could not map shared memory " << name << ": " << std::strerror(errno) << std::endl;
+            ::close(fd);
+            shm_unlink(shm_name(name).c_str());
+            return false;
+        }
+        ::close(fd);
+        owned = shm_name(name);
+
+        header* h = new(base) header();
+        h->magic = magic; h->version = version;
+        h->width = width; h->height = height;
+        h->sequence.store(0, std::memory_order_release);
+        return true;
+    }
+
+    // Maps an existing segment read only, for viewers
+    bool attach(const std::string& name){
+        close();
+        int fd = shm_open(shm_name(name).c_str(), O_RDONLY, 0);
+        if(fd < 0) return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(header) && map(fd, st.st_size, false);
+        ::close(fd);
+        if(ok && (get_header()->magic != magic || get_header()->version != version
+                  || size_t(st.st_size) < sizeof(header) + size_t(get_header()->width)*get_header()->height*3*sizeof(float))){
+            std::clog << "Shared memory " << name << " isn't a framebuffer" << std::endl;
+            close();
+            return false;
+        }
+        return ok;
+    }
+
+    // Unmaps the segment, and removes it if this process created it. Viewers keep their mapping.
+    void close(){
+        if(base != nullptr) munmap(base, length);
+        if(!owned.empty()) shm_unlink(owned.c_str());
+        base = nullptr; length = 0; owned.clear();
+    }
+
+    // Copies image into the segment and publishes it as the given pass
+    void publish(const std::vector<color>& image, int pass, int samples, bool done){
+        header* h = get_header();
+        uint64_t seq = h->sequence.load(std::memory_order_relaxed);
+        h->sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        float* dst = pixels();
+        size_t n = std::min(image.size(), size_t(h->width)*h->height);
+        for(size_t i = 0; i < n; i++){
+            dst[3*i] = float(image[i].x()); dst[3*i+1] = float(image[i].y()); dst[3*i+2] = float(image[i].z());
+        }
+        h->pass = pass; h->samples = samples; h->done = done;
+
+        h->sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    // Reader side: copies a consistent image, returns false if none was published yet
+    bool snapshot(std::vector<float>& out, uint32_t& pass, uint32_t& samples, bool& done) const {
+        const header* h = get_header();
+        out.resize(size_t(h->width)*h->height*3);
+        for(;;){
+            uint64_t s0 = h->sequence.load(std::memory_order_acquire);
+            if(s0 == 0) return false;
+            if(s0 & 1) continue;
+            std::memcpy(out.data(), pixels(), out.size()*sizeof(float));
+            pass = h->pass; samples = h->samples; done = h->done != 0;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(h->sequence.load(std::memory_order_relaxed) == s0) return true;
+        }
+    }
+
+    header* get_header() const {
+        return static_cast<header*>(base);
+    }
+
+    float* pixels() const {
+        return reinterpret_cast<float*>(static_cast<char*>(base) + sizeof(header));
+    }
+
+private:
+    void* base = nullptr;
+    size_t length = 0;
+    std::string owned;
+
+    bool map(int fd, size_t len, bool writable){
+        void* p = mmap(nullptr, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED) return false;
+        base = p; length = len;
+        return true;
+    }
+
+    static std::string shm_name(const std::string& name){
+        return name.empty() || name[0] != '/' ? "/" + name : name;
+    }
+};
+
+// Renders cam's frame in passes, publishing the image to fb after each one:
+//  - a first pass of one sample per block of previewScale x previewScale pixels, shown as blocks,
+//    estimated by the camera's integrator when it has one
+//  - passes over the whole frame of 1, 1, 2, 4, ... samples per pixel, each adding its samples to
+//    the same film, up to samplesPerPixel
+// The passes take the same pixel samples as a single render of samplesPerPixel samples. If the
+// camera denoises, every published pass is denoised. The final image is written to out.
+inline void render_progressive(hittable& world, shared_ptr<hittable> lights, camera& cam, shm_framebuffer& fb,
+                               std::ostream& out = std::cout, int previewScale = 4){
+    world.commit_transform();
+    cam.begin_render();
+    int width = cam.imgWidth, height = cam.image_height();
+    std::vector<color> image(size_t(width)*height);
+    int pass = 0;
+
+    if(previewScale > 1){
+        int bw = (width + previewScale - 1)/previewScale, bh = (height + previewScale - 1)/previewScale;
+        // The integrator's splats go to their own film, added to the blocks once they are all traced
+        film splatFilm(width, height, cam.pixelFilter);
+        shared_ptr<integrator> integ = cam.radianceIntegrator;
+        if(integ != nullptr){
+            integ->prepare(world, lights, cam, 0, 1);
+            if(integ->splats())
+                splatFilm.enable_splats();
+        }
+        #pragma omp parallel
+        {
+            shared_ptr<sampler> smp = cam.pixelSampler->clone();
+            #pragma omp for schedule(dynamic)
+            for(int by = 0; by < bh; by++){
+                seed_thread_random(cam.frame_seed() ^ (uint64_t(by + 1) * 0xd6e8feb86659fd93ULL));
+                for(int bx = 0; bx < bw; bx++){
+                    int x0 = bx*previewScale, y0 = by*previewScale;
+                    int x1 = std::min(x0 + previewScale, width), y1 = std::min(y0 + previewScale, height);
+                    smp->start_pixel_sample(x0, y0, 0);
+                    double su, sv;
+                    smp->get_2d(su, sv);
+                    double fx = x0 + su*(x1 - x0), fy = y0 + sv*(y1 - y0);
+                    ray r = cam.get_ray_at(fx, fy, *smp);
+                    color c;
+                    if(integ != nullptr){
+                        film_tile tile = splatFilm.make_tile(x0, y0, x1, y1);
+                        c = integ->radiance(r, world, lights, cam, *smp, tile, nullptr);
+                        splatFilm.merge_tile(tile);
+                    } else {
+                        c = cam.ray_color(r, world, cam.maxRayBounce, lights, *smp);
+                    }
+                    c = cam.post.clamp_sample(c);
+                    for(int y = y0; y < y1; y++)
+                        for(int x = x0; x < x1; x++)
+                            image[size_t(y)*width + x] = c;
+                }
+            }
+        }
+        if(integ != nullptr && integ->splats()){
+            std::vector<color> splats = splatFilm.resolve();
+            for(size_t i = 0; i < image.size(); i++) image[i] += splats[i];
+        }
+        cam.post.apply(image, width, height);
+        fb.publish(image, ++pass, 0, false);
+    }
+
+    film flm(width, height, cam.pixelFilter);
+    std::vector<int> tiles(cam.tile_count());
+    for(int t = 0; t < cam.tile_count(); t++) tiles[t] = t;
+    if(cam.guide != nullptr)
+        cam.guide->reset(world.bounding_box());
+    int done = 0;
+    while(done < cam.samplesPerPixel){
+        int n = std::min(std::max(done, 1), cam.samplesPerPixel - done);
+        std::clog << "Pass " << pass + 1 << ", samples " << done << " to " << done + n << std::endl;
+        if(cam.guide != nullptr)
+            cam.guide->set_training(done + n < cam.samplesPerPixel);
+        cam.render_tiles(world, lights, flm, tiles, done, n);
+        done += n;
+        if(cam.guide != nullptr && cam.guide->training())
+            cam.guide->refine(n);
+
+        image = flm.resolve();
+        if(done == cam.samplesPerPixel){
+            if(!cam.aovPrefix.empty())
+                cam.aovs.write(cam.aovPrefix);
+        }
+        if(cam.denoise)
+            cam.denoiser.apply(image, cam.aovs);
+        cam.post.apply(image, width, height);
+        fb.publish(image, ++pass, done, done == cam.samplesPerPixel);
+    }
+    cam.write_image(image, out);
+}
+
+#endif
@@ -5,9 +5,13 @@
 #define STBI_FAILURE_USERMSG
 #include "stb_image.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <string>
+#include <vector>
+
+#include "numa.h"
 
 class pt_image {
 private:
@@ -18,6 +22,12 @@ private:
     int            image_height = 0;        // Loaded image height
     int            bytes_per_scanline = 0;
 
+    struct mip_level {
+        int width, height;
+        numa::scene_vector<unsigned char> data;
+    };
+    std::vector<mip_level> mips;            // Downsampled copies of bdata, mips[0] is half resolution
+
 public:
     pt_image() {}
 
@@ -50,12 +60,17 @@ public:
 
         bytes_per_scanline = image_width * bytes_per_pixel;
         convert_to_bytes();
+        build_mips();
         return true;
     }
 
     int width()  const { return (fdata == nullptr) ? 0 : image_width; }
     int height() const { return (fdata == nullptr) ? 0 : image_height; }
 
+    int mip_levels() const { return 1 + mips.size(); }
+    int width(int level)  const { return level == 0 ? width()  : mips[level-1].width; }
+    int height(int level) const { return level == 0 ? height() : mips[level-1].height; }
+
     const unsigned char* pixel_data(int x, int y) const {
         // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
         // data, returns magenta.
@@ -68,6 +83,16 @@ public:
         return bdata + y*bytes_per_scanline + x*bytes_per_pixel;
     }
 
+    const unsigned char* pixel_data(int x, int y, int level) const {
+        if (level == 0 || bdata == nullptr) return pixel_data(x, y);
+
+        const mip_level& m = mips[level-1];
+        x = clamp(x, 0, m.width);
+        y = clamp(y, 0, m.height);
+
+        return m.data.data() + (y*m.width + x)*bytes_per_pixel;
+    }
+
 private:
     static int clamp(int x, int low, int high) {
         // Return the value clamped to the range [low, high).
@@ -89,7 +114,7 @@ private:
         // data in the `bdata` member.
 
         int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
+        bdata = static_cast<unsigned char*>(numa::alloc_large(total_bytes));
 
         // Iterate through all pixel components, converting from [0.0, 1.0] float values to
         // unsigned [0, 255] byte values.
@@ -99,6 +124,34 @@ private:
         for (auto i=0; i < total_bytes; i++, fptr++, bptr++)
             *bptr = float_to_byte(*fptr);
     }
+
+    void build_mips() {
+        // Build the mip chain down to 1x1, each level is a 2x2 box filter of the previous one.
+
+        mips.clear();
+        int w = image_width, h = image_height;
+        const unsigned char* src = bdata;
+        while (w > 1 || h > 1) {
+            int nw = std::max(1, w/2), nh = std::max(1, h/2);
+            mip_level m = { nw, nh, numa::scene_vector<unsigned char>(nw*nh*bytes_per_pixel) };
+
+            for (int y = 0; y < nh; y++) {
+                int y0 = std::min(2*y, h-1), y1 = std::min(2*y+1, h-1);
+                for (int x = 0; x < nw; x++) {
+                    int x0 = std::min(2*x, w-1), x1 = std::min(2*x+1, w-1);
+                    for (int c = 0; c < bytes_per_pixel; c++) {
+                        int sum = src[(y0*w + x0)*bytes_per_pixel + c] + src[(y0*w + x1)*bytes_per_pixel + c]
+                                + src[(y1*w + x0)*bytes_per_pixel + c] + src[(y1*w + x1)*bytes_per_pixel + c];
+                        m.data[(y*nw + x)*bytes_per_pixel + c] = (unsigned char)((sum + 2) / 4);
+                    }
+                }
+            }
+
+            mips.push_back(std::move(m));
+            w = nw; h = nh;
+            src = mips.back().data.data();
+        }
+    }
 };
 
 #endif
\ No newline at end of file
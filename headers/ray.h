@@ -10,6 +10,12 @@ private:
     double tm; // time at which the ray was sent
 
 public:
+    // Ray differentials: two auxiliary rays offset by (a fraction of) a pixel in x and y,
+    // used to estimate the footprint of the ray on the surfaces it hits
+    bool has_differentials = false;
+    point3 rx_origin, ry_origin;
+    vec3 rx_direction, ry_direction;
+
     ray() {}
 
     ray(const point3& origin, const vec3& direction): orig(origin), dir(direction), tm(0) {}
@@ -22,8 +28,15 @@ public:
     point3 at(double t) const{
         return orig + t*dir;
     }
+
+    void set_differentials(const point3& rxo, const vec3& rxd, const point3& ryo, const vec3& ryd){
+        has_differentials = true;
+        rx_origin = rxo; rx_direction = rxd;
+        ry_origin = ryo; ry_direction = ryd;
+    }
+
     friend std::ostream& operator<<(std::ostream& out, const ray& r);
 };
 
 
-#endif
\ No newline at end of file
+#endif
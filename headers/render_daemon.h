@@ -0,0 +1,192 @@
+#ifndef RENDER_DAEMON_H
+#define RENDER_DAEMON_H
+
+#include "common.h"
+#include "scene.h"
+#include "distributed.h"
+#include "bdpt.h"
+#include "photon_map.h"
+#include "wavefront.h"
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+
+// Keeps one scene built, with its BVHs and textures loaded and its transforms committed, and
+// renders the jobs sent to a local socket one after the other. A job is a line of key=value pairs:
+//
+//   out=/tmp/view.ppm width=400 spp=64 lookfrom=0,2,9 lookat=0,0,0 fov=40
+//
+// out is required, the other keys override the scene camera for that job only:
+//   width aspect spp bounces fov lookfrom lookat vup defocus focus seed exposure denoise
+// aov (prefix of the AOV files written with the image), filter (box, gaussian or mitchell),
+// sampler (sobol, zsobol or independent) and integrator, path (the default), wavefront (path tracing by batches of samples), bdpt, photons
+// or ppm (progressive photon mapping).
+// Each job is answered with a line, "ok <seconds>" or "error <reason>". "quit" stops the daemon.
+class render_daemon {
+public:
+    std::string address;        // unix:<path>, jobs write files so only local clients are served
+
+    // Serves jobs until a client sends quit, returns false if the address isn't a unix socket or
+    // can't be listened on
+    bool serve(scene& scn){
+        bool isUnix; std::string host, port;
+        if(!dist::parse_address(address, isUnix, host, port) || !isUnix){
+            std::clog << "The render daemon only listens on unix: sockets, not " << address << std::endl;
+            return false;
+        }
+        int lfd = dist::listen_on(address);
+        if(lfd < 0) return false;
+
+        scn.world.commit_transform();
+        std::clog << "Serving render jobs on " << address << std::endl;
+
+        bool running = true;
+        while(running){
+            int fd = accept(lfd, nullptr, nullptr);
+            if(fd < 0){
+                if(errno == EINTR) continue;
+                std::clog << "Render daemon accept failed: " << std::strerror(errno) << std::endl;
+                break;
+            }
+
+            std::string pending, line;
+            while(running && read_line(fd, pending, line)){
+                if(line.empty()) continue;
+                if(line == "quit"){
+                    running = false;
+                    dist::write_all(fd, "ok\n", 3);
+                    break;
+                }
+                std::string reply = run_job(scn, line) + "\n";
+                if(!dist::write_all(fd, reply.data(), reply.size())) break;
+            }
+            close(fd);
+        }
+
+        close(lfd);
+        unlink(host.c_str());
+        return true;
+    }
+
+    // Client side: sends one job line to the daemon at addr and returns its answer
+    static std::string submit(const std::string& addr, const std::string& job){
+        int fd = dist::connect_to(addr, 1);
+        if(fd < 0) return "error no daemon at " + addr;
+        std::string line = job + "\n", pending, reply;
+        if(!dist::write_all(fd, line.data(), line.size()) || !read_line(fd, pending, reply))
+            reply = "error the daemon closed the connection";
+        close(fd);
+        return reply;
+    }
+
+private:
+    // Renders one job with a copy of the scene camera, the scene itself is shared by every job
+    static std::string run_job(const scene& scn, const std::string& line){
+        camera cam = scn.cam;
+        std::string outPath, err;
+        if(!parse_job(line, cam, outPath, err))
+            return "error " + err;
+
+        std::ofstream out(outPath);
+        if(!out)
+            return "error can't write " + outPath;
+
+        auto start = std::chrono::steady_clock::now();
+        cam.render_frame(scn.world, scn.lights, out);
+        out.close();
+        if(!out)
+            return "error writing " + outPath + " failed";
+        return "ok " + std::to_string(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    static bool parse_job(const std::string& line, camera& cam, std::string& outPath, std::string& err){
+        std::istringstream in(line);
+        std::string kv;
+        while(in >> kv){
+            size_t eq = kv.find('=');
+            if(eq == std::string::npos){ err = "expected key=value, got " + kv; return false; }
+            std::string key = kv.substr(0, eq), val = kv.substr(eq + 1);
+
+            bool ok = true;
+            if(key == "out") outPath = val;
+            else if(key == "width") ok = parse_number(val, cam.imgWidth) && cam.imgWidth > 0;
+            else if(key == "aspect") ok = parse_number(val, cam.aspectRatio) && cam.aspectRatio > 0;
+            else if(key == "spp") ok = parse_number(val, cam.samplesPerPixel) && cam.samplesPerPixel > 0;
+            else if(key == "bounces") ok = parse_number(val, cam.maxRayBounce);
+            else if(key == "fov") ok = parse_number(val, cam.vertFOV);
+            else if(key == "defocus") ok = parse_number(val, cam.defocusAngle);
+            else if(key == "focus") ok = parse_number(val, cam.focusDist);
+            else if(key == "seed") ok = parse_number(val, cam.seed);
+            else if(key == "exposure") ok = parse_number(val, cam.post.exposure);
+            else if(key == "denoise") ok = parse_number(val, cam.denoise);
+            else if(key == "aov") cam.aovPrefix = val;
+            else if(key == "lookfrom") ok = parse_vec(val, cam.lookfrom);
+            else if(key == "lookat") ok = parse_vec(val, cam.lookat);
+            else if(key == "vup") ok = parse_vec(val, cam.vup);
+            else if(key == "filter"){
+                shared_ptr<filter> f = make_filter(val);
+                ok = f != nullptr;
+                if(ok) cam.pixelFilter = f;
+            }
+            else if(key == "sampler"){
+                shared_ptr<sampler> smp = make_sampler(val);
+                ok = smp != nullptr;
+                if(ok) cam.pixelSampler = smp;
+            }
+            else if(key == "integrator"){
+                ok = val == "path" || val == "wavefront" || val == "bdpt" || val == "photons" || val == "ppm";
+                if(val == "path") cam.radianceIntegrator = nullptr;
+                else if(val == "wavefront") cam.radianceIntegrator = make_shared<wavefront_integrator>();
+                else if(val == "bdpt") cam.radianceIntegrator = make_shared<bdpt_integrator>();
+                else if(val == "photons" || val == "ppm"){
+                    auto photons = make_shared<photon_mapper>();
+                    photons->progressive = val == "ppm";
+                    cam.radianceIntegrator = photons;
+                }
+            }
+            else { err = "unknown key " + key; return false; }
+
+            if(!ok){ err = "bad value for " + key + ": " + val; return false; }
+        }
+        if(outPath.empty()){ err = "missing out=<path>"; return false; }
+        return true;
+    }
+
+    template<typename T>
+    static bool parse_number(const std::string& s, T& v){
+        std::istringstream in(s);
+        T tmp;
+        if(!(in >> tmp) || !in.eof()) return false;
+        v = tmp;
+        return true;
+    }
+
+    static bool parse_vec(const std::string& s, vec3& v){
+        std::istringstream in(s);
+        double x, y, z;
+        char c1, c2;
+        if(!(in >> x >> c1 >> y >> c2 >> z) || c1 != ',' || c2 != ',') return false;
+        v = vec3(x, y, z);
+        return true;
+    }
+
+    // Reads up to the next newline, pending keeps what was received past it
+    static bool read_line(int fd, std::string& pending, std::string& line){
+        size_t nl;
+        while((nl = pending.find('\n')) == std::string::npos){
+            char buf[4096];
+            ssize_t r = recv(fd, buf, sizeof(buf), 0);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) return false;
+            pending.append(buf, r);
+        }
+        line = pending.substr(0, nl);
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        pending.erase(0, nl + 1);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "common.h"
+
+#include <cstdint>
+#include <algorithm>
+#include <string>
+
+// Source of the random numbers of one camera sample. The camera calls start_pixel_sample
+// before tracing sample `index` of a pixel, then every random decision of the path reads
+// the next dimension with get_1d/get_2d. Samplers are stateful, each thread uses a clone.
+class sampler {
+public:
+    virtual ~sampler() = default;
+
+    // Called once per render, before any sample is drawn
+    virtual void init(int width, int height, int spp) {}
+
+    // Number of samples per pixel the sampler actually takes when spp are requested
+    virtual int round_count(int spp) const { return spp; }
+
+    virtual void start_pixel_sample(int px, int py, int index) = 0;
+    virtual double get_1d() = 0;
+    virtual void get_2d(double& u, double& v) = 0;
+
+    // Dimension the next get_1d/get_2d reads. A sample can be suspended by saving it, and
+    // resumed after start_pixel_sample by restoring it, to interleave the samples of a batch.
+    virtual int dimension() const { return 0; }
+    virtual void set_dimension(int d) {}
+
+    virtual shared_ptr<sampler> clone() const = 0;
+};
+
+
+class independent_sampler : public sampler {
+public:
+    void start_pixel_sample(int px, int py, int index) override {}
+
+    double get_1d() override {
+        return randDouble();
+    }
+
+    void get_2d(double& u, double& v) override {
+        u = randDouble(); v = randDouble();
+    }
+
+    shared_ptr<sampler> clone() const override {
+        return make_shared<independent_sampler>(*this);
+    }
+};
+
+
+// Building blocks shared by the Sobol samplers
+namespace sobol {
+
+    inline uint64_t mix_bits(uint64_t v) {
+        v ^= (v >> 31);
+        v *= 0x7fb5d329728ea185ULL;
+        v ^= (v >> 27);
+        v *= 0x81dadef4bc2dd44dULL;
+        v ^= (v >> 33);
+        return v;
+    }
+
+    inline uint64_t hash(uint64_t a, uint64_t b, uint64_t c = 0) {
+        return mix_bits(a ^ mix_bits(b ^ mix_bits(c)));
+    }
+
+    inline uint32_t reverse_bits(uint32_t v) {
+        v = (v << 16) | (v >> 16);
+        v = ((v & 0x00ff00ff) << 8) | ((v & 0xff00ff00) >> 8);
+        v = ((v & 0x0f0f0f0f) << 4) | ((v & 0xf0f0f0f0) >> 4);
+        v = ((v & 0x33333333) << 2) | ((v & 0xcccccccc) >> 2);
+        v = ((v & 0x55555555) << 1) | ((v & 0xaaaaaaaa) >> 1);
+        return v;
+    }
+
+    // First two dimensions of the Sobol sequence, as 32 bits fractions
+    inline uint32_t dim0(uint32_t i) {
+        return reverse_bits(i);
+    }
+
+    inline uint32_t dim1(uint32_t i) {
+        uint32_t r = 0;
+        for(uint32_t c = 1u << 31; i; i >>= 1, c ^= c >> 1)
+            if(i & 1) r ^= c;
+        return r;
+    }
+
+    // Hash based nested uniform (Owen) scrambling, Laine and Karras 2011 / Burley 2020
+    inline uint32_t owen_scramble(uint32_t v, uint32_t seed) {
+        v = reverse_bits(v);
+        v ^= v * 0x3d20adeau;
+        v += seed;
+        v *= (seed >> 16) | 1;
+        v ^= v * 0x05526c56u;
+        v ^= v * 0x53a22864u;
+        return reverse_bits(v);
+    }
+
+    inline double to_double(uint32_t v) {
+        return std::fmin(v * 0x1p-32, 1 - 0x1p-53);
+    }
+
+    // Element i of a random permutation of [0, l) selected by p, Kensler 2013
+    inline uint32_t permutation_element(uint32_t i, uint32_t l, uint32_t p) {
+        uint32_t w = l - 1;
+        w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+        do {
+            i ^= p;             i *= 0xe170893d;
+            i ^= p >> 16;       i ^= (i & w) >> 4;
+            i ^= p >> 8;        i *= 0x0929eb3f;
+            i ^= p >> 23;       i ^= (i & w) >> 1;
+            i *= 1 | p >> 27;   i *= 0x6935fa69;
+            i ^= (i & w) >> 11; i *= 0x74dcb303;
+            i ^= (i & w) >> 2;  i *= 0x9e501cc3;
+            i ^= (i & w) >> 2;  i *= 0xc860a3df;
+            i &= w;             i ^= i >> 5;
+        } while(i >= l);
+        return (i + p) % l;
+    }
+
+    inline uint64_t morton2(uint32_t x, uint32_t y) {
+        uint64_t m = 0;
+        for(int b = 0; b < 32; b++)
+            m |= (uint64_t((x >> b) & 1) << (2*b)) | (uint64_t((y >> b) & 1) << (2*b + 1));
+        return m;
+    }
+}
+
+
+// Owen scrambled Sobol points, padded dimension by dimension (Burley 2020): every 1D or 2D
+// dimension draws the first two Sobol dimensions with its own scramble, and the samples of
+// a pixel are shuffled independently for each dimension so dimensions stay uncorrelated.
+class sobol_sampler : public sampler {
+private:
+    uint64_t seed;
+    int spp = 1;
+    uint64_t pixelHash = 0;
+    uint32_t index = 0;
+    int dim = 0;
+
+public:
+    sobol_sampler(uint64_t seed = 0): seed(seed) {}
+
+    void init(int width, int height, int spp) override {
+        this->spp = spp;
+    }
+
+    void start_pixel_sample(int px, int py, int index) override {
+        pixelHash = sobol::hash(uint64_t(px) | (uint64_t(py) << 32), seed);
+        this->index = index;
+        dim = 0;
+    }
+
+    double get_1d() override {
+        uint64_t h = sobol::hash(pixelHash, dim++);
+        uint32_t i = sobol::permutation_element(index, spp, uint32_t(h));
+        return sobol::to_double(sobol::owen_scramble(sobol::dim0(i), uint32_t(h >> 32)));
+    }
+
+    void get_2d(double& u, double& v) override {
+        uint64_t h = sobol::hash(pixelHash, dim++);
+        uint64_t hs = sobol::mix_bits(h);
+        uint32_t i = sobol::permutation_element(index, spp, uint32_t(h));
+        u = sobol::to_double(sobol::owen_scramble(sobol::dim0(i), uint32_t(hs)));
+        v = sobol::to_double(sobol::owen_scramble(sobol::dim1(i), uint32_t(hs >> 32)));
+    }
+
+    int dimension() const override {
+        return dim;
+    }
+
+    void set_dimension(int d) override {
+        dim = d;
+    }
+
+    shared_ptr<sampler> clone() const override {
+        return make_shared<sobol_sampler>(*this);
+    }
+};
+
+
+// Owen scrambled Sobol points spread over the image along a randomized Morton curve
+// (Ahmed and Wonka 2020), so the error of neighbouring pixels is blue noise.
+// The sample count is rounded up to a power of two.
+class zsobol_sampler : public sampler {
+private:
+    uint64_t seed;
+    int log2spp = 0;
+    int base4Digits = 0;
+    uint64_t mortonIndex = 0;
+    int dim = 0;
+
+public:
+    zsobol_sampler(uint64_t seed = 0): seed(seed) {}
+
+    int round_count(int spp) const override {
+        int n = 1;
+        while(n < spp) n <<= 1;
+        return n;
+    }
+
+    void init(int width, int height, int spp) override {
+        log2spp = 0;
+        while((1 << log2spp) < spp) log2spp++;
+        int log2res = 0;
+        while((1 << log2res) < std::max(width, height)) log2res++;
+        base4Digits = log2res + (log2spp + 1)/2;
+    }
+
+    void start_pixel_sample(int px, int py, int index) override {
+        mortonIndex = (sobol::morton2(px, py) << log2spp) | uint64_t(index);
+        dim = 0;
+    }
+
+    double get_1d() override {
+        uint64_t i = sample_index();
+        uint32_t h = uint32_t(sobol::hash(dim++, seed));
+        return sobol::to_double(sobol::owen_scramble(sobol::dim0(uint32_t(i)), h));
+    }
+
+    void get_2d(double& u, double& v) override {
+        uint64_t i = sample_index();
+        uint64_t h = sobol::hash(dim++, seed);
+        u = sobol::to_double(sobol::owen_scramble(sobol::dim0(uint32_t(i)), uint32_t(h)));
+        v = sobol::to_double(sobol::owen_scramble(sobol::dim1(uint32_t(i)), uint32_t(h >> 32)));
+    }
+
+    int dimension() const override {
+        return dim;
+    }
+
+    void set_dimension(int d) override {
+        dim = d;
+    }
+
+    shared_ptr<sampler> clone() const override {
+        return make_shared<zsobol_sampler>(*this);
+    }
+
+private:
+    // Global Sobol index of the current sample, the base 4 digits of the Morton index are
+    // shuffled with a permutation chosen from the higher digits and the dimension
+    uint64_t sample_index() const {
+        static const uint8_t permutations[24][4] = {
+            {0,1,2,3}, {0,1,3,2}, {0,2,1,3}, {0,2,3,1}, {0,3,2,1}, {0,3,1,2},
+            {1,0,2,3}, {1,0,3,2}, {1,2,0,3}, {1,2,3,0}, {1,3,2,0}, {1,3,0,2},
+            {2,1,0,3}, {2,1,3,0}, {2,0,1,3}, {2,0,3,1}, {2,3,0,1}, {2,3,1,0},
+            {3,1,2,0}, {3,1,0,2}, {3,2,1,0}, {3,2,0,1}, {3,0,2,1}, {3,0,1,2}};
+
+        uint64_t index = 0;
+        bool oddLog2 = log2spp & 1;
+        int lastDigit = oddLog2 ? 1 : 0;
+        for(int d = base4Digits - 1; d >= lastDigit; d--){
+            int shift = 2*d - (oddLog2 ? 1 : 0);
+            int digit = (mortonIndex >> shift) & 3;
+            uint64_t higher = mortonIndex >> (shift + 2);
+            int p = (sobol::mix_bits(higher ^ (0x55555555ULL * dim) ^ seed) >> 24) % 24;
+            index |= uint64_t(permutations[p][digit]) << shift;
+        }
+        if(oddLog2){
+            int digit = mortonIndex & 1;
+            index |= digit ^ (sobol::mix_bits((mortonIndex >> 1) ^ (0x55555555ULL * dim) ^ seed) & 1);
+        }
+        return index;
+    }
+};
+
+// Sampler by name, sobol, zsobol or independent, nullptr for any other name
+inline shared_ptr<sampler> make_sampler(const std::string& name){
+    if(name == "sobol") return make_shared<sobol_sampler>();
+    if(name == "zsobol") return make_shared<zsobol_sampler>();
+    if(name == "independent") return make_shared<independent_sampler>();
+    return nullptr;
+}
+
+#endif
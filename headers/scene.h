@@ -0,0 +1,20 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "common.h"
+#include "hittable_list.h"
+#include "camera.h"
+#include "arena.h"
+
+// What a scene function builds: the objects, the ones to sample as lights and the camera
+// looking at them. Rendering is left to the caller, locally or spread over worker processes.
+// The arena owns the objects allocated in it and the table of the materials the camera shades
+// with, it comes first so it is destroyed last.
+struct scene {
+    shared_ptr<scene_arena> arena;
+    hittable_list world;
+    shared_ptr<hittable> lights;
+    camera cam;
+};
+
+#endif
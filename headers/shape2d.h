@@ -4,6 +4,8 @@
 #include "transform.h"
 #include "hittable.h"
 #include "aabb.h"
+#include "material_table.h"
+#include "warp.h"
 
 
 // abstract class for all 2D shapes
@@ -42,6 +44,10 @@ public:
         only_normal_face = b;
     }
 
+    bool two_sided() const override {
+        return !only_normal_face;
+    }
+
     void commit_transform() override{
 #ifdef SIMPLE_DEBUG
         std::clog << "Committed sahpe2d transform" << std::endl;
@@ -67,21 +73,33 @@ public:
         by_vector_formula(p, alpha, beta);
     }
 
+    // Area sampling density, the spherical samplers of quad and triangle fall back on it
     double pdf_value(const point3& orig, const vec3& dir) const override{
+        double t, alpha, beta;
+        if(!line_coordinates(orig, dir, &t, &alpha, &beta) || !contains(alpha, beta)) return 0;
+        return area_pdf(dir, t);
+    }
 
-        //std::clog << "Computing PDF val for quad with area " << area << std::endl;
+    // Intersection of the half line (orig, dir) with the plane, and its planar coordinates
+    bool line_coordinates(const point3& orig, const vec3& dir, double* t, double* alpha, double* beta) const {
+        double nd = dot(normal, dir);
+        if(std::fabs(nd) <= EPSILON) return false;
+        if(only_normal_face && nd >= -EPSILON) return false;
+        *t = (D - dot(normal, orig))/nd;
+        if(*t <= 0) return false;
+        planar_coordinates(orig + *t*dir, alpha, beta);
+        return true;
+    }
 
-        hit_record hr;
-        if(!hit(ray(orig, dir), interval(0.001, infinity), hr))
-            return 0;
-    
-        double dist2 = hr.t*hr.t*dir.length_squared();
-        double dt = dot(dir, normal);
-        if(only_normal_face && dt > 0) return 0;
-        double cosine = std::fabs(dt) / dir.length();
-        double proj_area = cosine*area;
-        //std::clog << "UHPDF val is " << dist2 << "/" << proj_area  << " = " << dist2/proj_area << std::endl;
-        return dist2/proj_area;
+    double area_pdf(const vec3& dir, double t) const {
+        double len2 = dir.length_squared();
+        double cosine = std::fabs(dot(dir, normal)) / std::sqrt(len2);
+        return t*t*len2 / (cosine*area);
+    }
+
+    // Single faced shapes are only seen from the side their normal points to
+    bool seen_from(const point3& orig) const {
+        return !only_normal_face || dot(orig - q, normal) > EPSILON;
     }
 
     bool ray_plane_intersection(const ray& r, double* hitTime) const{
@@ -99,7 +117,17 @@ public:
         return true;
     }
 
-    virtual bool is_interior(double alpha, double beta, hit_record& hr) const = 0;
+    virtual bool contains(double alpha, double beta) const = 0;
+
+    bool is_interior(double alpha, double beta, hit_record& hr) const {
+        if(!contains(alpha, beta)) return false;
+        hr.u = alpha; hr.v = beta;
+        return true;
+    }
+
+protected:
+    // Below this solid angle the spherical samplers lose precision, shapes are sampled by area instead
+    static constexpr double min_spherical_angle = 3e-4;
 
 private:
     void by_vector_formula(const point3& p, double* ka, double* kb) const {
@@ -156,19 +184,122 @@ private:
 
 };
 
+// Solid angle subtended by the rectangle s + [0,1]*ex + [0,1]*ey seen from orig, sampled uniformly
+// with the parametrization of Urena et al. 2013, "An Area-Preserving Parametrization for Spherical Rectangles"
+struct spherical_rect {
+    vec3 x, y, z;
+    double x0, y0, z0, x1, y1;
+    double b0, b1, k;
+    double S; // solid angle
+
+    spherical_rect(const point3& orig, const point3& s, const vec3& ex, const vec3& ey){
+        double exl = ex.length(), eyl = ey.length();
+        x = ex/exl; y = ey/eyl; z = cross(x, y);
+        vec3 d = s - orig;
+        x0 = dot(d, x); y0 = dot(d, y); z0 = dot(d, z);
+        if(z0 > 0){ z0 = -z0; z = -z; }
+        x1 = x0 + exl; y1 = y0 + eyl;
+
+        vec3 v00(x0, y0, z0), v01(x0, y1, z0), v10(x1, y0, z0), v11(x1, y1, z0);
+        vec3 n0 = cross(v00, v10).normalized(), n1 = cross(v10, v11).normalized();
+        vec3 n2 = cross(v11, v01).normalized(), n3 = cross(v01, v00).normalized();
+
+        double g0 = safe_acos(-dot(n0, n1)), g1 = safe_acos(-dot(n1, n2));
+        double g2 = safe_acos(-dot(n2, n3)), g3 = safe_acos(-dot(n3, n0));
+        b0 = n0.z(); b1 = n2.z();
+        k = 2*PI - g2 - g3;
+        S = g0 + g1 - k;
+        if(!std::isfinite(S)) S = 0;
+    }
+
+    // Direction (not normalized) towards the point of the rectangle mapped to (su, sv) in [0,1]^2
+    vec3 sample(double su, double sv) const {
+        double au = su*S + k;
+        double fu = (std::cos(au)*b0 - b1) / std::sin(au);
+        double cu = std::copysign(1.0, fu) / std::sqrt(fu*fu + b0*b0);
+        cu = std::fmin(1.0, std::fmax(-1.0, cu));
+        double xu = -(cu*z0) / std::sqrt(std::fmax(EPSILON, 1 - cu*cu));
+        xu = std::fmin(x1, std::fmax(x0, xu));
+
+        double dist = std::sqrt(xu*xu + z0*z0);
+        double h0 = y0 / std::sqrt(dist*dist + y0*y0);
+        double h1 = y1 / std::sqrt(dist*dist + y1*y1);
+        double hv = h0 + sv*(h1 - h0), hv2 = hv*hv;
+        double yv = hv2 < 1 - EPSILON ? (hv*dist) / std::sqrt(1 - hv2) : y1;
+
+        return xu*x + yv*y + z0*z;
+    }
+
+    static double safe_acos(double c){
+        return std::acos(std::fmin(1.0, std::fmax(-1.0, c)));
+    }
+};
+
+// Spherical triangle of the vertices a, b, c seen from orig, sampled uniformly with
+// the method of Arvo 1995, "Stratified Sampling of Spherical Triangles"
+struct spherical_triangle {
+    vec3 a, b, c;
+    double alpha = 0, cos_c = 0;
+    double area = 0; // solid angle
+
+    spherical_triangle(const point3& orig, const point3& p0, const point3& p1, const point3& p2){
+        a = (p0 - orig).normalized(); b = (p1 - orig).normalized(); c = (p2 - orig).normalized();
+        vec3 nab = cross(a, b), nbc = cross(b, c), nca = cross(c, a);
+        if(nab.near_zero() || nbc.near_zero() || nca.near_zero()) return;
+        nab = nab.normalized(); nbc = nbc.normalized(); nca = nca.normalized();
+
+        alpha = angle_between(nab, -nca);
+        double beta = angle_between(nbc, -nab);
+        double gamma = angle_between(nca, -nbc);
+        area = std::fmax(0.0, alpha + beta + gamma - PI);
+        cos_c = dot(a, b);
+    }
+
+    // Direction (normalized) of the point of the triangle mapped to (su, sv) in [0,1]^2
+    vec3 sample(double su, double sv) const {
+        // Pick the sub triangle a, b, cp of area su*area, then a point along the arc b-cp
+        double areaP = su*area + PI; // area of the sub triangle plus pi
+        double cosAlpha = std::cos(alpha), sinAlpha = std::sin(alpha);
+        double sinPhi = std::sin(areaP)*cosAlpha - std::cos(areaP)*sinAlpha;
+        double cosPhi = std::cos(areaP)*cosAlpha + std::sin(areaP)*sinAlpha;
+        double k1 = cosPhi + cosAlpha;
+        double k2 = sinPhi - sinAlpha*cos_c;
+        double cosBp = (k2 + (k2*cosPhi - k1*sinPhi)*cosAlpha) / ((k2*sinPhi + k1*cosPhi)*sinAlpha);
+        cosBp = std::fmin(1.0, std::fmax(-1.0, cosBp));
+        double sinBp = std::sqrt(1 - cosBp*cosBp);
+        vec3 cp = cosBp*a + sinBp*orthogonal_part(c, a);
+
+        double cosTheta = 1 - sv*(1 - dot(cp, b));
+        double sinTheta = std::sqrt(std::fmax(0.0, 1 - cosTheta*cosTheta));
+        return cosTheta*b + sinTheta*orthogonal_part(cp, b);
+    }
+
+    // Angle between two unit vectors, accurate near 0 and pi
+    static double angle_between(const vec3& v1, const vec3& v2){
+        if(dot(v1, v2) < 0) return PI - 2*std::asin(std::fmin(1.0, (v1 + v2).length()/2));
+        return 2*std::asin(std::fmin(1.0, (v2 - v1).length()/2));
+    }
+
+    // Normalized component of v orthogonal to the unit vector w
+    static vec3 orthogonal_part(const vec3& v, const vec3& w){
+        vec3 o = v - dot(v, w)*w;
+        return o.near_zero() ? vec3(0,0,0) : o.normalized();
+    }
+};
+
 class quad : public planar_shape {
 private:
 
     
-    shared_ptr<material> mat;
+    uint32_t mat_id;
     aabb bbox;
+    bool rectangle; // only rectangles can be sampled by solid angle, other parallelograms are sampled by area
 
 
 public:
-    quad(point3 q, vec3 u, vec3 v, shared_ptr<material> mat): planar_shape(q,u,v), mat(mat){         
-    }
 
-    quad(point3 q, vec3 u, vec3 v, shared_ptr<material> mat, bool single_face): planar_shape(q,u,v, single_face), mat(mat){         
+
+    quad(point3 q, vec3 u, vec3 v, uint32_t mat_id, bool single_face = false): planar_shape(q,u,v, single_face), mat_id(mat_id){
     }
 
     void commit_transform() override {
@@ -177,6 +308,7 @@ public:
         std::clog << "Committed quad transform" << std::endl;
 #endif
         area = n.length();
+        rectangle = std::fabs(dot(u,v)) < 1e-9*u.length()*v.length();
         compute_bbox();
     }
 
@@ -199,26 +331,59 @@ public:
         if(!is_interior(ka, kb, hr)) return false;
 
         hr.t = hitTime;
-        hr.p = hitPoint;
-        hr.mat = mat;
-        hr.set_frontface_and_normal(r, normal);
+        hr.obj = this;
 
         return true;
     }
 
-    bool is_interior(double alpha, double beta, hit_record& hr) const override {
+    void surface_interaction(const ray& r, hit_record& hr) const override {
+        hr.p = r.at(hr.t);
+        hr.mat_id = mat_id;
+        hr.dpdu = u; hr.dpdv = v;
+        hr.curvature = 0;
+        hr.set_frontface_and_normal(r, normal);
+    }
+
+    bool contains(double alpha, double beta) const override {
         interval oi = interval(0.0, 1.0);
+        return oi.contains(alpha) && oi.contains(beta);
+    }
 
-        if(!oi.contains(alpha) || !oi.contains(beta)) return false;
+    double pdf_value(const point3& orig, const vec3& dir) const override {
+        double t, alpha, beta;
+        if(!line_coordinates(orig, dir, &t, &alpha, &beta) || !contains(alpha, beta)) return 0;
+        if(rectangle){
+            spherical_rect sr(orig, q, u, v);
+            if(sr.S >= min_spherical_angle) return 1/sr.S;
+        }
+        return area_pdf(dir, t);
+    }
 
-        hr.u = alpha; hr.v = beta;
-        return true;
+    vec3 sample_direction(const point3& orig, double su, double sv) const override {
+        if(rectangle && seen_from(orig)){
+            spherical_rect sr(orig, q, u, v);
+            if(sr.S >= min_spherical_angle) return sr.sample(su, sv);
+        }
+        return q + u*su + v*sv - orig;
     }
 
     point3 random_point() const override {
         return q + u*randDouble() + v*randDouble();
     };
 
+    bool sample_surface(double su, double sv, hit_record& hr) const override {
+        hr.p = q + u*su + v*sv;
+        hr.u = su; hr.v = sv;
+        hr.obj = this; hr.mat_id = mat_id;
+        hr.normal = normal; hr.front_face = true;
+        hr.dpdu = u; hr.dpdv = v;
+        return true;
+    }
+
+    void collect_emitters(const material_table& materials, std::vector<const hittable*>& out) const override {
+        if(materials.kind(mat_id) == material_kind::emissive) out.push_back(this);
+    }
+
     point3 random_point_towards(const point3& position) const override {
         return random_point();
     }
@@ -238,15 +403,14 @@ class triangle : public planar_shape {
 private:
 
     
-    shared_ptr<material> mat;
+    uint32_t mat_id;
     aabb bbox;
 
 
 public:
-    triangle(point3 q, vec3 u, vec3 v, shared_ptr<material> mat): planar_shape(q,u,v), mat(mat){         
-    }
 
-    triangle(point3 q, vec3 u, vec3 v, shared_ptr<material> mat, bool single_face): planar_shape(q,u,v, single_face), mat(mat){         
+
+    triangle(point3 q, vec3 u, vec3 v, uint32_t mat_id, bool single_face = false): planar_shape(q,u,v, single_face), mat_id(mat_id){
     }
 
     //triangle(point3 a, point3 b, point3 c, shared_ptr<material> mat): planar_shape(a,b-a,c-a), mat(mat){         
@@ -282,26 +446,61 @@ public:
         if(!is_interior(ka, kb, hr)) return false;
 
         hr.t = hitTime;
-        hr.p = hitPoint;
-        hr.mat = mat;
-        hr.set_frontface_and_normal(r, normal);
+        hr.obj = this;
 
         return true;
     }
 
-    bool is_interior(double alpha, double beta, hit_record& hr) const override {
+    void surface_interaction(const ray& r, hit_record& hr) const override {
+        hr.p = r.at(hr.t);
+        hr.mat_id = mat_id;
+        hr.dpdu = u; hr.dpdv = v;
+        hr.curvature = 0;
+        hr.set_frontface_and_normal(r, normal);
+        hr.w = 1-hr.u-hr.v;
+    }
+
+    bool contains(double alpha, double beta) const override {
         interval oi = interval(0.0, 1.0);
+        return oi.contains(alpha) && oi.contains(beta) && oi.contains(alpha+beta);
+    }
 
-        if(!oi.contains(alpha+beta)) return false;
+    double pdf_value(const point3& orig, const vec3& dir) const override {
+        double t, alpha, beta;
+        if(!line_coordinates(orig, dir, &t, &alpha, &beta) || !contains(alpha, beta)) return 0;
+        spherical_triangle st(orig, q, q+u, q+v);
+        if(st.area >= min_spherical_angle) return 1/st.area;
+        return area_pdf(dir, t);
+    }
 
-        hr.u = alpha; hr.v = beta; hr.w = 1-alpha-beta;
-        return true;
+    vec3 sample_direction(const point3& orig, double su, double sv) const override {
+        if(seen_from(orig)){
+            spherical_triangle st(orig, q, q+u, q+v);
+            if(st.area >= min_spherical_angle) return st.sample(su, sv);
+        }
+        vec3 b = warp_uniform_triangle(su, sv);
+        return q + u*b.y() + v*b.z() - orig;
     }
 
     point3 random_point() const override {
-        return q + u*randDouble() + v*randDouble();
+        vec3 b = warp_uniform_triangle(randDouble(), randDouble());
+        return q + u*b.y() + v*b.z();
     };
 
+    bool sample_surface(double su, double sv, hit_record& hr) const override {
+        vec3 b = warp_uniform_triangle(su, sv);
+        hr.p = q + u*b.y() + v*b.z();
+        hr.u = b.y(); hr.v = b.z(); hr.w = b.x();
+        hr.obj = this; hr.mat_id = mat_id;
+        hr.normal = normal; hr.front_face = true;
+        hr.dpdu = u; hr.dpdv = v;
+        return true;
+    }
+
+    void collect_emitters(const material_table& materials, std::vector<const hittable*>& out) const override {
+        if(materials.kind(mat_id) == material_kind::emissive) out.push_back(this);
+    }
+
     point3 random_point_towards(const point3& position) const override {
         return random_point();
     }
@@ -0,0 +1,322 @@
+#ifndef SPARSE_GRID_H
+#define SPARSE_GRID_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "voxel_grid.h"
+
+// Sparse voxel grid stored as a 3 level tree, read straight from a memory mapped file:
+//   root table  -> one entry per upper node, each upper node covers 128^3 voxels
+//   upper node  -> 16^3 entries, one per leaf
+//   leaf        -> a dense 8^3 brick of voxels
+// Empty nodes are not stored at all. Parents keep the max of each child, padded by one voxel so
+// it bounds the interpolated density too, and walk_majorants descends the tree with a DDA per
+// level, skipping the children whose max is 0. Opening reads the root table and the upper nodes,
+// a render only pages in the bricks its rays sample. Past a resident budget, the pages of the
+// bricks least recently read are given back (clock replacement), so a volume bigger than memory
+// renders with a bounded resident size.
+//
+// File layout (little endian, offsets in bytes from the start of the file, 0 means not stored):
+//   sparse_grid::file_header
+//   root_entry root[root_res[0]*root_res[1]*root_res[2]]     x varying fastest
+//   upper nodes: float leaf_max[16*16*16]; uint64 leaves[16*16*16]
+//   leaves:      float voxels[8*8*8]
+class sparse_grid : public voxel_grid {
+public:
+    static const int leaf_log2 = 3, leaf_dim = 1 << leaf_log2;
+    static const int upper_log2 = 4, upper_dim = 1 << upper_log2;
+    static const int upper_voxels_log2 = leaf_log2 + upper_log2;
+
+    struct file_header {
+        char magic[8];
+        int32_t nx, ny, nz;
+        int32_t root_res[3];
+        uint64_t root_offset;
+    };
+
+    struct root_entry {
+        uint64_t offset;
+        float maxv;         // padded max of the upper node, kept when it isn't stored
+        uint32_t unused;
+    };
+
+    struct upper_node {
+        float leaf_max[upper_dim*upper_dim*upper_dim];  // padded max of each leaf, stored or not
+        uint64_t leaves[upper_dim*upper_dim*upper_dim];
+    };
+
+    struct leaf_node {
+        float voxels[leaf_dim*leaf_dim*leaf_dim];
+    };
+
+    ~sparse_grid() {
+        if(base != nullptr) munmap(const_cast<unsigned char*>(base), file_size);
+    }
+
+    // Maps the file at path. Files smaller than resident_budget bytes are prefetched
+    // entirely, bigger ones are paged in on demand as bricks get read and the pages of their
+    // bricks are kept under resident_budget bytes.
+    // Returns nullptr if the file can not be mapped, is not a sparse grid, has a node outside
+    // of the file or a max that isn't a finite positive number.
+    static shared_ptr<sparse_grid> open(const std::string& path, size_t resident_budget = size_t(256) << 20) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            std::clog << "Could not open sparse grid " << path << std::endl;
+            return nullptr;
+        }
+
+        struct stat st;
+        void* mapped = MAP_FAILED;
+        if(fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(file_header))
+            mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(mapped == MAP_FAILED){
+            std::clog << "Could not map sparse grid " << path << std::endl;
+            return nullptr;
+        }
+
+        auto grid = shared_ptr<sparse_grid>(new sparse_grid());
+        grid->base = static_cast<const unsigned char*>(mapped);
+        grid->file_size = st.st_size;
+
+        if(!grid->validate()){
+            std::clog << "Malformed sparse grid " << path << std::endl;
+            return nullptr;
+        }
+
+        if(grid->file_size <= resident_budget){
+            madvise(mapped, grid->file_size, MADV_WILLNEED);
+        } else {
+            madvise(mapped, grid->file_size, MADV_RANDOM);
+            // Faulting a page maps the rest of its page cache folio too, up to 2 MB, so pages are
+            // tracked in runs of that size
+            long ps = sysconf(_SC_PAGESIZE);
+            grid->run_size = std::max(ps > 0 ? size_t(ps) : 4096, size_t(2) << 20);
+            grid->run_count = (grid->file_size + grid->run_size - 1) / grid->run_size;
+            grid->budget_runs = std::max(resident_budget / grid->run_size, size_t(2));
+            grid->run_state.reset(new std::atomic<uint8_t>[grid->run_count]());
+        }
+        return grid;
+    }
+
+    float voxel(int i, int j, int k) const override {
+        const leaf_node* leaf = find_leaf(i >> leaf_log2, j >> leaf_log2, k >> leaf_log2);
+        if(leaf == nullptr) return 0;
+        int m = leaf_dim - 1;
+        return leaf->voxels[((k & m)*leaf_dim + (j & m))*leaf_dim + (i & m)];
+    }
+
+    // The tree bounds itself, there is nothing to build
+    void build_majorants() override {}
+
+    // DDA over the upper nodes, then over the leaves of the stored ones. An upper node that isn't
+    // stored but borders voxels (its padded max isn't 0) is one segment.
+    bool walk_majorants(const point3& o, const vec3& d, double t0, double t1, const majorant_segment_fn& f) const override {
+        const int lo[3] = {0, 0, 0};
+        return walk_cells(o, d, t0, t1, 1 << upper_voxels_log2, lo, root_res, [&](const int* u, double uEnter, double uExit){
+            const root_entry& e = root[(size_t(u[2])*root_res[1] + u[1])*root_res[0] + u[0]];
+            if(e.maxv == 0) return false;
+            if(e.offset == 0) return f(uEnter, uExit, e.maxv);
+
+            const upper_node* upper = reinterpret_cast<const upper_node*>(base + e.offset);
+            const int llo[3] = {u[0] << upper_log2, u[1] << upper_log2, u[2] << upper_log2};
+            const int lhi[3] = {llo[0] + upper_dim, llo[1] + upper_dim, llo[2] + upper_dim};
+            const int m = upper_dim - 1;
+            return walk_cells(o, d, uEnter, uExit, leaf_dim, llo, lhi, [&](const int* l, double lEnter, double lExit){
+                float lmax = upper->leaf_max[((l[2] & m)*upper_dim + (l[1] & m))*upper_dim + (l[0] & m)];
+                return lmax > 0 && f(lEnter, lExit, lmax);
+            });
+        });
+    }
+
+    // Writes any grid in the sparse format, bricks that are entirely 0 are dropped
+    static bool write(const voxel_grid& g, const std::string& path) {
+        FILE* f = std::fopen(path.c_str(), "wb");
+        if(f == nullptr){
+            std::clog << "Could not write sparse grid " << path << std::endl;
+            return false;
+        }
+
+        int upper_span = 1 << upper_voxels_log2;
+        file_header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, "PTSVT2", 6);
+        h.nx = g.nx; h.ny = g.ny; h.nz = g.nz;
+        h.root_res[0] = (g.nx + upper_span-1) / upper_span;
+        h.root_res[1] = (g.ny + upper_span-1) / upper_span;
+        h.root_res[2] = (g.nz + upper_span-1) / upper_span;
+        h.root_offset = sizeof(file_header);
+
+        std::vector<root_entry> root_table(size_t(h.root_res[0])*h.root_res[1]*h.root_res[2], root_entry{0, 0, 0});
+        uint64_t offset = h.root_offset + root_table.size()*sizeof(root_entry);
+        bool ok = std::fseek(f, offset, SEEK_SET) == 0;
+
+        auto upper = std::make_unique<upper_node>();
+        std::vector<leaf_node> leaves;
+        for(int uk = 0; ok && uk < h.root_res[2]; uk++)
+          for(int uj = 0; ok && uj < h.root_res[1]; uj++)
+            for(int ui = 0; ok && ui < h.root_res[0]; ui++){
+                std::memset(upper.get(), 0, sizeof(upper_node));
+                root_entry& e = root_table[(size_t(uk)*h.root_res[1] + uj)*h.root_res[0] + ui];
+                leaves.clear();
+
+                for(int lk = 0; lk < upper_dim; lk++)
+                  for(int lj = 0; lj < upper_dim; lj++)
+                    for(int li = 0; li < upper_dim; li++){
+                        int l = (lk*upper_dim + lj)*upper_dim + li;
+                        int i0 = ((ui << upper_log2) + li) << leaf_log2;
+                        int j0 = ((uj << upper_log2) + lj) << leaf_log2;
+                        int k0 = ((uk << upper_log2) + lk) << leaf_log2;
+                        float lmax = g.max_over(i0-1, j0-1, k0-1, i0+leaf_dim+1, j0+leaf_dim+1, k0+leaf_dim+1);
+                        upper->leaf_max[l] = lmax;
+                        e.maxv = std::max(e.maxv, lmax);
+                        if(lmax == 0) continue;
+
+                        leaf_node leaf;
+                        bool empty = true;
+                        for(int k = 0; k < leaf_dim; k++)
+                            for(int j = 0; j < leaf_dim; j++)
+                                for(int i = 0; i < leaf_dim; i++){
+                                    float d = g.voxel(i0+i, j0+j, k0+k);
+                                    leaf.voxels[(k*leaf_dim + j)*leaf_dim + i] = d;
+                                    empty = empty && d == 0;
+                                }
+                        if(empty) continue;
+
+                        upper->leaves[l] = offset + sizeof(upper_node) + leaves.size()*sizeof(leaf_node);
+                        leaves.push_back(leaf);
+                    }
+                if(leaves.empty()) continue;
+
+                e.offset = offset;
+                ok = std::fwrite(upper.get(), sizeof(upper_node), 1, f) == 1
+                  && std::fwrite(leaves.data(), sizeof(leaf_node), leaves.size(), f) == leaves.size();
+                offset += sizeof(upper_node) + leaves.size()*sizeof(leaf_node);
+            }
+
+        ok = ok && std::fseek(f, 0, SEEK_SET) == 0
+                && std::fwrite(&h, sizeof(h), 1, f) == 1
+                && std::fwrite(root_table.data(), sizeof(root_entry), root_table.size(), f) == root_table.size();
+        ok = std::fclose(f) == 0 && ok;
+        if(!ok) std::clog << "Failed writing sparse grid " << path << std::endl;
+        return ok;
+    }
+
+private:
+    const unsigned char* base = nullptr;
+    size_t file_size = 0;
+    int root_res[3] = {0,0,0};
+    const root_entry* root = nullptr;
+
+    // Residency of the file in runs of pages, only tracked when the file is over the budget
+    enum run_residency : uint8_t { RUN_ABSENT, RUN_REFERENCED, RUN_COLD };
+    size_t run_size = 0, run_count = 0, budget_runs = 0;
+    std::unique_ptr<std::atomic<uint8_t>[]> run_state;
+    mutable std::atomic<size_t> resident_runs{0};
+    mutable std::mutex evict_mutex;
+    mutable size_t clock_hand = 0;
+
+    sparse_grid() {}
+
+    // Checks the header, that every node the root table leads to lies within the file, so
+    // lookups can follow the offsets without checking them, and that the maxes the walk tracks
+    // against are finite. Only the root table and the upper nodes are read.
+    bool validate() {
+        const file_header* h = reinterpret_cast<const file_header*>(base);
+        if(std::memcmp(h->magic, "PTSVT2", 6) != 0 || h->nx <= 0 || h->ny <= 0 || h->nz <= 0) return false;
+        int n[3] = {h->nx, h->ny, h->nz};
+        int upper_span = 1 << upper_voxels_log2;
+        for(int a = 0; a < 3; a++)
+            if(h->root_res[a] != (n[a] + upper_span-1) / upper_span) return false;
+        size_t root_count = size_t(h->root_res[0])*h->root_res[1]*h->root_res[2];
+        if(!node_fits(h->root_offset, root_count*sizeof(root_entry), alignof(root_entry))) return false;
+
+        root = reinterpret_cast<const root_entry*>(base + h->root_offset);
+        for(size_t u = 0; u < root_count; u++){
+            if(!valid_max(root[u].maxv)) return false;
+            if(root[u].offset == 0) continue;
+            if(!node_fits(root[u].offset, sizeof(upper_node), alignof(upper_node))) return false;
+            const upper_node* upper = reinterpret_cast<const upper_node*>(base + root[u].offset);
+            for(int l = 0; l < upper_dim*upper_dim*upper_dim; l++){
+                if(!valid_max(upper->leaf_max[l])) return false;
+                uint64_t loff = upper->leaves[l];
+                if(loff != 0 && !node_fits(loff, sizeof(leaf_node), alignof(leaf_node))) return false;
+            }
+        }
+
+        nx = h->nx; ny = h->ny; nz = h->nz;
+        for(int a = 0; a < 3; a++) root_res[a] = h->root_res[a];
+        return true;
+    }
+
+    static bool valid_max(float m) {
+        return m >= 0 && m <= std::numeric_limits<float>::max();
+    }
+
+    // Whether size bytes at offset lie after the header and within the file, aligned on align
+    bool node_fits(uint64_t offset, size_t size, size_t align) const {
+        return offset >= sizeof(file_header) && offset % align == 0 && offset <= file_size && size <= file_size - offset;
+    }
+
+    // Leaf at brick coordinates (li,lj,lk), nullptr for empty space
+    const leaf_node* find_leaf(int li, int lj, int lk) const {
+        if(li < 0 || lj < 0 || lk < 0) return nullptr;
+        int ui = li >> upper_log2, uj = lj >> upper_log2, uk = lk >> upper_log2;
+        if(ui >= root_res[0] || uj >= root_res[1] || uk >= root_res[2]) return nullptr;
+
+        uint64_t uoff = root[(size_t(uk)*root_res[1] + uj)*root_res[0] + ui].offset;
+        if(uoff == 0) return nullptr;
+        const upper_node* upper = reinterpret_cast<const upper_node*>(base + uoff);
+
+        int m = upper_dim - 1;
+        uint64_t loff = upper->leaves[((lk & m)*upper_dim + (lj & m))*upper_dim + (li & m)];
+        if(loff == 0) return nullptr;
+        if(run_state != nullptr) touch(loff);
+        return reinterpret_cast<const leaf_node*>(base + loff);
+    }
+
+    // Marks the runs holding the leaf at offset as recently read, evicting once over the budget
+    void touch(uint64_t offset) const {
+        for(size_t p = offset / run_size; p <= (offset + sizeof(leaf_node) - 1) / run_size; p++){
+            if(run_state[p].load(std::memory_order_relaxed) == RUN_REFERENCED) continue;
+            if(run_state[p].exchange(RUN_REFERENCED, std::memory_order_relaxed) == RUN_ABSENT
+               && resident_runs.fetch_add(1, std::memory_order_relaxed) + 1 > budget_runs)
+                evict();
+        }
+    }
+
+    // Clock sweep down to 7/8 of the budget: referenced runs get a second chance, cold ones are
+    // dropped. The mapping is private and never written, so a dropped run that is still being
+    // read is simply read from the file again. One thread evicts at a time, the others go on.
+    void evict() const {
+        std::unique_lock<std::mutex> lock(evict_mutex, std::try_to_lock);
+        if(!lock.owns_lock()) return;
+        size_t target = budget_runs - budget_runs/8;
+        for(size_t step = 0; step < 2*run_count && resident_runs.load(std::memory_order_relaxed) > target; step++){
+            size_t p = clock_hand;
+            clock_hand = (clock_hand + 1) % run_count;
+            uint8_t state = run_state[p].load(std::memory_order_relaxed);
+            if(state == RUN_REFERENCED){
+                run_state[p].compare_exchange_strong(state, RUN_COLD, std::memory_order_relaxed);
+            } else if(state == RUN_COLD && run_state[p].compare_exchange_strong(state, RUN_ABSENT, std::memory_order_relaxed)){
+                madvise(const_cast<unsigned char*>(base) + p*run_size, std::min(run_size, file_size - p*run_size), MADV_DONTNEED);
+                resident_runs.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+#endif
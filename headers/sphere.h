@@ -5,6 +5,7 @@
 #include "transform.h"
 #include "hittable.h"
 #include "material.h"
+#include "material_table.h"
 #include "time_profiler.h"
 
 class sphere : public hittable, public transform{
@@ -12,9 +13,9 @@ private:
     aabb bbox;
 public:
     double radius;
-    shared_ptr<material> mat;
+    uint32_t mat_id;
 
-    sphere(const point3 c, double r, shared_ptr<material> m): transform(c), radius(r), mat(m) {
+    sphere(const point3 c, double r, uint32_t mat_id): transform(c), radius(r), mat_id(mat_id) {
         bbox = aabb(center - radius*vec3(1,1,1), center + radius*vec3(1,1,1));
     }
     //sphere(const point3& c, double r, shared_ptr<material> m): 
@@ -47,35 +48,57 @@ public:
         }
 
         hr.t = root;
-        hr.p = r.at(root);
+        hr.obj = this;
+
+        return true; 
+    }
+
+    void surface_interaction(const ray& r, hit_record& hr) const override {
+        hr.p = r.at(hr.t);
         
-        get_sphere_uv(hr.normal,hr.u,hr.v);
         vec3 outnorm = (hr.p - center) / radius;
+        get_sphere_uv(outnorm,hr.u,hr.v);
+        get_sphere_tangents(outnorm*radius, hr.dpdu, hr.dpdv);
+        hr.curvature = 1.0/radius;
         hr.set_frontface_and_normal(r, outnorm);
-        hr.mat = mat;
-
-        return true; 
+        hr.mat_id = mat_id;
     }
 
     void commit_transform(){
         
     }
 
-    virtual double pdf_value(const point3& origin, const vec3& direction) const {
-        // This method only works for stationary spheres.
+    // Directions are sampled uniformly in the cone the sphere subtends from origin,
+    // or over the whole sphere of directions when origin is inside
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        vec3 toCenter = center - origin;
+        double dist2 = toCenter.length_squared();
+        if(dist2 <= radius*radius) return 1/(4*PI);
+
+        double oneMinusCos = cone_one_minus_cos(radius*radius/dist2);
+        double cosine = dot(direction, toCenter) / std::sqrt(direction.length_squared()*dist2);
+        if(cosine < 1 - oneMinusCos) return 0;
+        return 1 / (2*PI*oneMinusCos);
+    }
 
-        hit_record rec;
-        if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
-            return 0;
+    vec3 sample_direction(const point3& origin, double su, double sv) const override {
+        vec3 toCenter = center - origin;
+        double dist2 = toCenter.length_squared();
+        double oneMinusCos = dist2 <= radius*radius ? 2.0 : cone_one_minus_cos(radius*radius/dist2);
 
-        auto cos_theta_max = std::sqrt(1 - radius*radius/(center - origin).length_squared());
-        auto solid_angle = 2*PI*(1-cos_theta_max);
+        double cosTheta = 1 - su*oneMinusCos;
+        double sinTheta = std::sqrt(std::fmax(0.0, 1 - cosTheta*cosTheta));
+        double phi = 2*PI*sv;
 
-        return  1 / solid_angle;
+        vec3 w = dist2 > 0 ? toCenter / std::sqrt(dist2) : vec3(0,0,1);
+        vec3 a = std::fabs(w.x()) > 0.9 ? vec3(0,1,0) : vec3(1,0,0);
+        vec3 v = cross(w, a).normalized();
+        vec3 u = cross(w, v);
+        return std::cos(phi)*sinTheta*u + std::sin(phi)*sinTheta*v + cosTheta*w;
     }
 
     double get_area() const override {
-        return 4*PI*radius*radius*radius/3.0;
+        return 4*PI*radius*radius;
     }
 
     bool is_facing(const vec3& dir) const override {
@@ -85,11 +108,26 @@ public:
     point3 random_point() const override {
         return center + radius*vec3::random_on_unit_sphere();
     }
+
+    bool sample_surface(double su, double sv, hit_record& hr) const override {
+        vec3 outnorm = warp_uniform_sphere(su, sv);
+        hr.p = center + radius*outnorm;
+        get_sphere_uv(outnorm, hr.u, hr.v);
+        get_sphere_tangents(outnorm*radius, hr.dpdu, hr.dpdv);
+        hr.obj = this; hr.mat_id = mat_id;
+        hr.normal = outnorm; hr.front_face = true;
+        return true;
+    }
+
+    void collect_emitters(const material_table& materials, std::vector<const hittable*>& out) const override {
+        if(materials.kind(mat_id) == material_kind::emissive) out.push_back(this);
+    }
     
 
+    // Points on the far side are reflected through the center onto the visible half
     point3 random_point_towards(const point3& position) const override {
         point3 p = random_point();
-        if(dot(p-center, center-position) > 0) return -p;
+        if(dot(p-center, center-position) > 0) return center - (p-center);
         return p;
     }
     
@@ -108,6 +146,26 @@ public:
         u = phi / (2*PI);
         v = theta / PI;
     }
+
+    // 1 - cos(theta_max) of the cone subtended by a sphere, from sin^2(theta_max),
+    // switching to the series expansion for far away spheres where 1 - sqrt(..) cancels out
+    static double cone_one_minus_cos(double sin2) {
+        if(sin2 < 0.00068523) return sin2/2 + sin2*sin2/8;
+        return 1 - std::sqrt(1 - sin2);
+    }
+
+    static void get_sphere_tangents(const vec3& p, vec3& dpdu, vec3& dpdv) {
+        // p: hit point relative to the center, dpdu and dpdv are the derivatives of p
+        // along the (u,v) parametrization of get_sphere_uv.
+
+        double rho = std::sqrt(p.x()*p.x() + p.z()*p.z());
+        dpdu = 2*PI*vec3(p.z(), 0, -p.x());
+        if(rho < EPSILON){
+            dpdv = vec3(0,0,0);
+            return;
+        }
+        dpdv = PI*vec3(-p.y()*p.x()/rho, rho, -p.y()*p.z()/rho);
+    }
 };
 
 
@@ -0,0 +1,202 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include <algorithm>
+#include <vector>
+
+#include "hittable.h"
+#include "material_table.h"
+#include "sphere.h"
+#include "numa.h"
+
+// Large group of static spheres stored as flat arrays (centers, radii, material ids) with its
+// own BVH over them. Leaves hold up to leaf_size consecutive spheres that are intersected in a
+// single vectorizable loop, there is no per sphere object, bounding box or virtual call.
+// The BVH is built by commit_transform, so the set must be reached by the world's commit.
+class sphere_set : public hittable {
+public:
+    static const int leaf_size = 8;
+
+    sphere_set() {}
+
+    void add(const point3& c, double r, uint32_t mat_id){
+        cx.push_back(c.x()); cy.push_back(c.y()); cz.push_back(c.z());
+        radius.push_back(r);
+        mat.push_back(mat_id);
+        bbox = aabb(bbox, aabb(c - r*vec3(1,1,1), c + r*vec3(1,1,1)));
+        built = false;
+    }
+
+    size_t size() const {
+        return radius.size();
+    }
+
+    void commit_transform() override {
+        if(!built) build();
+    }
+
+    aabb bounding_box() const override {
+        return bbox;
+    }
+
+    bool hit(const ray& r, interval t_int, hit_record& hr) const override {
+        if(nodes.empty()) return false;
+
+        const vec3& d = r.direction();
+        const point3& o = r.origin();
+        double inv[3] = { 1.0/d.x(), 1.0/d.y(), 1.0/d.z() };
+        double a = dot(d, d), inv_a = 1.0/a;
+
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+        bool hitAnything = false;
+
+        while(sp > 0){
+            const node& n = nodes[stack[--sp]];
+            if(!slab(n, o, inv, t_int)) continue;
+
+            if(n.count == 0){
+                // Visit the child on the side of the ray origin first
+                int first = n.index_or_first, second = n.right;
+                if(inv[n.axis] < 0) std::swap(first, second);
+                stack[sp++] = second;
+                stack[sp++] = first;
+                continue;
+            }
+
+            double ts[leaf_size];
+            int base = n.index_or_first;
+            #pragma omp simd
+            for(int k = 0; k < leaf_size; k++){
+                int s = base + std::min(k, n.count-1);
+                double ocx = cx[s] - o.x(), ocy = cy[s] - o.y(), ocz = cz[s] - o.z();
+                double h = d.x()*ocx + d.y()*ocy + d.z()*ocz;
+                double c = ocx*ocx + ocy*ocy + ocz*ocz - radius[s]*radius[s];
+                double delta = h*h - a*c;
+                double sq = std::sqrt(std::fmax(delta, 0.0));
+                double t0 = (h - sq)*inv_a, t1 = (h + sq)*inv_a;
+                double t = t0 > t_int.min ? t0 : t1;
+                ts[k] = (delta >= 0 && t > t_int.min && t < t_int.max) ? t : infinity;
+            }
+
+            for(int k = 0; k < n.count; k++){
+                if(ts[k] < t_int.max){
+                    t_int.max = ts[k];
+                    hr.t = ts[k];
+                    hr.obj = this;
+                    hr.prim = base + k;
+                    hitAnything = true;
+                }
+            }
+        }
+
+        return hitAnything;
+    }
+
+    void surface_interaction(const ray& r, hit_record& hr) const override {
+        int s = hr.prim;
+        point3 center = point3(cx[s], cy[s], cz[s]);
+        hr.p = r.at(hr.t);
+
+        vec3 outnorm = (hr.p - center) / radius[s];
+        sphere::get_sphere_uv(outnorm, hr.u, hr.v);
+        sphere::get_sphere_tangents(outnorm*radius[s], hr.dpdu, hr.dpdv);
+        hr.curvature = 1.0/radius[s];
+        hr.set_frontface_and_normal(r, outnorm);
+        hr.mat_id = mat[s];
+    }
+
+private:
+    struct node {
+        double bmin[3], bmax[3];
+        int index_or_first;     // first sphere of a leaf, left child of an inner node
+        int right;              // right child of an inner node
+        int count;              // spheres in a leaf, 0 for inner nodes
+        int axis;               // split axis of an inner node
+    };
+
+    numa::scene_vector<double> cx, cy, cz, radius;
+    numa::scene_vector<uint32_t> mat;
+    numa::scene_vector<node> nodes;
+    aabb bbox;
+    bool built = false;
+
+    static bool slab(const node& n, const point3& o, const double* inv, interval t){
+        for(int a = 0; a < 3; a++){
+            double t0 = (n.bmin[a] - o[a]) * inv[a];
+            double t1 = (n.bmax[a] - o[a]) * inv[a];
+            if(t1 < t0) std::swap(t0, t1);
+            if(t0 > t.min) t.min = t0;
+            if(t1 < t.max) t.max = t1;
+            if(t.min > t.max) return false;
+        }
+        return true;
+    }
+
+    void build(){
+        nodes.clear();
+        if(size() == 0) return;
+
+        std::vector<int> order(size());
+        for(size_t i = 0; i < order.size(); i++) order[i] = i;
+        nodes.reserve(2*size()/leaf_size + 1);
+        build_node(order, 0, order.size());
+
+        // Reorder the arrays so every leaf covers a contiguous range
+        auto permute = [&](auto& v){
+            auto old = v;
+            for(size_t i = 0; i < order.size(); i++) v[i] = old[order[i]];
+        };
+        permute(cx); permute(cy); permute(cz); permute(radius); permute(mat);
+        built = true;
+    }
+
+    int build_node(std::vector<int>& order, int stt, int end){
+        int idx = nodes.size();
+        nodes.push_back(node());
+
+        double bmin[3] = { infinity, infinity, infinity }, bmax[3] = { -infinity, -infinity, -infinity };
+        double cmin[3] = { infinity, infinity, infinity }, cmax[3] = { -infinity, -infinity, -infinity };
+        for(int i = stt; i < end; i++){
+            int s = order[i];
+            double c[3] = { cx[s], cy[s], cz[s] };
+            for(int a = 0; a < 3; a++){
+                bmin[a] = std::fmin(bmin[a], c[a] - radius[s]);
+                bmax[a] = std::fmax(bmax[a], c[a] + radius[s]);
+                cmin[a] = std::fmin(cmin[a], c[a]);
+                cmax[a] = std::fmax(cmax[a], c[a]);
+            }
+        }
+
+        node n;
+        for(int a = 0; a < 3; a++){ n.bmin[a] = bmin[a]; n.bmax[a] = bmax[a]; }
+
+        if(end - stt <= leaf_size){
+            n.index_or_first = stt;
+            n.right = 0;
+            n.count = end - stt;
+            n.axis = 0;
+            nodes[idx] = n;
+            return idx;
+        }
+
+        int axis = 0;
+        for(int a = 1; a < 3; a++)
+            if(cmax[a] - cmin[a] > cmax[axis] - cmin[axis]) axis = a;
+        const numa::scene_vector<double>& key = axis == 0 ? cx : axis == 1 ? cy : cz;
+
+        int mid = (stt + end) / 2;
+        std::nth_element(order.begin() + stt, order.begin() + mid, order.begin() + end,
+                         [&](int a, int b){ return key[a] < key[b]; });
+
+        n.count = 0;
+        n.axis = axis;
+        n.index_or_first = build_node(order, stt, mid);
+        n.right = build_node(order, mid, end);
+        nodes[idx] = n;
+        return idx;
+    }
+};
+
+#endif
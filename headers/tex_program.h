@@ -0,0 +1,120 @@
+#ifndef TEX_PROGRAM_H
+#define TEX_PROGRAM_H
+
+#include <cstdint>
+#include <vector>
+
+#include "texture.h"
+
+// Texture graph lowered into a flat array of nodes. Solid colors are folded into the
+// nodes (or into the program itself when the whole graph is constant) and checkers only
+// hold the indices of their children, so a lookup is a short loop over the array instead
+// of a chain of virtual calls through shared pointers.
+// Textures are lowered when the program is built, later changes to them are not seen.
+class tex_program {
+public:
+    enum op_code : uint8_t { OP_CONST, OP_CHECKER, OP_IMAGE, OP_NOISE, OP_VIRTUAL };
+
+    struct node {
+        op_code op;
+        int a, b;               // OP_CHECKER: children taken on odd and even cells
+        double size;            // OP_CHECKER: cell size
+        color col;              // OP_CONST
+        const texture* tex;     // OP_IMAGE, OP_NOISE, OP_VIRTUAL
+    };
+
+    tex_program(): constant(0,0,0) {}
+    tex_program(const color& c): constant(c) {}
+    tex_program(shared_ptr<texture> t): source(t) {
+        lower(t.get());
+        if(nodes[0].op == OP_CONST){
+            constant = nodes[0].col;
+            nodes.clear();
+            source = nullptr;
+        }
+    }
+
+    bool is_constant() const { return nodes.empty(); }
+
+    color eval(double u, double v, const point3& p, const tex_footprint& fp) const {
+        if(nodes.empty()) return constant;
+
+        const node* n = &nodes[0];
+        while(n->op == OP_CHECKER){
+            int x = int(p.x()/n->size), y = int(p.y()/n->size), z = int(p.z()/n->size);
+            n = &nodes[((x+y+z) % 2) ? n->a : n->b];
+        }
+
+        switch(n->op){
+            case OP_CONST:
+                return n->col;
+            case OP_IMAGE: // qualified calls, resolved statically
+                return static_cast<const image_tex*>(n->tex)->image_tex::filtered_value(u, v, p, fp);
+            case OP_NOISE:
+                return static_cast<const noise_tex*>(n->tex)->noise_tex::filtered_value(u, v, p, fp);
+            default:
+                return n->tex->filtered_value(u, v, p, fp);
+        }
+    }
+
+    color eval(double u, double v, const point3& p) const {
+        return eval(u, v, p, tex_footprint());
+    }
+
+    // Lookups of a batch of n hits. A single texture at the root takes the whole batch through
+    // texture::values, checkers pick their cell hit by hit.
+    void eval(int n, const double* u, const double* v, const point3* p, const tex_footprint* fp, color* out) const {
+        if(nodes.empty()){
+            for(int i = 0; i < n; i++) out[i] = constant;
+            return;
+        }
+
+        const node& root = nodes[0];
+        switch(root.op){
+            case OP_CHECKER:
+                for(int i = 0; i < n; i++) out[i] = eval(u[i], v[i], p[i], fp != nullptr ? fp[i] : tex_footprint());
+                return;
+            case OP_NOISE:
+                static_cast<const noise_tex*>(root.tex)->noise_tex::values(n, u, v, p, fp, out);
+                return;
+            default:
+                root.tex->values(n, u, v, p, fp, out);
+        }
+    }
+
+private:
+    color constant;
+    std::vector<node> nodes;        // nodes[0] is the root
+    shared_ptr<texture> source;     // keeps the textures referenced by the nodes alive
+
+    int emit(const node& n){
+        nodes.push_back(n);
+        return nodes.size()-1;
+    }
+
+    int lower(const texture* t){
+        int idx = emit(node{OP_VIRTUAL, 0, 0, 0, color(), t});
+
+        if(auto solid = dynamic_cast<const solid_color_tex*>(t)){
+            nodes[idx] = node{OP_CONST, 0, 0, 0, solid->col, nullptr};
+        } else if(auto checker = dynamic_cast<const checker_tex*>(t)){
+            int a = lower(checker->t1.get());
+            int b = lower(checker->t2.get());
+            if(nodes[a].op == OP_CONST && nodes[b].op == OP_CONST && nodes[a].col == nodes[b].col){
+                // Both cells are the same color, no need to branch at lookup time
+                color c = nodes[a].col;
+                nodes.resize(idx+1);
+                nodes[idx] = node{OP_CONST, 0, 0, 0, c, nullptr};
+            } else {
+                nodes[idx] = node{OP_CHECKER, a, b, checker->sz, color(), nullptr};
+            }
+        } else if(dynamic_cast<const image_tex*>(t)){
+            nodes[idx].op = OP_IMAGE;
+        } else if(dynamic_cast<const noise_tex*>(t)){
+            nodes[idx].op = OP_NOISE;
+        }
+        return idx;
+    }
+};
+
+#endif
@@ -1,17 +1,38 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
+#include <vector>
 
 #include "color.h"
 #include "pt_image.h"
 #include "perlin.h"
 
+// Width of a texture lookup, estimated from ray differentials
+struct tex_footprint {
+    double uv = 0;      // in uv space
+    double world = 0;   // in world space
+};
+
 class texture {
 public:
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    // Lookup over the given footprint, textures that can prefilter override this
+    virtual color filtered_value(double u, double v, const point3& p, const tex_footprint& fp) const {
+        return value(u, v, p);
+    }
+
+    // Lookup for a batch of n hits, filtered over their footprints fp unless it is null.
+    // Textures with a vectorized kernel override this.
+    virtual void values(int n, const double* u, const double* v, const point3* p, const tex_footprint* fp, color* out) const {
+        for(int i = 0; i < n; i++)
+            out[i] = fp != nullptr ? filtered_value(u[i], v[i], p[i], fp[i]) : value(u[i], v[i], p[i]);
+    }
 };
 
 class solid_color_tex : public texture {
@@ -49,6 +70,14 @@ public:
 
         return t2->value(u,v,p);
     }
+
+    color filtered_value(double u, double v, const point3& p, const tex_footprint& fp) const override {
+        int x = int(p.x()/sz), y = int(p.y()/sz), z = int(p.z()/sz);
+        if( (x+y+z) % 2 )
+            return t1->filtered_value(u, v, p, fp);
+
+        return t2->filtered_value(u, v, p, fp);
+    }
 };
 
 class image_tex : public texture {
@@ -60,17 +89,28 @@ public:
     image_tex(const char* filename): img(filename) {}
 
     color value(double u, double v, const point3& p) const override{
+        return lookup(u, v, 0);
+    }
+
+    color filtered_value(double u, double v, const point3& p, const tex_footprint& fp) const override {
+        // Pick the mip level whose texels match the footprint
+        double texels = fp.uv * std::max(img.width(), img.height());
+        int level = texels > 1.0 ? int(std::log2(texels)) : 0;
+        return lookup(u, v, std::min(level, img.mip_levels()-1));
+    }
+
+private:
+    color lookup(double u, double v, int level) const {
         if (img.height() <= 0) return color(0,1,1);
 
-        int x = u * img.width();
-        int y = v * img.height();
+        int x = u * img.width(level);
+        int y = v * img.height(level);
 
-        const unsigned char* col_bytes = img.pixel_data(x, y);
+        const unsigned char* col_bytes = img.pixel_data(x, y, level);
 
         double color_scale = 1.0/255.0;
         color col = color(col_bytes[0], col_bytes[1], col_bytes[2])*color_scale;
         return col;
-
     }
 
 };
@@ -79,13 +119,65 @@ class noise_tex : public texture {
 private:
     perlin noise;
     double scale;
+    int octaves;
 
 public:
-    noise_tex(double scale = 1): noise(), scale(scale){}
+    noise_tex(double scale = 1, int octaves = 1): noise(), scale(scale), octaves(octaves){}
 
     color value(double u, double v, const point3& p) const override {
-        double noiseVal = noise.noise(p*scale);
-        return color(1, 1, 1) * 0.5 * (1.0 + noiseVal);
+        return color(1, 1, 1) * 0.5 * (1.0 + noise_value(p, 0));
+    }
+
+    color filtered_value(double u, double v, const point3& p, const tex_footprint& fp) const override {
+        return color(1, 1, 1) * 0.5 * (1.0 + noise_value(p, fp.world*scale));
+    }
+
+    // Same sum as noise_value, one octave of all the points at a time
+    void values(int n, const double* u, const double* v, const point3* p, const tex_footprint* fp, color* out) const override {
+        thread_local std::vector<double> xs, ys, zs, xf, yf, zf, ns, accum, width;
+        xs.resize(n); ys.resize(n); zs.resize(n); xf.resize(n); yf.resize(n); zf.resize(n);
+        ns.resize(n); width.resize(n);
+        accum.assign(n, 0.0);
+        double narrowest = infinity;
+        for(int i = 0; i < n; i++){
+            point3 sp = p[i]*scale;
+            xs[i] = sp.x(); ys[i] = sp.y(); zs[i] = sp.z();
+            width[i] = fp != nullptr ? fp[i].world*scale : 0;
+            narrowest = std::fmin(narrowest, width[i]);
+        }
+
+        double weight = 1.0, freq = 1.0;
+        for(int o = 0; o < octaves; o++){
+            // Past the octave where the narrowest footprint fades out, all the points have stopped
+            if(o > 0 && 2.0 - 2.0*narrowest*freq <= 0.0) break;
+            for(int i = 0; i < n; i++){
+                xf[i] = xs[i]*freq; yf[i] = ys[i]*freq; zf[i] = zs[i]*freq;
+            }
+            noise.noise(xf.data(), yf.data(), zf.data(), ns.data(), n);
+            for(int i = 0; i < n; i++){
+                double fade = o == 0 ? 1.0 : std::fmin(1.0, 2.0 - 2.0*width[i]*freq);
+                if(fade > 0.0) accum[i] += fade * weight * ns[i];
+            }
+            weight *= 0.5;
+            freq *= 2;
+        }
+        for(int i = 0; i < n; i++)
+            out[i] = color(1, 1, 1) * 0.5 * (1.0 + accum[i]);
+    }
+
+private:
+    double noise_value(const point3& p, double width) const {
+        // Octaves finer than the footprint (width, in noise space) average out to 0,
+        // they are faded out then skipped. The base octave is always kept whole.
+        double accum = 0.0, weight = 1.0, freq = 1.0;
+        for(int i = 0; i < octaves; i++){
+            double fade = i == 0 ? 1.0 : std::fmin(1.0, 2.0 - 2.0*width*freq);
+            if(fade <= 0.0) break;
+            accum += fade * weight * noise.noise(p*scale*freq);
+            weight *= 0.5;
+            freq *= 2;
+        }
+        return accum;
     }
 };
 
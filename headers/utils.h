@@ -6,6 +6,8 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
+#include <cstdint>
+#include <atomic>
 
 
 using std::make_shared;
@@ -31,8 +33,42 @@ inline double radsToDeg(double rads){
     return rads * 180.0 / PI;
 }
 
+// Each thread owns a splitmix64 generator, rand() is shared by all threads and serializes them.
+// Threads are seeded one after the other from a common counter.
+inline std::atomic<uint64_t>& random_seed_counter(){
+    static std::atomic<uint64_t> counter{0};
+    return counter;
+}
+
+inline uint64_t splitmix64(uint64_t& state){
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+inline uint64_t& thread_random_state(){
+    thread_local uint64_t state = [](){
+        uint64_t s = random_seed_counter().fetch_add(1);
+        return splitmix64(s);
+    }();
+    return state;
+}
+
+// Restarts the calling thread's generator and the seeds of the threads started afterwards
+inline void seed_random(uint64_t seed){
+    random_seed_counter() = seed;
+    uint64_t s = random_seed_counter().fetch_add(1);
+    thread_random_state() = splitmix64(s);
+}
+
+// Restarts only the calling thread's generator
+inline void seed_thread_random(uint64_t seed){
+    thread_random_state() = splitmix64(seed);
+}
+
 inline double randDouble(){
-    return rand() / (RAND_MAX+1.0);
+    return (splitmix64(thread_random_state()) >> 11) * 0x1p-53;
 }
 
 inline double randDouble(double min, double max){
@@ -40,7 +76,14 @@ inline double randDouble(double min, double max){
 }
 
 inline int rand_int(int min, int max){
-    return min + rand()%(max-min);
+    return min + int(splitmix64(thread_random_state()) % uint64_t(max-min));
+}
+
+// Atomic a += v for floating point types, which have no fetch_add before C++20
+template<typename T>
+inline void atomic_add(std::atomic<T>& a, T v){
+    T cur = a.load(std::memory_order_relaxed);
+    while(!a.compare_exchange_weak(cur, cur + v, std::memory_order_relaxed));
 }
 
 
@@ -0,0 +1,207 @@
+#ifndef VOXEL_GRID_H
+#define VOXEL_GRID_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "numa.h"
+
+// 3D DDA of the ray o + t*d over [t0, t1) through the cubic cells of side cell, restricted to the
+// cells [lo, hi) on each axis. f(c, tEnter, tExit) is called for every cell crossed, in order,
+// until it returns true. Returns whether it did.
+template<typename F>
+bool walk_cells(const point3& o, const vec3& d, double t0, double t1, double cell, const int lo[3], const int hi[3], F&& f) {
+    point3 g = o + t0*d;
+    int c[3], step[3];
+    double tNext[3], tDelta[3];
+    for(int a = 0; a < 3; a++){
+        if(lo[a] >= hi[a]) return false;
+        c[a] = std::clamp(int(std::floor(g[a] / cell)), lo[a], hi[a]-1);
+        if(d[a] > 0){
+            step[a] = 1;
+            tNext[a] = t0 + ((c[a]+1)*cell - g[a]) / d[a];
+            tDelta[a] = cell / d[a];
+        } else if(d[a] < 0){
+            step[a] = -1;
+            tNext[a] = t0 + (c[a]*cell - g[a]) / d[a];
+            tDelta[a] = -cell / d[a];
+        } else {
+            step[a] = 0;
+            tNext[a] = tDelta[a] = infinity;
+        }
+    }
+
+    double t = t0;
+    while(t < t1){
+        int a = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        double tEnd = std::fmin(tNext[a], t1);
+        if(f(c, t, tEnd)) return true;
+        t = tEnd;
+        c[a] += step[a];
+        if(c[a] < lo[a] || c[a] >= hi[a]) break;
+        tNext[a] += tDelta[a];
+    }
+    return false;
+}
+
+// Called with segments [t0, t1) of a ray and a bound of the density along them, true stops the walk
+using majorant_segment_fn = std::function<bool(double t0, double t1, double majorant)>;
+
+// Scalar field sampled on a nx*ny*nz lattice, voxel (i,j,k) covers [i,i+1)x[j,j+1)x[k,k+1)
+// in grid coordinates. Voxels outside the lattice are empty.
+class voxel_grid {
+public:
+    int nx = 0, ny = 0, nz = 0;
+
+    virtual ~voxel_grid() = default;
+
+    virtual float voxel(int i, int j, int k) const = 0;
+
+    // Highest value over the voxels in [i0,i1)x[j0,j1)x[k0,k1), used to build majorants
+    virtual float max_over(int i0, int j0, int k0, int i1, int j1, int k1) const {
+        i0 = std::max(i0, 0); j0 = std::max(j0, 0); k0 = std::max(k0, 0);
+        i1 = std::min(i1, nx); j1 = std::min(j1, ny); k1 = std::min(k1, nz);
+        float m = 0;
+        for(int k = k0; k < k1; k++)
+            for(int j = j0; j < j1; j++)
+                for(int i = i0; i < i1; i++)
+                    m = std::max(m, voxel(i, j, k));
+        return m;
+    }
+
+    // Prepares walk_majorants once the voxels are set. The default walk goes through a coarse grid
+    // of upper bounds, one per block of majorant_cell^3 voxels, padded by one voxel so the bound
+    // also holds for the interpolated density.
+    virtual void build_majorants() {
+        for(int a = 0; a < 3; a++)
+            majorant_res[a] = ((a == 0 ? nx : a == 1 ? ny : nz) + majorant_cell-1)/majorant_cell;
+        majorants.resize(size_t(majorant_res[0])*majorant_res[1]*majorant_res[2]);
+
+        const int cs = majorant_cell;
+        #pragma omp parallel for collapse(2)
+        for(int k = 0; k < majorant_res[2]; k++)
+            for(int j = 0; j < majorant_res[1]; j++)
+                for(int i = 0; i < majorant_res[0]; i++)
+                    majorants[(size_t(k)*majorant_res[1] + j)*majorant_res[0] + i] =
+                        max_over(i*cs-1, j*cs-1, k*cs-1, (i+1)*cs+1, (j+1)*cs+1, (k+1)*cs+1);
+    }
+
+    // Passes f the segments of the ray o + t*d (grid coordinates) over [t0, t1) in order, each with
+    // a bound of the interpolated density along it, until f returns true. Segments where the
+    // density is 0 are left out. Returns whether f stopped the walk.
+    virtual bool walk_majorants(const point3& o, const vec3& d, double t0, double t1, const majorant_segment_fn& f) const {
+        const int lo[3] = {0, 0, 0};
+        return walk_cells(o, d, t0, t1, majorant_cell, lo, majorant_res, [&](const int* c, double tEnter, double tExit){
+            float m = majorants[(size_t(c[2])*majorant_res[1] + c[1])*majorant_res[0] + c[0]];
+            return m > 0 && f(tEnter, tExit, m);
+        });
+    }
+
+    // Trilinear interpolation at grid coordinates g, voxel values sit at voxel centers
+    double density(const point3& g) const {
+        double x = g.x() - 0.5, y = g.y() - 0.5, z = g.z() - 0.5;
+        int i = int(std::floor(x)), j = int(std::floor(y)), k = int(std::floor(z));
+        double u = x - i, v = y - j, w = z - k;
+
+        double accum = 0.0;
+        for(int di = 0; di < 2; di++)
+            for(int dj = 0; dj < 2; dj++)
+                for(int dk = 0; dk < 2; dk++)
+                    accum += (di ? u : 1-u) * (dj ? v : 1-v) * (dk ? w : 1-w) * voxel(i+di, j+dj, k+dk);
+        return accum;
+    }
+
+private:
+    static const int majorant_cell = 8;
+    int majorant_res[3] = {0, 0, 0};
+    numa::scene_vector<float> majorants;
+};
+
+class dense_grid : public voxel_grid {
+public:
+    numa::scene_vector<float> data; // x varies fastest
+
+    dense_grid(int x, int y, int z): data(size_t(x)*y*z, 0.0f) {
+        nx = x; ny = y; nz = z;
+    }
+
+    float voxel(int i, int j, int k) const override {
+        if(i < 0 || j < 0 || k < 0 || i >= nx || j >= ny || k >= nz) return 0;
+        return data[(size_t(k)*ny + j)*nx + i];
+    }
+
+    float& at(int i, int j, int k) {
+        return data[(size_t(k)*ny + j)*nx + i];
+    }
+};
+
+// Loads a grid stored as a one line ascii header followed by little endian binary data:
+//   "PTVOL dense nx ny nz\n"          then nx*ny*nz float32, x varying fastest
+//   "PTVOL sparse nx ny nz count\n"   then count records of int32 i, j, k and float32 value
+// Returns nullptr if the file can not be read, its kind is neither dense nor sparse, it has more
+// than max_voxels voxels or it is shorter than its header says.
+inline shared_ptr<dense_grid> load_voxel_grid(const std::string& filename, size_t max_voxels = size_t(1) << 30) {
+    FILE* f = std::fopen(filename.c_str(), "rb");
+    if(f == nullptr){
+        std::clog << "Could not open voxel grid " << filename << std::endl;
+        return nullptr;
+    }
+
+    char kind[16];
+    int nx, ny, nz;
+    long count = 0;
+    bool ok = std::fscanf(f, "PTVOL %15s %d %d %d", kind, &nx, &ny, &nz) == 4 && nx > 0 && ny > 0 && nz > 0;
+    bool sparse = ok && std::strcmp(kind, "sparse") == 0;
+    if(ok && !sparse && std::strcmp(kind, "dense") != 0){
+        std::clog << "Unknown voxel grid kind " << kind << " in " << filename << std::endl;
+        std::fclose(f);
+        return nullptr;
+    }
+    if(sparse) ok = std::fscanf(f, "%ld", &count) == 1 && count >= 0;
+    ok = ok && std::fgetc(f) == '\n';
+
+    // Check the sizes before allocating, a corrupt header would ask for any amount of memory
+    if(ok){
+        if(size_t(nx)*ny > max_voxels/nz){
+            std::clog << "Voxel grid " << filename << " has more than " << max_voxels << " voxels" << std::endl;
+            std::fclose(f);
+            return nullptr;
+        }
+        long start = std::ftell(f);
+        std::fseek(f, 0, SEEK_END);
+        size_t left = size_t(std::ftell(f) - start);
+        std::fseek(f, start, SEEK_SET);
+        if(sparse) ok = size_t(count) <= left/(3*sizeof(int32_t) + sizeof(float));
+        else ok = size_t(nx)*ny*nz <= left/sizeof(float);
+    }
+
+    shared_ptr<dense_grid> grid;
+    if(ok){
+        grid = make_shared<dense_grid>(nx, ny, nz);
+        if(!sparse){
+            ok = std::fread(grid->data.data(), sizeof(float), grid->data.size(), f) == grid->data.size();
+        } else {
+            for(long n = 0; ok && n < count; n++){
+                int32_t ijk[3]; float val;
+                ok = std::fread(ijk, sizeof(int32_t), 3, f) == 3 && std::fread(&val, sizeof(float), 1, f) == 1;
+                if(ok && ijk[0] >= 0 && ijk[1] >= 0 && ijk[2] >= 0 && ijk[0] < nx && ijk[1] < ny && ijk[2] < nz)
+                    grid->at(ijk[0], ijk[1], ijk[2]) = val;
+            }
+        }
+    }
+    std::fclose(f);
+
+    if(!ok){
+        std::clog << "Malformed voxel grid " << filename << std::endl;
+        return nullptr;
+    }
+    return grid;
+}
+
+#endif
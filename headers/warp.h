@@ -0,0 +1,140 @@
+#ifndef WARP_H
+#define WARP_H
+
+#include "vec3.h"
+#include "utils.h"
+
+// Closed form maps from [0,1)^2 to common sampling domains. They take their random numbers as
+// arguments so stratified or QMC samples keep their distribution, and have no loops or data
+// dependent branches (the selects compile to conditional moves), so each costs the same.
+// Directions are in a local frame around +z, move them around a normal with to_world.
+// The batch versions work on arrays of samples and vectorize.
+
+// Shirley and Chiu 1997, area preserving and keeps strata shapes
+inline vec3 warp_concentric_disk(double su, double sv){
+    double a = 2*su - 1, b = 2*sv - 1;
+    bool horizontal = a*a > b*b;
+    double r = horizontal ? a : b;
+    double num = horizontal ? b : a, den = horizontal ? a : b;
+    double q = den != 0 ? num/den : 0;
+    double phi = horizontal ? (PI/4)*q : PI/2 - (PI/4)*q;
+    return vec3(r*std::cos(phi), r*std::sin(phi), 0);
+}
+
+inline vec3 warp_uniform_sphere(double su, double sv){
+    double z = 1 - 2*su;
+    double r = std::sqrt(std::fmax(0.0, 1 - z*z));
+    double phi = 2*PI*sv;
+    return vec3(r*std::cos(phi), r*std::sin(phi), z);
+}
+
+inline vec3 warp_uniform_hemisphere(double su, double sv){
+    double z = su;
+    double r = std::sqrt(std::fmax(0.0, 1 - z*z));
+    double phi = 2*PI*sv;
+    return vec3(r*std::cos(phi), r*std::sin(phi), z);
+}
+
+// Cosine weighted directions inside the cone of half angle acos(cosThetaMax), a full
+// hemisphere by default. The disk is shrunk to the cone's radius then lifted (Malley's method).
+inline vec3 warp_cosine_hemisphere(double su, double sv, double cosThetaMax = 0){
+    vec3 d = warp_concentric_disk(su, sv) * std::sqrt(std::fmax(0.0, 1 - cosThetaMax*cosThetaMax));
+    double z = std::sqrt(std::fmax(0.0, 1 - d.x()*d.x() - d.y()*d.y()));
+    return vec3(d.x(), d.y(), z);
+}
+
+inline vec3 warp_uniform_cone(double su, double sv, double cosThetaMax){
+    double z = (1 - su) + su*cosThetaMax;
+    double r = std::sqrt(std::fmax(0.0, 1 - z*z));
+    double phi = 2*PI*sv;
+    return vec3(r*std::cos(phi), r*std::sin(phi), z);
+}
+
+// Barycentric coordinates (b0, b1, b2) uniform over a triangle
+inline vec3 warp_uniform_triangle(double su, double sv){
+    double s = std::sqrt(su);
+    double b0 = 1 - s, b1 = sv*s;
+    return vec3(b0, b1, 1 - b0 - b1);
+}
+
+inline double warp_uniform_sphere_pdf(){ return 1/(4*PI); }
+inline double warp_uniform_hemisphere_pdf(){ return 1/(2*PI); }
+inline double warp_uniform_cone_pdf(double cosThetaMax){ return 1/(2*PI*(1 - cosThetaMax)); }
+inline double warp_cosine_hemisphere_pdf(double cosTheta, double cosThetaMax = 0){
+    return cosTheta < cosThetaMax ? 0.0 : cosTheta / (PI*(1 - cosThetaMax*cosThetaMax));
+}
+
+// Expresses a local direction in the frame around the unit vector n, with the branchless
+// orthonormal basis of Duff et al. 2017
+inline vec3 to_world(const vec3& local, const vec3& n){
+    double sign = std::copysign(1.0, n.z());
+    double a = -1/(sign + n.z());
+    double b = n.x()*n.y()*a;
+    vec3 t(1 + sign*n.x()*n.x()*a, sign*b, -sign*n.x());
+    vec3 bt(b, sign + n.y()*n.y()*a, -n.y());
+    return local.x()*t + local.y()*bt + local.z()*n;
+}
+
+
+// Batch versions, on structure of arrays buffers
+inline void warp_concentric_disk(int n, const double* su, const double* sv, double* x, double* y){
+    #pragma omp simd
+    for(int i = 0; i < n; i++){
+        double a = 2*su[i] - 1, b = 2*sv[i] - 1;
+        bool horizontal = a*a > b*b;
+        double r = horizontal ? a : b;
+        double num = horizontal ? b : a, den = horizontal ? a : b;
+        double q = den != 0 ? num/den : 0;
+        double phi = horizontal ? (PI/4)*q : PI/2 - (PI/4)*q;
+        x[i] = r*std::cos(phi);
+        y[i] = r*std::sin(phi);
+    }
+}
+
+inline void warp_uniform_sphere(int n, const double* su, const double* sv, double* x, double* y, double* z){
+    #pragma omp simd
+    for(int i = 0; i < n; i++){
+        double zi = 1 - 2*su[i];
+        double r = std::sqrt(std::fmax(0.0, 1 - zi*zi));
+        double phi = 2*PI*sv[i];
+        x[i] = r*std::cos(phi); y[i] = r*std::sin(phi); z[i] = zi;
+    }
+}
+
+inline void warp_uniform_hemisphere(int n, const double* su, const double* sv, double* x, double* y, double* z){
+    #pragma omp simd
+    for(int i = 0; i < n; i++){
+        double zi = su[i];
+        double r = std::sqrt(std::fmax(0.0, 1 - zi*zi));
+        double phi = 2*PI*sv[i];
+        x[i] = r*std::cos(phi); y[i] = r*std::sin(phi); z[i] = zi;
+    }
+}
+
+inline void warp_cosine_hemisphere(int n, const double* su, const double* sv, double* x, double* y, double* z){
+    warp_concentric_disk(n, su, sv, x, y);
+    #pragma omp simd
+    for(int i = 0; i < n; i++)
+        z[i] = std::sqrt(std::fmax(0.0, 1 - x[i]*x[i] - y[i]*y[i]));
+}
+
+inline void warp_uniform_cone(int n, const double* su, const double* sv, double cosThetaMax, double* x, double* y, double* z){
+    #pragma omp simd
+    for(int i = 0; i < n; i++){
+        double zi = (1 - su[i]) + su[i]*cosThetaMax;
+        double r = std::sqrt(std::fmax(0.0, 1 - zi*zi));
+        double phi = 2*PI*sv[i];
+        x[i] = r*std::cos(phi); y[i] = r*std::sin(phi); z[i] = zi;
+    }
+}
+
+inline void warp_uniform_triangle(int n, const double* su, const double* sv, double* b0, double* b1){
+    #pragma omp simd
+    for(int i = 0; i < n; i++){
+        double s = std::sqrt(su[i]);
+        b0[i] = 1 - s;
+        b1[i] = sv[i]*s;
+    }
+}
+
+#endif
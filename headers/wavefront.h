@@ -0,0 +1,295 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "camera.h"
+#include "integrator.h"
+#include "material_table.h"
+
+// Path tracer advancing the camera samples of a tile together, one bounce at a time through
+// separate stages, each a loop over the path buffers:
+//   intersect -> sort hits by material -> texture lookups -> shade -> accumulate -> compact
+// The rays, hits and throughputs are kept as arrays of components, the sort keys and the
+// throughput updates are vector loops. Traversal and shading stay per path, through the scalar
+// BVH and the material classes. The hits of a material are contiguous after the sort, their
+// textures are looked up together (material::texture_values).
+// It evaluates the same estimator as camera::ray_color (emission plus BSDF/light mixture
+// sampling, there is no separate shadow ray to trace) with the camera's sampler: every path
+// keeps the sampler dimension it reached and resumes from it when shaded. The tiles are rendered
+// in parallel, the stages of a tile are serial. The guide only applies to ray_color.
+class wavefront_integrator : public integrator {
+public:
+    int batchSize = 1 << 14;    // camera samples in flight in a tile
+
+    int batch_samples() const override {
+        return batchSize;
+    }
+
+    // A single path, when the camera doesn't batch (preview blocks)
+    color radiance(const ray& r, const hittable& world, shared_ptr<hittable> lights, const camera& cam,
+                   sampler& smp, film_tile& tile, aov_sample* aov) override {
+        camera_sample cs;
+        cs.px = cs.py = cs.index = 0;
+        cs.dim = smp.dimension();
+        cs.fx = cs.fy = 0;
+        cs.r = r;
+        color L;
+        aov_sample firstHit;
+        radiance_batch(&cs, 1, world, lights, cam, smp, tile, &L, aov != nullptr ? aov : &firstHit);
+        return L;
+    }
+
+    void radiance_batch(const camera_sample* samples, int n, const hittable& world, shared_ptr<hittable> lights,
+                        const camera& cam, sampler& smp, film_tile& tile, color* out, aov_sample* aovs) override {
+        thread_local path_state paths;
+        paths.start(samples, n);
+        // A lone path carries on with the sampler where it is
+        bool resume = n > 1;
+        for(int bounce = 0; bounce <= cam.maxRayBounce && !paths.active.empty(); bounce++){
+            paths.intersect(world);
+            paths.sort_by_material(*cam.materials);
+            paths.lookup_textures(*cam.materials);
+            paths.shade(samples, cam, lights, smp, resume, bounce, bounce == 0 ? aovs : nullptr);
+            paths.accumulate();
+            paths.compact();
+        }
+        for(int i = 0; i < n; i++)
+            out[i] = color(paths.rad_r[i], paths.rad_g[i], paths.rad_b[i]);
+    }
+
+    shared_ptr<integrator> clone() const override {
+        return make_shared<wavefront_integrator>(*this);
+    }
+
+private:
+    // Path state, one entry per camera sample of the batch, as arrays of components
+    struct path_state {
+        // Rays: origin, direction, closest hit so far and time, with their differentials
+        std::vector<double> org_x, org_y, org_z;
+        std::vector<double> dir_x, dir_y, dir_z;
+        std::vector<double> tmax, time;
+        std::vector<char> has_diff;
+        std::vector<point3> rx_org, ry_org;
+        std::vector<vec3> rx_dir, ry_dir;
+
+        // Hits: distance, texture coordinates and material. The full records are the shading
+        // points, some hittables resolve them while traversing (animated, constant_medium)
+        std::vector<double> hit_t, hit_u, hit_v;
+        std::vector<uint32_t> hit_mat;
+        std::vector<hit_record> surfaces;
+
+        std::vector<double> thr_r, thr_g, thr_b;    // throughput
+        std::vector<double> rad_r, rad_g, rad_b;    // radiance gathered so far
+        std::vector<double> em_r, em_g, em_b;       // radiance found at this bounce
+        std::vector<double> w_r, w_g, w_b;          // throughput weight of the next bounce
+        std::vector<int> dims;                      // sampler dimension the path resumes from
+        std::vector<char> alive, did_hit;
+
+        std::vector<int> active;    // paths still bouncing
+        std::vector<int> keys;      // sort key of the active paths, 0 for a miss else 1 + material kind
+        std::vector<int> sorted;    // active paths, misses first then the hits grouped by material kind and id
+        int misses = 0;             // paths at the start of sorted that escaped
+
+        // Texture lookups of the hits, in sorted order
+        std::vector<double> tex_u, tex_v;
+        std::vector<point3> tex_p;
+        std::vector<tex_footprint> tex_fp;
+        std::vector<color> texels;
+        std::vector<char> textured;
+
+        void start(const camera_sample* samples, int n){
+            for(auto* v : {&org_x, &org_y, &org_z, &dir_x, &dir_y, &dir_z, &tmax, &time, &hit_t, &hit_u, &hit_v,
+                           &em_r, &em_g, &em_b, &w_r, &w_g, &w_b})
+                v->resize(n);
+            has_diff.resize(n); rx_org.resize(n); ry_org.resize(n); rx_dir.resize(n); ry_dir.resize(n);
+            hit_mat.resize(n); surfaces.resize(n);
+            thr_r.assign(n, 1.0); thr_g.assign(n, 1.0); thr_b.assign(n, 1.0);
+            rad_r.assign(n, 0.0); rad_g.assign(n, 0.0); rad_b.assign(n, 0.0);
+            dims.resize(n); alive.resize(n); did_hit.resize(n);
+            active.resize(n); keys.resize(n); sorted.resize(n);
+            for(int i = 0; i < n; i++){
+                set_ray(i, samples[i].r);
+                dims[i] = samples[i].dim;
+                alive[i] = 1;
+                active[i] = i;
+            }
+        }
+
+        ray get_ray(int i) const {
+            ray r(point3(org_x[i], org_y[i], org_z[i]), vec3(dir_x[i], dir_y[i], dir_z[i]), time[i]);
+            if(has_diff[i]) r.set_differentials(rx_org[i], rx_dir[i], ry_org[i], ry_dir[i]);
+            return r;
+        }
+
+        void set_ray(int i, const ray& r){
+            org_x[i] = r.origin().x(); org_y[i] = r.origin().y(); org_z[i] = r.origin().z();
+            dir_x[i] = r.direction().x(); dir_y[i] = r.direction().y(); dir_z[i] = r.direction().z();
+            tmax[i] = infinity;
+            time[i] = r.time();
+            has_diff[i] = r.has_differentials;
+            rx_org[i] = r.rx_origin; rx_dir[i] = r.rx_direction;
+            ry_org[i] = r.ry_origin; ry_dir[i] = r.ry_direction;
+        }
+
+        // The hits are completed here, the sort needs their material
+        void intersect(const hittable& world){
+            for(int i : active){
+                ray r = get_ray(i);
+                hit_record& hr = surfaces[i];
+                did_hit[i] = world.hit(r, interval(0.001, tmax[i]), hr);
+                if(!did_hit[i]) continue;
+                hr.obj->surface_interaction(r, hr);
+                hr.compute_differentials(r);
+                tmax[i] = hit_t[i] = hr.t;
+                hit_u[i] = hr.u; hit_v[i] = hr.v;
+                hit_mat[i] = hr.mat_id;
+            }
+        }
+
+        void sort_by_material(const material_table& materials){
+            int n = active.size();
+            const int* idx = active.data();
+            const char* hit = did_hit.data();
+            const uint32_t* mat = hit_mat.data();
+            int* key = keys.data();
+            #pragma omp simd
+            for(int a = 0; a < n; a++){
+                int i = idx[a];
+                key[a] = hit[i] ? 1 + int(materials.kind(mat[i])) : 0;
+            }
+
+            // Counting sort of the hits by material kind, misses go first
+            const int kinds = 8;
+            std::array<int, kinds + 2> offsets{};
+            for(int a = 0; a < n; a++) offsets[key[a] + 1]++;
+            for(int k = 0; k <= kinds; k++) offsets[k+1] += offsets[k];
+            for(int a = 0; a < n; a++) sorted[offsets[key[a]]++] = idx[a];
+            misses = offsets[0];
+
+            // Then by material within a kind, the bucket of key k now ends at offsets[k]
+            for(int k = 0; k < kinds; k++)
+                std::sort(sorted.begin() + offsets[k], sorted.begin() + offsets[k+1],
+                          [this](int a, int b){ return hit_mat[a] < hit_mat[b]; });
+        }
+
+        void lookup_textures(const material_table& materials){
+            int n = active.size();
+            tex_u.resize(n); tex_v.resize(n); tex_p.resize(n); tex_fp.resize(n);
+            texels.resize(n); textured.assign(n, 0);
+            for(int a = misses; a < n; a++){
+                int i = sorted[a];
+                tex_u[a] = hit_u[i]; tex_v[a] = hit_v[i]; tex_p[a] = surfaces[i].p; tex_fp[a] = surfaces[i].footprint;
+            }
+            for(int a0 = misses, a1; a0 < n; a0 = a1){
+                uint32_t id = hit_mat[sorted[a0]];
+                for(a1 = a0 + 1; a1 < n && hit_mat[sorted[a1]] == id; a1++);
+                bool found = materials.get(id)->texture_values(a1 - a0, &tex_u[a0], &tex_v[a0], &tex_p[a0], &tex_fp[a0], &texels[a0]);
+                std::fill(textured.begin() + a0, textured.begin() + a1, found);
+            }
+        }
+
+        // Finds the emission and the next ray of every path, the throughput is updated by accumulate
+        void shade(const camera_sample* samples, const camera& cam, const shared_ptr<hittable>& lights, sampler& smp,
+                   bool resume, int bounce, aov_sample* aovs){
+            bool lastBounce = bounce == cam.maxRayBounce;
+            int n = active.size();
+            for(int a = 0; a < n; a++){
+                int i = sorted[a];
+                ray r = get_ray(i);
+
+                if(!did_hit[i]){
+                    set_emitted(i, cam.background(r));
+                    alive[i] = 0;
+                    continue;
+                }
+
+                hit_record& hr = surfaces[i];
+                const material* mat = cam.materials->get(hit_mat[i]);
+                set_emitted(i, mat->emitted(hit_u[i], hit_v[i], hr.p));
+
+                scatter_rec sr;
+                bool scatters = textured[a] ? mat->scatter_texel(r, hr, texels[a], sr) : mat->scatter(r, hr, sr);
+                if(aovs != nullptr){
+                    aovs[i].hit = true;
+                    aovs[i].albedo = scatters ? sr.attenuation : color(1,1,1);
+                    aovs[i].normal = hr.normal;
+                    aovs[i].depth = hit_t[i] * r.direction().length();
+                }
+                if(lastBounce || !scatters){
+                    alive[i] = 0;
+                    continue;
+                }
+
+                if(resume){
+                    smp.start_pixel_sample(samples[i].px, samples[i].py, samples[i].index);
+                    smp.set_dimension(dims[i]);
+                }
+
+                if(sr.scattered_solid_angle < 0.1){
+                    ray specular = ray(hr.p, sr.pdf_ptr->generate(smp));
+                    mat->scatter_differentials(r, hr, specular);
+                    set_ray(i, specular);
+                    set_weight(i, sr.attenuation);
+                    dims[i] = smp.dimension();
+                    continue;
+                }
+
+                // Equal mixture of the BSDF and the lights, as the linear_comb_pdf of ray_color
+                double pdfval = 0, matPdf = 0;
+                vec3 dir;
+                while(pdfval < EPSILON){
+                    double pick = smp.get_1d();
+                    if(lights == nullptr || pick <= 0.5){
+                        dir = sr.pdf_ptr->generate(smp);
+                    } else {
+                        double su, sv;
+                        smp.get_2d(su, sv);
+                        dir = lights->sample_direction(hr.p, su, sv);
+                    }
+                    matPdf = sr.pdf_ptr->val(dir);
+                    pdfval = lights == nullptr ? matPdf : 0.5*(matPdf + lights->pdf_value(hr.p, dir));
+                }
+                set_ray(i, ray(hr.p, dir, hr.t));
+                set_weight(i, sr.attenuation * (matPdf / pdfval));
+                dims[i] = smp.dimension();
+            }
+        }
+
+        // Adds the emission found by shade and applies the weight of the next bounce
+        void accumulate(){
+            int n = active.size();
+            const int* idx = active.data();
+            double *tr = thr_r.data(), *tg = thr_g.data(), *tb = thr_b.data();
+            double *lr = rad_r.data(), *lg = rad_g.data(), *lb = rad_b.data();
+            const double *er = em_r.data(), *eg = em_g.data(), *eb = em_b.data();
+            const double *wr = w_r.data(), *wg = w_g.data(), *wb = w_b.data();
+            #pragma omp simd
+            for(int a = 0; a < n; a++){
+                int i = idx[a];
+                lr[i] += tr[i]*er[i]; lg[i] += tg[i]*eg[i]; lb[i] += tb[i]*eb[i];
+                tr[i] *= wr[i]; tg[i] *= wg[i]; tb[i] *= wb[i];
+            }
+        }
+
+        void compact(){
+            int kept = 0;
+            for(int i : active)
+                if(alive[i]) active[kept++] = i;
+            active.resize(kept);
+        }
+
+        void set_emitted(int i, const color& c){
+            em_r[i] = c.x(); em_g[i] = c.y(); em_b[i] = c.z();
+            w_r[i] = w_g[i] = w_b[i] = 1;
+        }
+
+        void set_weight(int i, const color& c){
+            w_r[i] = c.x(); w_g[i] = c.y(); w_b[i] = c.z();
+        }
+    };
+};
+
+#endif
@@ -10,64 +10,80 @@
 #include "shape2d.h"
 #include "box.h"
 #include "constant_medium.h"
+#include "heterogeneous_medium.h"
+#include "sparse_grid.h"
+#include "sphere_set.h"
+#include "scene.h"
+#include "distributed.h"
+#include "render_daemon.h"
+#include "batch.h"
+#include "preview.h"
+#include "bdpt.h"
+#include "photon_map.h"
+#include "wavefront.h"
 
 #include <numeric>
 #include <vector>
+#include <string>
+#include <omp.h>
 
-void complex_scene(){
+scene complex_scene(){
+    auto arena = make_shared<scene_arena>();
     hittable_list world;
 
-    auto earth_tex = make_shared<image_tex>("images/earthmap.jpg");
-    auto earth_mat = make_shared<lambertian>(earth_tex);
+    auto earth_tex = arena->texture<image_tex>("images/earthmap.jpg");
+    auto earth_mat = arena->material<lambertian>(earth_tex);
 
-    auto noiseTex = make_shared<noise_tex>(4);
-    auto noiseMat = make_shared<lambertian>(noiseTex);
+    auto noiseTex = arena->texture<noise_tex>(4);
+    auto noiseMat = arena->material<lambertian>(noiseTex);
     
 
-    auto checker = make_shared<checker_tex>(color(0.78, 0.41, 1.0), color(0.75, 0.89, 0.74));
+    auto checker = arena->texture<checker_tex>(color(0.78, 0.41, 1.0), color(0.75, 0.89, 0.74));
     checker->set_size(0.32);
-    auto ground_material = make_shared<lambertian>(checker);
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, noiseMat));
+    auto ground_material = arena->material<lambertian>(checker);
+    world.add(arena->geometry<sphere>(point3(0,-1000,0), 1000, noiseMat));
 
+    auto small_spheres = arena->geometry<sphere_set>();
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
             auto choose_mat = randDouble();
             point3 center(a + 0.9*randDouble(), 0.2, b + 0.9*randDouble());
 
             if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
+                uint32_t sphere_material;
 
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = arena->material<lambertian>(albedo);
+                    small_spheres->add(center, 0.2, sphere_material);
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = randDouble(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = arena->material<metal>(albedo, fuzz);
+                    small_spheres->add(center, 0.2, sphere_material);
                 } else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = arena->material<dielectric>(1.5);
+                    small_spheres->add(center, 0.2, sphere_material);
                 }
             }
         }
     }
+    world.add(small_spheres);
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    auto material1 = arena->material<dielectric>(1.5);
+    world.add(arena->geometry<sphere>(point3(0, 1, 0), 1.0, material1));
 
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, earth_mat));
+    world.add(arena->geometry<sphere>(point3(-4, 1, 0), 1.0, earth_mat));
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    auto material3 = arena->material<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(arena->geometry<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    world.add(make_shared<sphere>(point3(8,1,1), 1.0, noiseMat));
+    world.add(arena->geometry<sphere>(point3(8,1,1), 1.0, noiseMat));
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(arena->acceleration<bvh_node>(world, arena.get()));
 
 
     camera cam;
@@ -83,9 +99,7 @@ void complex_scene(){
     cam.lookat   = point3(0,0,1.2);
     cam.vup      = vec3(0,1,0);
 
-    cam.render(world, nullptr);
-   
-    std::clog << "\n\rDone done.                                     \n";
+    return {arena, world, nullptr, cam};
 }
 
 
@@ -93,24 +107,25 @@ void center_sphere_move(double t, sphere& _base){
     _base.center[2] += (t-0.5)*2;
 }
 
-void simple_scene() {
+scene simple_scene() {
+    auto arena = make_shared<scene_arena>();
     hittable_list world;
     
-    auto materialGround = make_shared<lambertian>(color(0.8,0.8,0.0));
-    auto materialCenter = make_shared<lambertian>(color(0.1,0.2,0.5));
-    auto materialLeft   = make_shared<dielectric>(1.5);
-    auto materialRight  = make_shared<metal>(color(0.8,0.6,0.2), 0.9);
-    auto materialBubble = make_shared<dielectric>(1.0/1.5);
+    auto materialGround = arena->material<lambertian>(color(0.8,0.8,0.0));
+    auto materialCenter = arena->material<lambertian>(color(0.1,0.2,0.5));
+    auto materialLeft   = arena->material<dielectric>(1.5);
+    auto materialRight  = arena->material<metal>(color(0.8,0.6,0.2), 0.9);
+    auto materialBubble = arena->material<dielectric>(1.0/1.5);
 
-    auto center_sphere = make_shared<sphere>(sphere(point3(0,0,1.2), 0.5, materialCenter));
+    auto center_sphere = arena->geometry<sphere>(sphere(point3(0,0,1.2), 0.5, materialCenter));
 
-    //world.add(make_shared<sphere>(point3(0,-100.5,-1), 100, materialGround));
+    //world.add(arena->geometry<sphere>(point3(0,-100.5,-1), 100, materialGround));
     world.add(center_sphere);
-    world.add(make_shared<sphere>(point3(-1.1,0,1.0), 0.5, materialLeft));
-    world.add(make_shared<sphere>(point3(-1.1,0,1.0), 0.4, materialBubble));
-    world.add(make_shared<sphere>(point3(1.1,0,1.0), 0.5, materialRight));
+    world.add(arena->geometry<sphere>(point3(-1.1,0,1.0), 0.5, materialLeft));
+    world.add(arena->geometry<sphere>(point3(-1.1,0,1.0), 0.4, materialBubble));
+    world.add(arena->geometry<sphere>(point3(1.1,0,1.0), 0.5, materialRight));
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(arena->acceleration<bvh_node>(world, arena.get()));
 
     camera cam;
     cam.aspectRatio = 16.0/9.0;
@@ -125,19 +140,17 @@ void simple_scene() {
     cam.lookat   = point3(0,0,1.2);
     cam.vup      = vec3(0,1,0);
 
-    cam.render(world, nullptr);
-   
-    std::clog << "\n\rDone done.                                     \n";
-
+    return {arena, world, nullptr, cam};
 }
 
-void extra_simple_scene(){
+scene extra_simple_scene(){
+    auto arena = make_shared<scene_arena>();
     hittable_list world;
     
-    auto mat = make_shared<lambertian>(color(0.0,0.8,0.8));
-    auto singleSphere = make_shared<sphere>(sphere(point3(0,0,1.2), 0.5, mat));
+    auto mat = arena->material<lambertian>(color(0.0,0.8,0.8));
+    auto singleSphere = arena->geometry<sphere>(sphere(point3(0,0,1.2), 0.5, mat));
     world.add(singleSphere);
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(arena->acceleration<bvh_node>(world, arena.get()));
     camera cam;
     cam.aspectRatio = 16.0/9.0;
     cam.imgWidth = 400;
@@ -151,28 +164,29 @@ void extra_simple_scene(){
     cam.lookat   = point3(0,0,1.2);
     cam.vup      = vec3(0,1,0);
 
-    cam.render(world, nullptr);
+    return {arena, world, nullptr, cam};
    
 }
 
-void quad_scene() {
+scene quad_scene() {
+    auto arena = make_shared<scene_arena>();
     hittable_list world;
 
     // Materials
-    auto left_red     = make_shared<lambertian>(color(1.0, 0.2, 0.2));
-    auto back_green   = make_shared<lambertian>(color(0.2, 1.0, 0.2));
-    auto right_blue   = make_shared<lambertian>(color(0.2, 0.2, 1.0));
-    auto upper_orange = make_shared<lambertian>(color(1.0, 0.5, 0.0));
-    auto lower_teal   = make_shared<lambertian>(color(0.2, 0.8, 0.8));
-    auto materialGlass   = make_shared<dielectric>(1.5);
+    auto left_red     = arena->material<lambertian>(color(1.0, 0.2, 0.2));
+    auto back_green   = arena->material<lambertian>(color(0.2, 1.0, 0.2));
+    auto right_blue   = arena->material<lambertian>(color(0.2, 0.2, 1.0));
+    auto upper_orange = arena->material<lambertian>(color(1.0, 0.5, 0.0));
+    auto lower_teal   = arena->material<lambertian>(color(0.2, 0.8, 0.8));
+    auto materialGlass   = arena->material<dielectric>(1.5);
     
     // Quads
-    world.add(make_shared<quad>(point3(-3,-2, 5), vec3(0, 0,-4), vec3(0, 4, 0), left_red));
-    world.add(make_shared<quad>(point3(-2,-2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
-    world.add(make_shared<quad>(point3( 3,-2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
-    world.add(make_shared<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
-    world.add(make_shared<quad>(point3(-2,-3, 5), vec3(4, 0, 0), vec3(0, 0,-4), lower_teal));
-    world.add(make_shared<sphere>(point3(2,0,0), 2, materialGlass));
+    world.add(arena->geometry<quad>(point3(-3,-2, 5), vec3(0, 0,-4), vec3(0, 4, 0), left_red));
+    world.add(arena->geometry<quad>(point3(-2,-2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
+    world.add(arena->geometry<quad>(point3( 3,-2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
+    world.add(arena->geometry<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
+    world.add(arena->geometry<quad>(point3(-2,-3, 5), vec3(4, 0, 0), vec3(0, 0,-4), lower_teal));
+    world.add(arena->geometry<sphere>(point3(2,0,0), 2, materialGlass));
 
     camera cam;
 
@@ -183,14 +197,14 @@ void quad_scene() {
     cam.vertFOV = 80.0;
     cam.defocusAngle = 0;
     
-    auto skybox_tex = make_shared<solid_color_tex>(1.0,1.0,1.0);
+    auto skybox_tex = arena->texture<solid_color_tex>(1.0,1.0,1.0);
 
     cam.skybox = skybox_tex;
     cam.lookfrom = point3(0,0,9);
     cam.lookat   = point3(0,0,0);
     cam.vup      = vec3(0,1,0);
 
-    cam.render(world, nullptr);
+    return {arena, world, nullptr, cam};
     //cam.initialize();
     //ray r = cam.get_ray(200, 200);
     //hit_record hr;
@@ -198,16 +212,17 @@ void quad_scene() {
     //std::clog << "Final Ray color is " << cam.ray_color(r, world, 50) << std::endl; 
 }
 
-void simple_light() {
+scene simple_light() {
+    auto arena = make_shared<scene_arena>();
     hittable_list world;
 
-    auto pertext = make_shared<noise_tex>(4);
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
-    world.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
+    auto pertext = arena->texture<noise_tex>(4);
+    world.add(arena->geometry<sphere>(point3(0,-1000,0), 1000, arena->material<lambertian>(pertext)));
+    world.add(arena->geometry<sphere>(point3(0,2,0), 2, arena->material<lambertian>(pertext)));
 
-    auto difflight = make_shared<emissive_mat>(color(4,4,4));
-        world.add(make_shared<sphere>(point3(0,7,0), 2, difflight));
-    world.add(make_shared<quad>(point3(3,1,-2), vec3(2,0,0), vec3(0,2,0), difflight));
+    auto difflight = arena->material<emissive_mat>(color(4,4,4));
+        world.add(arena->geometry<sphere>(point3(0,7,0), 2, difflight));
+    world.add(arena->geometry<quad>(point3(3,1,-2), vec3(2,0,0), vec3(0,2,0), difflight));
 
     camera cam;
 
@@ -218,7 +233,7 @@ void simple_light() {
     cam.vertFOV     = 20;
     cam.defocusAngle = 0;
     
-    auto skybox_tex = make_shared<solid_color_tex>(0.0,0.0,0.0);
+    auto skybox_tex = arena->texture<solid_color_tex>(0.0,0.0,0.0);
     cam.skybox = skybox_tex;
 
     cam.lookfrom = point3(26,3,6);
@@ -226,30 +241,31 @@ void simple_light() {
     cam.vup      = vec3(0,1,0);
 
 
-    cam.render(world, nullptr);
+    return {arena, world, nullptr, cam};
 }
 
-void cornell_box(){
+scene cornell_box(){
+    auto arena = make_shared<scene_arena>();
     hittable_list world;
 
-    auto red   = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<emissive_mat>(color(15,15,15));
-    auto alluminium = make_shared<metal>(color(1,1,1), 0.0);
+    auto red   = arena->material<lambertian>(color(.65, .05, .05));
+    auto white = arena->material<lambertian>(color(.73, .73, .73));
+    auto green = arena->material<lambertian>(color(.12, .45, .15));
+    auto light = arena->material<emissive_mat>(color(15,15,15));
+    auto alluminium = arena->material<metal>(color(1,1,1), 0.0);
 
-    //world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
-    //world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
-    auto light_hittable = make_shared<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light);
+    //world.add(arena->geometry<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    //world.add(arena->geometry<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    auto light_hittable = arena->geometry<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light);
     world.add(light_hittable);
-    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
-    //world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
-    //world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+    world.add(arena->geometry<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    //world.add(arena->geometry<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    //world.add(arena->geometry<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
 
-    auto box1 = make_shared<box>(point3(130, 0, 65), point3(295, 165, 230), white);
+    auto box1 = arena->geometry<box>(point3(130, 0, 65), point3(295, 165, 230), white);
     box1->rotate(0,-15,0);
     //world.add(box1);
-    auto box2 = make_shared<box>(point3(265, 0, 295), point3(430, 330, 460), alluminium);
+    auto box2 = arena->geometry<box>(point3(265, 0, 295), point3(430, 330, 460), alluminium);
     box2->rotate(0,18,0);
     //world.add(box2);
 
@@ -260,7 +276,7 @@ void cornell_box(){
     cam.samplesPerPixel = 300;
     cam.maxRayBounce         = 25;
 
-    auto skybox_tex = make_shared<solid_color_tex>(0,0,0);
+    auto skybox_tex = arena->texture<solid_color_tex>(0,0,0);
     cam.skybox = skybox_tex;
 
     cam.vertFOV     = 40;
@@ -271,64 +287,35 @@ void cornell_box(){
 
     cam.defocusAngle = 0;
 
-#ifndef SIMPLE_DEBUG
-    cam.render(world, light_hittable);
-    /*cam.initialize();
-    world.commit_transform();
-    ray r = cam.get_ray(300, 100, 8, 8);
-    hit_record hr;
-    
-
-    int rcount = 6000;
-    std::vector<color> v(rcount);
-    for(int i = 0; i < rcount; i++){
-        v[i] = cam.ray_color(r, world, 50, light_hittable);
-        write_vector(std::cout, v[i]);
-    }
-
-    color sum = std::accumulate(v.begin(), v.end(), color(0,0,0));
-    color mean = sum / v.size();
-
-    color sq_sum = std::inner_product(v.begin(), v.end(), v.begin(), color(0,0,0));
-    color stdev2 = sq_sum / v.size() - mean * mean;
-    color stdev = color(std::sqrt(stdev2.x()),std::sqrt(stdev2.y()),std::sqrt(stdev2.z()));
-
-    std::clog << "Got mean " << mean << " and std " << stdev << " giving error margin for 95% " << 4*stdev/(std::sqrt(rcount))*256 << std::endl;*/
-#else
-    cam.initialize();
-    world.commit_transform();
-    ray r = cam.get_ray(300, 100, 8, 8);
-    hit_record hr;
-    std::clog << "Sending Ray " << r << std::endl;
-    std::clog << "Final Ray color is " << cam.ray_color(r, world, 50, light_hittable) << std::endl; 
-#endif
+    return {arena, world, light_hittable, cam};
     
 }
 
 
-void fognell_box(){
+scene fognell_box(){
+    auto arena = make_shared<scene_arena>();
     hittable_list world;
 
-    auto red   = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<emissive_mat>(color(15, 15, 15));
+    auto red   = arena->material<lambertian>(color(.65, .05, .05));
+    auto white = arena->material<lambertian>(color(.73, .73, .73));
+    auto green = arena->material<lambertian>(color(.12, .45, .15));
+    auto light = arena->material<emissive_mat>(color(15, 15, 15));
 
-    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
-    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
-    world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light));
-    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
-    world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
-    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+    world.add(arena->geometry<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(arena->geometry<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(arena->geometry<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light));
+    world.add(arena->geometry<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(arena->geometry<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(arena->geometry<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
 
-    auto box1 = make_shared<box>(point3(130, 0, 65), point3(295, 165, 230), white);
+    auto box1 = arena->geometry<box>(point3(130, 0, 65), point3(295, 165, 230), white, true);
     box1->rotate(0,-15,0);
     
-    auto box2 = make_shared<box>(point3(265, 0, 295), point3(430, 330, 460), white);
+    auto box2 = arena->geometry<box>(point3(265, 0, 295), point3(430, 330, 460), white, true);
     box2->rotate(0,18,0);
     
-    world.add(make_shared<constant_medium>(box1, 0.01, color(0,0,0)));
-    world.add(make_shared<constant_medium>(box2, 0.01, color(1,1,1)));
+    world.add(arena->geometry<constant_medium>(box1, 0.01, arena->material<isotropic>(color(0,0,0))));
+    world.add(arena->geometry<constant_medium>(box2, 0.01, arena->material<isotropic>(color(1,1,1))));
 
     camera cam;
 
@@ -337,7 +324,7 @@ void fognell_box(){
     cam.samplesPerPixel = 200;
     cam.maxRayBounce         = 50;
 
-    auto skybox_tex = make_shared<solid_color_tex>(0.0,0.0,0.0);
+    auto skybox_tex = arena->texture<solid_color_tex>(0.0,0.0,0.0);
     cam.skybox = skybox_tex;
 
     cam.vertFOV     = 40;
@@ -348,7 +335,7 @@ void fognell_box(){
 
     cam.defocusAngle = 0;
 
-    cam.render(world, nullptr);
+    return {arena, world, nullptr, cam};
     /*cam.initialize();
     ray r = cam.get_ray(300, 515);
     hit_record hr;
@@ -358,9 +345,71 @@ void fognell_box(){
 }
 
 
-void final_scene(int image_width, int samples_per_pixel, int max_depth) {
+// grid, when given, replaces the procedural puff
+scene smoke_box(shared_ptr<voxel_grid> grid = nullptr){
+    auto arena = make_shared<scene_arena>();
+    hittable_list world;
+
+    auto red   = arena->material<lambertian>(color(.65, .05, .05));
+    auto white = arena->material<lambertian>(color(.73, .73, .73));
+    auto green = arena->material<lambertian>(color(.12, .45, .15));
+    auto light = arena->material<emissive_mat>(color(7, 7, 7));
+
+    world.add(arena->geometry<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(arena->geometry<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(arena->geometry<quad>(point3(113,554,127), vec3(330,0,0), vec3(0,0,305), light));
+    world.add(arena->geometry<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(arena->geometry<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(arena->geometry<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    // Puff of smoke: turbulence fading out towards the border of the grid
+    if(grid == nullptr){
+        int res = 64;
+        auto puff = arena->geometry<dense_grid>(res, res, res);
+        perlin noise;
+        // A row of voxels at a time through the batch turbulence
+        std::vector<double> xs(res), ys(res), zs(res), falloff(res), turb(res);
+        for(int k = 0; k < res; k++)
+            for(int j = 0; j < res; j++){
+                for(int i = 0; i < res; i++){
+                    vec3 q = (vec3(i, j, k) + vec3(0.5, 0.5, 0.5)) * (2.0/res) - vec3(1, 1, 1);
+                    falloff[i] = std::fmax(0.0, 1.0 - q.length());
+                    xs[i] = q.x()*4; ys[i] = q.y()*4; zs[i] = q.z()*4;
+                }
+                noise.turb(xs.data(), ys.data(), zs.data(), turb.data(), res, 5);
+                for(int i = 0; i < res; i++)
+                    puff->at(i, j, k) = falloff[i] * turb[i];
+            }
+        grid = puff;
+    }
+    world.add(arena->geometry<heterogeneous_medium>(grid, point3(128, 0, 128), point3(428, 350, 428), 0.1, arena->material<isotropic>(color(1,1,1))));
+
+    camera cam;
+
+    cam.aspectRatio      = 1.0;
+    cam.imgWidth       = 600;
+    cam.samplesPerPixel = 200;
+    cam.maxRayBounce         = 50;
+
+    auto skybox_tex = arena->texture<solid_color_tex>(0.0,0.0,0.0);
+    cam.skybox = skybox_tex;
+
+    cam.vertFOV     = 40;
+
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocusAngle = 0;
+
+    return {arena, world, nullptr, cam};
+}
+
+
+scene final_scene(int image_width, int samples_per_pixel, int max_depth) {
+    auto arena = make_shared<scene_arena>();
     hittable_list boxes1;
-    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+    auto ground = arena->material<lambertian>(color(0.48, 0.83, 0.53));
 
     int boxes_per_side = 20;
     for (int i = 0; i < boxes_per_side; i++) {
@@ -373,45 +422,45 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
             auto y1 = randDouble(1,101);
             auto z1 = z0 + w;
 
-            boxes1.add(make_shared<box>(point3(x0,y0,z0), point3(x1,y1,z1), ground));
+            boxes1.add(arena->geometry<box>(point3(x0,y0,z0), point3(x1,y1,z1), ground));
         }
     }
 
     hittable_list world;
 
-    world.add(make_shared<bvh_node>(boxes1));
+    world.add(arena->acceleration<bvh_node>(boxes1, arena.get()));
 
-    auto light = make_shared<emissive_mat>(color(7, 7, 7));
-    world.add(make_shared<quad>(point3(123,554,147), vec3(300,0,0), vec3(0,0,265), light));
+    auto light = arena->material<emissive_mat>(color(7, 7, 7));
+    world.add(arena->geometry<quad>(point3(123,554,147), vec3(300,0,0), vec3(0,0,265), light));
 
     auto center1 = point3(400, 400, 200);
     auto center2 = center1 + vec3(30,0,0);
-    auto sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
-    world.add(make_shared<sphere>(center1, 50, sphere_material));
+    auto sphere_material = arena->material<lambertian>(color(0.7, 0.3, 0.1));
+    world.add(arena->geometry<sphere>(center1, 50, sphere_material));
 
-    world.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-    world.add(make_shared<sphere>(
-        point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
+    world.add(arena->geometry<sphere>(point3(260, 150, 45), 50, arena->material<dielectric>(1.5)));
+    world.add(arena->geometry<sphere>(
+        point3(0, 150, 145), 50, arena->material<metal>(color(0.8, 0.8, 0.9), 1.0)
     ));
 
-    auto boundary = make_shared<sphere>(point3(360,150,145), 70, make_shared<dielectric>(1.5));
+    auto boundary = arena->geometry<sphere>(point3(360,150,145), 70, arena->material<dielectric>(1.5));
     world.add(boundary);
-    world.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-    boundary = make_shared<sphere>(point3(0,0,0), 5000, make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(boundary, .0001, color(1,1,1)));
+    world.add(arena->geometry<constant_medium>(boundary, 0.2, arena->material<isotropic>(color(0.2, 0.4, 0.9))));
+    boundary = arena->geometry<sphere>(point3(0,0,0), 5000, arena->material<dielectric>(1.5));
+    world.add(arena->geometry<constant_medium>(boundary, .0001, arena->material<isotropic>(color(1,1,1))));
 
-    auto emat = make_shared<lambertian>(make_shared<image_tex>("images/earthmap.jpg"));
-    world.add(make_shared<sphere>(point3(400,200,400), 100, emat));
-    auto pertext = make_shared<noise_tex>(0.2);
-    world.add(make_shared<sphere>(point3(220,280,300), 80, make_shared<lambertian>(pertext)));
+    auto emat = arena->material<lambertian>(arena->texture<image_tex>("images/earthmap.jpg"));
+    world.add(arena->geometry<sphere>(point3(400,200,400), 100, emat));
+    auto pertext = arena->texture<noise_tex>(0.2);
+    world.add(arena->geometry<sphere>(point3(220,280,300), 80, arena->material<lambertian>(pertext)));
 
-    hittable_list boxes2;
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto boxes2 = arena->geometry<sphere_set>();
+    auto white = arena->material<lambertian>(color(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0,165) + vec3(-100,270,395), 10, white));
+        boxes2->add(point3::random(0,165) + vec3(-100,270,395), 10, white);
     }
-    world.add(make_shared<bvh_node>(boxes2));
+    world.add(boxes2);
     camera cam;
 
     cam.aspectRatio      = 1.0;
@@ -419,7 +468,7 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     cam.samplesPerPixel = samples_per_pixel;
     cam.maxRayBounce         = max_depth;
     
-    auto skybox = make_shared<solid_color_tex>(color(0,0,0));
+    auto skybox = arena->texture<solid_color_tex>(color(0,0,0));
     cam.skybox        = skybox;
 
     cam.vertFOV     = 40;
@@ -429,18 +478,227 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
 
     cam.defocusAngle = 0;
 
-    cam.render(world, nullptr);
+    return {arena, world, nullptr, cam};
+}
+
+
+
+bool ends_with(const std::string& s, const std::string& suffix){
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Builds the scene called name, with the random generator seeded so worker processes build the same one.
+// A .svt (sparse_grid) or .vol (load_voxel_grid) file name renders that volume in the smoke box.
+bool load_scene(const std::string& name, uint64_t seed, scene& out){
+    seed_random(seed);
+    if(name == "complex") out = complex_scene();
+    else if(name == "simple") out = simple_scene();
+    else if(name == "extra_simple") out = extra_simple_scene();
+    else if(name == "quads") out = quad_scene();
+    else if(name == "simple_light") out = simple_light();
+    else if(name == "cornell") out = cornell_box();
+    else if(name == "fognell") out = fognell_box();
+    else if(name == "smoke") out = smoke_box();
+    else if(name == "final") out = final_scene(800, 10000, 40);
+    else if(ends_with(name, ".svt") || ends_with(name, ".vol")){
+        // Volume files are rendered in the smoke box
+        shared_ptr<voxel_grid> grid;
+        if(ends_with(name, ".svt")) grid = sparse_grid::open(name);
+        else grid = load_voxel_grid(name);
+        if(grid == nullptr) return false;
+        out = smoke_box(grid);
+    }
+    else {
+        std::clog << "Unknown scene " << name << std::endl;
+        return false;
+    }
+    out.cam.seed = seed;
+    out.cam.materials = out.arena->materials();
+    return true;
 }
 
+// PathTracer [scene] [--coordinator <address>] [--workers <n>]
+//     renders the scene (cornell by default, or a .svt/.vol volume file), with --coordinator the tiles
+//     are rendered by the workers
+//     connecting to address and n workers forked from this process
+// PathTracer --worker <address> [--workers <n>]
+//     runs n worker processes (1 by default) for the coordinator at address
+// PathTracer [scene] --serve unix:<path>
+//     keeps the scene loaded and renders the jobs sent to the local socket, see render_daemon
+// PathTracer [scene] --turntable <n> <pattern>
+//     renders n views around the scene's camera target, to the files named by the printf pattern
+// PathTracer [scene] --preview <name>
+//     renders progressively, publishing every pass to the shared memory framebuffer /dev/shm/<name>
+// PathTracer --submit <address> <key=value>...
+//     sends a job to the daemon at address and prints its answer
+// PathTracer --to-svt <in.vol> <out.svt>
+//     converts a PTVOL voxel grid (see load_voxel_grid) to a sparse grid file, rendered by streaming it
+// --guide learns where the light comes from while rendering and samples directions toward it, only
+// when path tracing and not with --coordinator or --turntable
+// --bdpt renders with bidirectional path tracing instead of path tracing, not with --coordinator
+// --wavefront path traces the samples of each tile together, bounce by bounce, not with --coordinator
+// --photons adds the caustics from a photon map to path tracing, --ppm from a new map for every
+// sample with a shrinking radius (progressive photon mapping), not with --coordinator
+// --sampler sobol|zsobol|independent picks the camera's sampler (sobol by default), not with --coordinator
+// --filter box|gaussian|mitchell picks the pixel reconstruction filter, not with --coordinator
+// --denoise denoises the image, guided by its AOVs
+// --aov <prefix> writes the AOVs to <prefix>_albedo.pfm, _normal.pfm, _depth.pfm and _variance.pfm,
+// the turntable's frame f to <prefix>_<f>_albedo.pfm and so on
+// --pin pins the render threads to CPUs spread over the NUMA nodes
+// Addresses are unix:<path> or tcp:<host>:<port>
+int main(int argc, char** argv){
+    std::string sceneName = "cornell", coordinator, worker, serve, submit, job, preview;
+    std::string turntablePattern, svtIn, svtOut;
+    int workers = -1, turntableFrames = 0;
+    bool pinThreads = false, guide = false, denoise = false;
+    std::string integratorFlag, samplerName, filterName, aovPrefix;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg == "--coordinator" && i+1 < argc) coordinator = argv[++i];
+        else if(arg == "--worker" && i+1 < argc) worker = argv[++i];
+        else if(arg == "--workers" && i+1 < argc) workers = std::atoi(argv[++i]);
+        else if(arg == "--serve" && i+1 < argc) serve = argv[++i];
+        else if(arg == "--preview" && i+1 < argc) preview = argv[++i];
+        else if(arg == "--pin") pinThreads = true;
+        else if(arg == "--guide") guide = true;
+        else if(arg == "--sampler" && i+1 < argc) samplerName = argv[++i];
+        else if(arg == "--filter" && i+1 < argc) filterName = argv[++i];
+        else if(arg == "--denoise") denoise = true;
+        else if(arg == "--aov" && i+1 < argc) aovPrefix = argv[++i];
+        else if(arg == "--bdpt" || arg == "--wavefront" || arg == "--photons" || arg == "--ppm") integratorFlag = arg;
+        else if(arg == "--turntable" && i+2 < argc){
+            turntableFrames = std::atoi(argv[++i]);
+            turntablePattern = argv[++i];
+        }
+        else if(arg == "--to-svt" && i+2 < argc){
+            svtIn = argv[++i];
+            svtOut = argv[++i];
+        }
+        else if(arg == "--submit" && i+1 < argc) submit = argv[++i];
+        else if(!submit.empty()) job += (job.empty() ? "" : " ") + arg;
+        else sceneName = arg;
+    }
+
+    if(!svtIn.empty()){
+        shared_ptr<dense_grid> grid = load_voxel_grid(svtIn);
+        return grid != nullptr && sparse_grid::write(*grid, svtOut) ? 0 : 1;
+    }
 
+    if(!submit.empty()){
+        std::string reply = render_daemon::submit(submit, job);
+        std::cout << reply << std::endl;
+        return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+    }
+
+    if(!worker.empty()){
+        std::vector<pid_t> children;
+        for(int i = 1; i < workers; i++){
+            pid_t pid = fork();
+            if(pid == 0) return dist::run_worker(worker, load_scene) ? 0 : 1;
+            if(pid > 0) children.push_back(pid);
+        }
+        bool ok = dist::run_worker(worker, load_scene);
+        for(pid_t pid : children)
+            waitpid(pid, nullptr, 0);
+        return ok ? 0 : 1;
+    }
 
-int main(){
-    srand(time(NULL));
     prfl::create_profile(WHOLE_EXEC, "runtime");
     prfl::start_profiling_segment(WHOLE_EXEC);
-    
-    cornell_box();
-    //final_scene(800, 10000, 40);
+
+    scene scn;
+    if(!load_scene(sceneName, uint64_t(time(NULL)), scn))
+        return 1;
+    scn.arena->report();
+    scn.cam.pinThreads = pinThreads;
+    if(denoise)
+        scn.cam.denoise = true;
+    if(!aovPrefix.empty())
+        scn.cam.aovPrefix = aovPrefix;
+    if(!samplerName.empty()){
+        // The workers sample with their scene's camera
+        if(!coordinator.empty()){
+            std::clog << "--sampler can't be used with --coordinator" << std::endl;
+            return 1;
+        }
+        scn.cam.pixelSampler = make_sampler(samplerName);
+        if(scn.cam.pixelSampler == nullptr){
+            std::clog << "Unknown sampler " << samplerName << ", expected sobol, zsobol or independent" << std::endl;
+            return 1;
+        }
+    }
+    if(!filterName.empty()){
+        // The workers splat their samples with their scene's filter
+        if(!coordinator.empty()){
+            std::clog << "--filter can't be used with --coordinator" << std::endl;
+            return 1;
+        }
+        scn.cam.pixelFilter = make_filter(filterName);
+        if(scn.cam.pixelFilter == nullptr){
+            std::clog << "Unknown filter " << filterName << ", expected box, gaussian or mitchell" << std::endl;
+            return 1;
+        }
+    }
+    if(guide){
+        // Only ray_color follows the guide, and it is learned within one render of this process
+        std::string other = !integratorFlag.empty() ? integratorFlag : !coordinator.empty() ? "--coordinator"
+                          : turntableFrames > 0 ? "--turntable" : "";
+        if(!other.empty()){
+            std::clog << "--guide can't be used with " << other << std::endl;
+            return 1;
+        }
+        scn.cam.guide = make_shared<path_guide>();
+    }
+    if(!integratorFlag.empty()){
+        // The workers build their own camera and only path trace
+        if(!coordinator.empty()){
+            std::clog << integratorFlag << " can't be used with --coordinator" << std::endl;
+            return 1;
+        }
+        if(integratorFlag == "--bdpt"){
+            scn.cam.radianceIntegrator = make_shared<bdpt_integrator>();
+        } else if(integratorFlag == "--wavefront"){
+            scn.cam.radianceIntegrator = make_shared<wavefront_integrator>();
+        } else {
+            auto photons = make_shared<photon_mapper>();
+            photons->progressive = integratorFlag == "--ppm";
+            scn.cam.radianceIntegrator = photons;
+        }
+    }
+
+#ifndef SIMPLE_DEBUG
+    if(!serve.empty()){
+        render_daemon daemon;
+        daemon.address = serve;
+        if(!daemon.serve(scn))
+            return 1;
+    } else if(turntableFrames > 0){
+        std::vector<batch_frame> frames = turntable(scn.cam, turntableFrames, turntablePattern);
+        if(!render_batch(scn.world, scn.lights, frames))
+            return 1;
+    } else if(!preview.empty()){
+        scn.cam.initialize();
+        shm_framebuffer fb;
+        if(!fb.create(preview, scn.cam.imgWidth, scn.cam.image_height()))
+            return 1;
+        render_progressive(scn.world, scn.lights, scn.cam, fb);
+    } else if(!coordinator.empty()){
+        dist::render_coordinator coord;
+        coord.address = coordinator;
+        coord.localWorkers = workers >= 0 ? workers : omp_get_max_threads();
+        if(!coord.render(scn, sceneName))
+            return 1;
+    } else {
+        scn.cam.render(scn.world, scn.lights);
+    }
+#else
+    scn.cam.initialize();
+    scn.world.commit_transform();
+    independent_sampler smp;
+    ray r = scn.cam.get_ray(300, 100, smp);
+    std::clog << "Sending Ray " << r << std::endl;
+    std::clog << "Final Ray color is " << scn.cam.ray_color(r, scn.world, 50, scn.lights, smp) << std::endl;
+#endif
     prfl::end_profiling_segment(WHOLE_EXEC);
     prfl::print_full_profiler_info();
-}
\ No newline at end of file
+}
@@ -5,9 +5,10 @@ void write_color(std::ostream& out, const color& c){
     double g = linear_to_gamma(c.y());
     double b = linear_to_gamma(c.z());
 
-    int ir = int(255.999 * r);
-    int ig = int(255.999 * g);
-    int ib = int(255.999 * b);
+    // Values above 1 would overflow the 255 max value of the PPM
+    int ir = int(255.999 * std::fmin(r, 1.0));
+    int ig = int(255.999 * std::fmin(g, 1.0));
+    int ib = int(255.999 * std::fmin(b, 1.0));
 
     out << ir << ' ' << ig << ' ' << ib << '\n';
 }
\ No newline at end of file